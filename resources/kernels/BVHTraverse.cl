@@ -1,93 +1,128 @@
 #include "resources/kernels/KernelStructs.h"
 #include "resources/kernels/Intersections.h"
+#include "resources/kernels/Instances.h"
 
+// Host sizes stack from deepest path of world tree, so it never overflows
+#ifndef STACK_SIZE
 #define STACK_SIZE 64
+#endif
 
 kernel void Traverse(
     global struct Resources * resources,
     global struct Ray * rays,
     global struct Sample * samples,
-    global float3 * normals
+    global float3 * normals,
+    global const uint * activePixels,
+    const uint numActive
     ){
 
     local struct Resources localResources;
 
     localResources = *resources;
 
-    global const struct BoundingBox * boxes = localResources.boxes;
+    global const struct BVHNode * nodes = localResources.nodes;
     global const struct Object * objects = localResources.objects;
+    global const struct Instance * instances = localResources.instances;
 
-    int gx = get_global_id(0);
-    int gy = get_global_id(1);
-
-    int width = get_global_size(0);
-
-    int globalIndex = gy * width + gx;
-
-    int lx = get_local_id(0);
-    int ly = get_local_id(1);
-
-    int lwidth = get_local_size(0);
+    if( get_global_id(0) >= numActive )
+        return;
 
-    int localIndex = ly * lwidth + lx;
+    int globalIndex = activePixels[ get_global_id(0) ];
 
     struct Ray ray = rays[globalIndex];
 
     struct Sample sample = {0};
     sample.objectID = -1;
+    sample.instanceID = -1;
 
     float minLength = INFINITY;
     float length = -1.0f;
 
-    int stack[ STACK_SIZE ] = {};
+    float3 inverseDirection = InverseDirection(ray.direction);
+    int3 octant = isless(ray.direction, (float3)(0.0f));
+
+    int stack[ STACK_SIZE ];
+    float entries[ STACK_SIZE ];
     int top = 0;
 
-    stack[top++] = 0;
+    stack[top] = 0;
+    entries[top++] = 0.0f;
 
     while ( top > 0 ) {
 
-        int boxID = stack[--top];
-        struct BoundingBox box = boxes[ boxID ];
+        --top;
 
-        int leftChildIndex = box.leftID;
-        int rightChildIndex = box.rightID;
+        if( entries[top] >= minLength )
+            continue;
 
-        if ( box.objectID >= 0 ) {
+        int nodeID = stack[top];
+        struct BVHNode node = nodes[ nodeID ];
 
-            struct Object object = objects[ box.objectID ];
+        if ( node.primitiveCount > 0 ) {
 
-            if ( object.type == TRIANGLE ){
-                length = IntersectTriangle(&ray, &object);
-            }else{
-                length = IntersectSphere(&ray, &object);
-            }
+            // Objects of a leaf are stored consecutively
+            for(int objectID = node.offset; objectID < node.offset + node.primitiveCount; ++objectID){
 
-            if( (length < minLength) && (length > 0.01f) ){
+                struct Object object = objects[ objectID ];
 
-                minLength = length;
-                sample.point = ray.origin + ray.direction * length;
-                sample.objectID = box.objectID;
+                if ( object.type == INSTANCE ){
 
-            }
+                    int meshObjectID = IntersectInstance(nodes, objects, instances + object.instanceID, &ray, &minLength);
+
+                    if( meshObjectID != -1 ){
+                        sample.point = ray.origin + ray.direction * minLength;
+                        sample.objectID = meshObjectID;
+                        sample.instanceID = object.instanceID;
+                    }
 
-        } else {
+                    continue;
+                }
 
-            if( leftChildIndex > 0){
-                struct BoundingBox left = boxes[ leftChildIndex ];
+                if ( object.type == TRIANGLE ){
+                    length = IntersectTriangle(&ray, &object);
+                }else{
+                    length = IntersectSphere(&ray, &object);
+                }
 
-                if( AABBIntersection(&ray, left.minimalPosition, left.maximalPosition) )
-                    stack[top++] = leftChildIndex;
+                if( (length < minLength) && (length > 0.01f) ){
 
+                    minLength = length;
+                    sample.point = ray.origin + ray.direction * length;
+                    sample.objectID = objectID;
+                    sample.instanceID = -1;
+
+                }
             }
 
-            if( rightChildIndex > 0){
+            continue;
+        }
 
-                struct BoundingBox right = boxes[ rightChildIndex ];
+        // First child directly follows its parent
+        int nearID = nodeID + 1;
+        int farID = node.offset;
 
-                if( AABBIntersection(&ray, right.minimalPosition, right.maximalPosition) )
-                    stack[top++] = rightChildIndex;
-            }
+        float nearEntry = NodeIntersection(&ray, inverseDirection, octant, nodes + nearID);
+        float farEntry = NodeIntersection(&ray, inverseDirection, octant, nodes + farID);
+
+        if( farEntry < nearEntry ){
+
+            int tempID = nearID;
+            nearID = farID;
+            farID = tempID;
+
+            float tempEntry = nearEntry;
+            nearEntry = farEntry;
+            farEntry = tempEntry;
+        }
 
+        if( farEntry < minLength ){
+            stack[top] = farID;
+            entries[top++] = farEntry;
+        }
+
+        if( nearEntry < minLength ){
+            stack[top] = nearID;
+            entries[top++] = nearEntry;
         }
 
     }
@@ -99,9 +134,12 @@ kernel void Traverse(
 
     struct Object object = objects[ sample.objectID ];
 
+    // Triangles of instanced meshes are stored in mesh space
+    float3 point = sample.instanceID < 0 ? sample.point : PointToInstance(instances + sample.instanceID, sample.point);
+
     if ( object.type == SPHERE){
 
-        normals[globalIndex] = normalize( sample.point - object.position);
+        normals[globalIndex] = normalize( point - object.position);
 
     }else if( object.type == TRIANGLE ){
 
@@ -111,7 +149,7 @@ kernel void Traverse(
 
         float3 v0 = (B - A);
         float3 v1 = (C - A);
-        float3 v2 = sample.point - A;
+        float3 v2 = point - A;
 
         float dot00 = dot(v0, v0);
         float dot01 = dot(v0, v1);
@@ -124,6 +162,11 @@ kernel void Traverse(
         float v = (dot00 * dot12 - dot01 * dot02) * invDenom;
         float w = 1.0f - u - v;
 
-        normals[globalIndex] = normalize(object.normalA * w + object.normalB * u + object.normalC * v);
+        float3 normal = object.normalA * w + object.normalB * u + object.normalC * v;
+
+        if( sample.instanceID >= 0 )
+            normal = NormalToWorld(instances + sample.instanceID, normal);
+
+        normals[globalIndex] = normalize(normal);
     }
 }
@@ -1,14 +1,9 @@
 #include "resources/kernels/KernelStructs.h"
+#include "resources/kernels/Sampler.h"
 
-float Rand(uint * seed){
-    *seed = *seed * 747796405u + 2891336453u;
-    uint word = ((*seed >> ((*seed >> 28u) + 4u)) ^ *seed) * 277803737u;
-    return ((word>>22u) ^ word)/(float)UINT_MAX;
-}
-
-float3 RandomDirection(uint * seed){
-    float latitude = ( 2.0f * Rand(seed) - 1.0f ) * M_PI_F;
-    float longitude = Rand(seed) * M_PI_F;
+float3 RandomDirection(struct Sampler * sampler){
+    float latitude = ( 2.0f * Next(sampler) - 1.0f ) * M_PI_F;
+    float longitude = Next(sampler) * M_PI_F;
 
     float cosLatitude = cos(latitude);
 
@@ -27,23 +22,29 @@ kernel void CastRays(
     global float * depth,
     global float4 * normals,
     const struct Camera camera,
-    const int numFrames
+    const int numFrames,
+    global const uint * activePixels,
+    const uint numActive,
+    const int samplerType
     ){
 
     local struct Resources localResources;
 
     localResources = *resources;
 
-    uint x = get_global_id(0);
-    uint y = get_global_id(1);
+    if( get_global_id(0) >= numActive )
+        return;
 
     uint width = localResources.width;
     uint height = localResources.height;
 
-    uint index = y * width + x;
-    uint seed = (numFrames<<16) ^ (numFrames >>13) + index;
+    uint index = activePixels[ get_global_id(0) ];
+
+    uint x = index % width;
+    uint y = index / width;
+    struct Sampler sampler = CreateSampler(samplerType, index, numFrames);
 
-    float3 offset = RandomDirection(&seed);
+    float3 offset = RandomDirection(&sampler);
 
     float tanHalfFOV = tan(radians(camera.fov) * 0.5f);
     float pixelXPos = (2.0f * (x + offset.x) / width - 1.0f) * camera.aspectRatio;
@@ -0,0 +1,36 @@
+#include "resources/kernels/KernelStructs.h"
+
+kernel void CompactPixels(
+    global const struct PixelStatistics * statistics,
+    global uint * activePixels,
+    global uint * numActive,
+    const int numFrames
+    ){
+
+    local uint groupCount;
+    local uint groupOffset;
+
+    uint index = get_global_id(1) * get_global_size(0) + get_global_id(0);
+    bool leader = get_local_id(0) == 0 && get_local_id(1) == 0;
+
+    if( leader )
+        groupCount = 0;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    bool active = numFrames == 0 || !statistics[index].converged;
+    uint slot = 0;
+
+    if( active )
+        slot = atomic_inc(&groupCount);
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if( leader )
+        groupOffset = atomic_add(numActive, groupCount);
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if( active )
+        activePixels[groupOffset + slot] = index;
+}
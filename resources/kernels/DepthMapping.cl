@@ -5,16 +5,18 @@ kernel void DepthMapping(
     global struct Resources * resources,
     global struct Ray * rays,
     global struct Sample * samples,
-    global float * depth
+    global float * depth,
+    global const uint * activePixels,
+    const uint numActive
     ){
 
     local struct Resources localResources;
     localResources = *resources;
 
-    uint x = get_global_id(0);
-    uint y = get_global_id(1);
+    if( get_global_id(0) >= numActive )
+        return;
 
-    uint index = y * localResources.width + x;
+    uint index = activePixels[ get_global_id(0) ];
 
     struct Sample sample = samples[index];
 
@@ -1,6 +1,8 @@
 #include "resources/kernels/KernelStructs.h"
 
 #define BATCH_SIZE 32
+#define CONVERGENCE_MIN_SAMPLES 16
+#define CONVERGENCE_FLOOR 0.01f
 
 void kernel ImageCorrection(
     write_only image2d_t image,
@@ -10,7 +12,9 @@ void kernel ImageCorrection(
     const int numFrames,
     const float gamma,
     global float * depth,
-    global float3 * normals
+    global float3 * normals,
+    global struct PixelStatistics * statistics,
+    const float threshold
     ){
 
     local struct Resources localResources;
@@ -23,11 +27,34 @@ void kernel ImageCorrection(
     int width = get_global_size(0);
     int globalIndex = coord.y * width + coord.x;
 
-    float scale = 1.0f / (1.0f + numFrames);
+    struct PixelStatistics pixel = statistics[globalIndex];
+
+    if( numFrames == 0 )
+        pixel = (struct PixelStatistics){0};
 
     float4 color = colors[globalIndex];
-    color = mix(color, accumulator[globalIndex], scale);
-    colors[globalIndex] = color;
+
+    if( !pixel.converged ){
+
+        float4 colorSample = accumulator[globalIndex];
+
+        pixel.numSamples++;
+        color = mix(color, colorSample, 1.0f / pixel.numSamples);
+        colors[globalIndex] = color;
+
+        float luminance = dot(colorSample.xyz, (float3)(0.2126f, 0.7152f, 0.0722f));
+        float delta = luminance - pixel.mean;
+
+        pixel.mean += delta / pixel.numSamples;
+        pixel.deviation += delta * (luminance - pixel.mean);
+
+        if( threshold > 0.0f && pixel.numSamples >= CONVERGENCE_MIN_SAMPLES ){
+            float error = sqrt(pixel.deviation / ((pixel.numSamples - 1.0f) * pixel.numSamples));
+            pixel.converged = error <= threshold * fmax(pixel.mean, CONVERGENCE_FLOOR);
+        }
+
+        statistics[globalIndex] = pixel;
+    }
 
     write_imagef(image, coord, color);
 }
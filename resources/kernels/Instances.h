@@ -0,0 +1,173 @@
+#ifndef INSTANCES_H
+#define INSTANCES_H
+
+#include "resources/kernels/KernelStructs.h"
+#include "resources/kernels/Intersections.h"
+
+// Deepest tree of instanced meshes decides size, defined by host
+#ifndef INSTANCE_STACK_SIZE
+#define INSTANCE_STACK_SIZE 64
+#endif
+
+float3 TransformRows(global const float4 * rows, const float3 vector, const float w){
+
+    float4 extended = (float4)(vector, w);
+
+    return (float3)(dot(rows[0], extended), dot(rows[1], extended), dot(rows[2], extended));
+}
+
+float3 PointToInstance(global const struct Instance * instance, const float3 point){
+    return TransformRows(instance->toInstance, point, 1.0f);
+}
+
+float3 NormalToWorld(global const struct Instance * instance, const float3 normal){
+
+    global const float4 * rows = instance->toInstance;
+
+    return rows[0].xyz * normal.x + rows[1].xyz * normal.y + rows[2].xyz * normal.z;
+}
+
+// Local direction is left unnormalized, so hit lengths stay comparable with world ones
+struct Ray RayToInstance(global const struct Instance * instance, const struct Ray * ray){
+
+    struct Ray localRay;
+    localRay.origin = TransformRows(instance->toInstance, ray->origin, 1.0f);
+    localRay.direction = TransformRows(instance->toInstance, ray->direction, 0.0f);
+
+    return localRay;
+}
+
+// Returns closest triangle of mesh placed by instance, -1 when none lies closer than minLength
+int IntersectInstance(
+    global const struct BVHNode * nodes,
+    global const struct Object * objects,
+    global const struct Instance * instance,
+    const struct Ray * worldRay,
+    float * minLength
+    ){
+
+    struct Ray ray = RayToInstance(instance, worldRay);
+
+    float3 inverseDirection = InverseDirection(ray.direction);
+    int3 octant = isless(ray.direction, (float3)(0.0f));
+
+    int stack[ INSTANCE_STACK_SIZE ];
+    float entries[ INSTANCE_STACK_SIZE ];
+    int top = 0;
+
+    stack[top] = instance->rootNode;
+    entries[top++] = NodeIntersection(&ray, inverseDirection, octant, nodes + instance->rootNode);
+
+    int hitID = -1;
+
+    while ( top > 0 ) {
+
+        --top;
+
+        if( entries[top] >= *minLength )
+            continue;
+
+        int nodeID = stack[top];
+        struct BVHNode node = nodes[ nodeID ];
+
+        if ( node.primitiveCount > 0 ) {
+
+            // Meshes hold only triangles
+            for(int objectID = node.offset; objectID < node.offset + node.primitiveCount; ++objectID){
+
+                struct Object object = objects[ objectID ];
+                float length = IntersectTriangle(&ray, &object);
+
+                if( (length < *minLength) && (length > 0.01f) ){
+                    *minLength = length;
+                    hitID = objectID;
+                }
+            }
+
+            continue;
+        }
+
+        int nearID = nodeID + 1;
+        int farID = node.offset;
+
+        float nearEntry = NodeIntersection(&ray, inverseDirection, octant, nodes + nearID);
+        float farEntry = NodeIntersection(&ray, inverseDirection, octant, nodes + farID);
+
+        if( farEntry < nearEntry ){
+
+            int tempID = nearID;
+            nearID = farID;
+            farID = tempID;
+
+            float tempEntry = nearEntry;
+            nearEntry = farEntry;
+            farEntry = tempEntry;
+        }
+
+        if( farEntry < *minLength ){
+            stack[top] = farID;
+            entries[top++] = farEntry;
+        }
+
+        if( nearEntry < *minLength ){
+            stack[top] = nearID;
+            entries[top++] = nearEntry;
+        }
+
+    }
+
+    return hitID;
+}
+
+// Same as IntersectInstance, but walks linked nodes of mesh tree without a stack
+int IntersectInstanceStackless(
+    global const struct BVHNode * nodes,
+    global const struct Object * objects,
+    global const struct Instance * instance,
+    const struct Ray * worldRay,
+    float * minLength
+    ){
+
+    struct Ray ray = RayToInstance(instance, worldRay);
+
+    float3 inverseDirection = InverseDirection(ray.direction);
+    int3 octant = isless(ray.direction, (float3)(0.0f));
+
+    int nodeID = instance->rootNode;
+    int lastNode = instance->rootNode + instance->numNodes;
+
+    int hitID = -1;
+
+    // Escape links of mesh tree never point past its range
+    while ( nodeID < lastNode ) {
+
+        struct BVHNode node = nodes[ nodeID ];
+        bool isLeaf = node.primitiveCount > 0;
+
+        if( NodeIntersection(&ray, inverseDirection, octant, nodes + nodeID) >= *minLength ){
+            nodeID = isLeaf ? nodeID + 1 : node.offset;
+            continue;
+        }
+
+        if ( isLeaf ) {
+
+            for(int objectID = node.offset; objectID < node.offset + node.primitiveCount; ++objectID){
+
+                struct Object object = objects[ objectID ];
+                float length = IntersectTriangle(&ray, &object);
+
+                if( (length < *minLength) && (length > 0.01f) ){
+                    *minLength = length;
+                    hitID = objectID;
+                }
+            }
+
+        }
+
+        ++nodeID;
+    }
+
+    return hitID;
+}
+
+#endif
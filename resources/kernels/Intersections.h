@@ -4,6 +4,7 @@
 #include "resources/kernels/KernelStructs.h"
 
 #define EPSILON 1.000001f
+#define RECIPROCAL_EPSILON 1e-8f
 
 #define PI 3.1415626535f
 #define TWO_PI 2.0f * PI
@@ -58,20 +59,47 @@ float IntersectTriangle(const struct Ray * ray, const struct Object * object) {
     return t;
 }
 
-bool AABBIntersection(const struct Ray * ray, const float3 minimalPosition , const float3 maximalPosition){
+float3 InverseDirection(const float3 direction){
 
-    float3 invDirection = 1.0f / ray->direction;
+    float3 epsilon = (float3)(RECIPROCAL_EPSILON);
+    float3 safeDirection = select(direction, copysign(epsilon, direction), isless(fabs(direction), epsilon));
 
-    float3 tMin = (minimalPosition - ray->origin) * invDirection;
-    float3 tMax = (maximalPosition - ray->origin) * invDirection;
+    return 1.0f / safeDirection;
+}
+
+float AABBIntersection(const struct Ray * ray, const float3 inverseDirection, const int3 octant, const float3 minimalPosition , const float3 maximalPosition){
+
+    float3 nearPlane = select(minimalPosition, maximalPosition, octant);
+    float3 farPlane = select(maximalPosition, minimalPosition, octant);
+
+    float3 tMin = (nearPlane - ray->origin) * inverseDirection;
+    float3 tMax = (farPlane - ray->origin) * inverseDirection;
+
+    float tNear = fmax(tMin.x, fmax(tMin.y, tMin.z));
+    float tFar = fmin(tMax.x, fmin(tMax.y, tMax.z));
+
+    if( tNear > tFar || tFar < 0.0f )
+        return INFINITY;
+
+    return tNear;
+}
+
+float NodeIntersection(const struct Ray * ray, const float3 inverseDirection, const int3 octant, global const struct BVHNode * node){
+    return AABBIntersection(ray, inverseDirection, octant, vload3(0, node->minimalPosition), vload3(0, node->maximalPosition));
+}
+
+// Grid step 2^exponent built directly from float exponent bits
+float3 QuantizedScale(global const struct QuantizedNode * node){
+    int3 exponents = (int3)(node->exponents[0], node->exponents[1], node->exponents[2]);
+    return as_float3((exponents + 127) << 23);
+}
 
-    float3 t1 = fmin(tMin, tMax);
-    float3 t2 = fmax(tMin, tMax);
+float QuantizedChildIntersection(const struct Ray * ray, const float3 inverseDirection, const int3 octant, global const struct QuantizedNode * node, const float3 origin, const float3 scale, const int slot){
 
-    float tNear = fmax(t1.x, fmax(t1.y, t1.z));
-    float tFar = fmin(t2.x, fmin(t2.y, t2.z));
+    float3 minimal = convert_float3((uchar3)(node->minimal[0][slot], node->minimal[1][slot], node->minimal[2][slot]));
+    float3 maximal = convert_float3((uchar3)(node->maximal[0][slot], node->maximal[1][slot], node->maximal[2][slot]));
 
-    return tNear <= tFar && tFar >= 0.0f;
+    return AABBIntersection(ray, inverseDirection, octant, origin + minimal * scale, origin + maximal * scale);
 }
 
 #endif
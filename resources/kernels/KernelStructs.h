@@ -33,7 +33,8 @@ enum SpatialType{
     PLANE,
     DISK,
     CUBE,
-    TRIANGLE
+    TRIANGLE,
+    INSTANCE
 } __attribute((aligned(1)));
 
 struct Ray{
@@ -55,12 +56,14 @@ struct Object{
     float3 uvB;
     float3 uvC;
     int materialID;
+    int instanceID;
 } __attribute((aligned(256)));
 
 struct Sample{
     float3 point;
     float len;
     int objectID;
+    int instanceID;
 } __attribute((aligned(32)));
 
 struct Camera{
@@ -81,16 +84,54 @@ struct Camera{
 
 };
 
-struct BoundingBox{
-    int objectID;
+struct BVHNode{
+    float minimalPosition[3];
+
+    // Leaf: first object of its range, inner node: index of second child
+    int offset;
+
+    float maximalPosition[3];
+
+    // Number of objects in leaf, zero for inner nodes
+    int primitiveCount;
+} __attribute((aligned(32)));
+
+#define QUANTIZED_NODE_WIDTH 8
+
+// Node of collapsed BVH, bounds of its children decode as origin + offset * 2^exponent
+struct QuantizedNode{
+    float origin[3];
+    char exponents[3];
+    uchar numChildren;
 
-    int parentID;
-    int leftID;
-    int rightID;
+    uchar minimal[3][QUANTIZED_NODE_WIDTH];
+    uchar maximal[3][QUANTIZED_NODE_WIDTH];
 
-    float3 minimalPosition;
-    float3 maximalPosition;
-} __attribute((aligned(64)));
+    // Leaf child: first object of its range, inner child: index of quantized node
+    int children[QUANTIZED_NODE_WIDTH];
+
+    // Number of objects in leaf child, zero for inner children
+    uchar primitiveCounts[QUANTIZED_NODE_WIDTH];
+} __attribute((aligned(8)));
+
+// Placement of mesh in world, rows hold translation in w
+struct Instance{
+    float4 toWorld[3];
+    float4 toInstance[3];
+
+    int meshID;
+
+    // Range of nodes of mesh tree
+    int rootNode;
+    int numNodes;
+} __attribute((aligned(16)));
+
+struct PixelStatistics{
+    float mean;
+    float deviation;
+    uint numSamples;
+    int converged;
+} __attribute((aligned(16)));
 
 struct Resources{
     global const struct Object * objects;
@@ -99,13 +140,17 @@ struct Resources{
     global const struct Texture * textureInfo;
     global const unsigned int * textureData;
 
-    global const struct BoundingBox * boxes;
+    global const struct BVHNode * nodes;
+    global const struct QuantizedNode * quantizedNodes;
+    global const struct Instance * instances;
 
     int width;
     int height;
 
     int numObject;
     int numMaterials;
-} __attribute((aligned(64)));
+    // Nodes of world tree, nodes of mesh trees follow them
+    int numNodes;
+} __attribute((aligned(128)));
 
 #endif
@@ -5,19 +5,18 @@ kernel void Traverse(
     global struct Resources * resources,
     global struct Ray * rays,
     global struct Sample * samples,
-    global float3 * normals
+    global float3 * normals,
+    global const uint * activePixels,
+    const uint numActive
     ){
 
     local struct Resources localResources;
     localResources = *resources;
 
-    uint gx = get_global_id(0);
-    uint gy = get_global_id(1);
-
-    uint width = get_global_size(0);
-    uint height = get_global_size(1);
+    if( get_global_id(0) >= numActive )
+        return;
 
-    uint globalIndex = gy * width + gx;
+    uint globalIndex = activePixels[ get_global_id(0) ];
 
     struct Ray ray = rays[globalIndex];
 
@@ -26,6 +25,7 @@ kernel void Traverse(
 
     struct Sample sample = {0};
     sample.objectID = -1;
+    sample.instanceID = -1;
     float minLength = INFINITY;
     float length = -1.0f;
 
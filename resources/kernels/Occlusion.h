@@ -0,0 +1,211 @@
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include "resources/kernels/KernelStructs.h"
+#include "resources/kernels/Intersections.h"
+#include "resources/kernels/Instances.h"
+
+// Shadow rays walk same trees as traversal kernels, host passes same worst case sizes
+#ifndef OCCLUSION_STACK_SIZE
+#define OCCLUSION_STACK_SIZE 64
+#endif
+
+#ifndef QUANTIZED_OCCLUSION_STACK_SIZE
+#define QUANTIZED_OCCLUSION_STACK_SIZE 96
+#endif
+
+#define STACK_TRAVERSAL 1
+#define STACKLESS_TRAVERSAL 2
+#define QUANTIZED_TRAVERSAL 3
+
+float IntersectObject(const struct Ray * ray, const struct Object * object){
+
+    if ( object->type == TRIANGLE )
+        return IntersectTriangle(ray, object);
+
+    return IntersectSphere(ray, object);
+}
+
+bool LinearOcclusion(const struct Resources resources, const struct Ray * ray, const float maxLength){
+
+    for (int id = 0; id < resources.numObject; ++id) {
+
+        struct Object object = resources.objects[id];
+        float length = IntersectObject(ray, &object);
+
+        if( (length < maxLength) && (length > 0.01f) )
+            return true;
+    }
+
+    return false;
+}
+
+bool BVHOcclusion(const struct Resources resources, const struct Ray * ray, const float maxLength){
+
+    global const struct BVHNode * nodes = resources.nodes;
+
+    float3 inverseDirection = InverseDirection(ray->direction);
+    int3 octant = isless(ray->direction, (float3)(0.0f));
+
+    int stack[ OCCLUSION_STACK_SIZE ];
+    int top = 0;
+
+    stack[top++] = 0;
+
+    while ( top > 0 ) {
+
+        int nodeID = stack[--top];
+        struct BVHNode node = nodes[ nodeID ];
+
+        if ( node.primitiveCount > 0 ) {
+
+            for(int objectID = node.offset; objectID < node.offset + node.primitiveCount; ++objectID){
+
+                struct Object object = resources.objects[ objectID ];
+
+                if ( object.type == INSTANCE ){
+
+                    float length = maxLength;
+
+                    if( IntersectInstance(nodes, resources.objects, resources.instances + object.instanceID, ray, &length) != -1 )
+                        return true;
+
+                    continue;
+                }
+
+                float length = IntersectObject(ray, &object);
+
+                if( (length < maxLength) && (length > 0.01f) )
+                    return true;
+            }
+
+            continue;
+        }
+
+        if( NodeIntersection(ray, inverseDirection, octant, nodes + nodeID + 1) < maxLength )
+            stack[top++] = nodeID + 1;
+
+        if( NodeIntersection(ray, inverseDirection, octant, nodes + node.offset) < maxLength )
+            stack[top++] = node.offset;
+    }
+
+    return false;
+}
+
+bool StacklessOcclusion(const struct Resources resources, const struct Ray * ray, const float maxLength){
+
+    global const struct BVHNode * nodes = resources.nodes;
+
+    float3 inverseDirection = InverseDirection(ray->direction);
+    int3 octant = isless(ray->direction, (float3)(0.0f));
+
+    int nodeID = 0;
+
+    while ( nodeID < resources.numNodes ) {
+
+        struct BVHNode node = nodes[ nodeID ];
+        bool isLeaf = node.primitiveCount > 0;
+
+        if( NodeIntersection(ray, inverseDirection, octant, nodes + nodeID) >= maxLength ){
+            nodeID = isLeaf ? nodeID + 1 : node.offset;
+            continue;
+        }
+
+        if ( isLeaf ) {
+
+            for(int objectID = node.offset; objectID < node.offset + node.primitiveCount; ++objectID){
+
+                struct Object object = resources.objects[ objectID ];
+
+                if ( object.type == INSTANCE ){
+
+                    float length = maxLength;
+
+                    if( IntersectInstanceStackless(nodes, resources.objects, resources.instances + object.instanceID, ray, &length) != -1 )
+                        return true;
+
+                    continue;
+                }
+
+                float length = IntersectObject(ray, &object);
+
+                if( (length < maxLength) && (length > 0.01f) )
+                    return true;
+            }
+
+        }
+
+        ++nodeID;
+    }
+
+    return false;
+}
+
+bool QuantizedOcclusion(const struct Resources resources, const struct Ray * ray, const float maxLength){
+
+    global const struct BVHNode * nodes = resources.nodes;
+    global const struct QuantizedNode * quantizedNodes = resources.quantizedNodes;
+
+    float3 inverseDirection = InverseDirection(ray->direction);
+    int3 octant = isless(ray->direction, (float3)(0.0f));
+
+    // Any hit ends the walk, so children are pushed unsorted
+    int stack[ QUANTIZED_OCCLUSION_STACK_SIZE ];
+    uchar counts[ QUANTIZED_OCCLUSION_STACK_SIZE ];
+    int top = 0;
+
+    stack[top] = 0;
+    counts[top++] = 0;
+
+    while ( top > 0 ) {
+
+        --top;
+
+        int index = stack[top];
+        int count = counts[top];
+
+        if ( count > 0 ) {
+
+            for(int objectID = index; objectID < index + count; ++objectID){
+
+                struct Object object = resources.objects[ objectID ];
+
+                if ( object.type == INSTANCE ){
+
+                    float length = maxLength;
+
+                    if( IntersectInstance(nodes, resources.objects, resources.instances + object.instanceID, ray, &length) != -1 )
+                        return true;
+
+                    continue;
+                }
+
+                float length = IntersectObject(ray, &object);
+
+                if( (length < maxLength) && (length > 0.01f) )
+                    return true;
+            }
+
+            continue;
+        }
+
+        global const struct QuantizedNode * node = quantizedNodes + index;
+
+        float3 origin = vload3(0, node->origin);
+        float3 scale = QuantizedScale(node);
+        int numChildren = node->numChildren;
+
+        for(int slot = 0; slot < numChildren; ++slot){
+
+            if( QuantizedChildIntersection(ray, inverseDirection, octant, node, origin, scale, slot) >= maxLength )
+                continue;
+
+            stack[top] = node->children[slot];
+            counts[top++] = node->primitiveCounts[slot];
+        }
+    }
+
+    return false;
+}
+
+#endif
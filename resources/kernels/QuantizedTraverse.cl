@@ -0,0 +1,177 @@
+#include "resources/kernels/KernelStructs.h"
+#include "resources/kernels/Intersections.h"
+#include "resources/kernels/Instances.h"
+
+// Every entered node leaves up to 7 siblings on stack, host sums them along deepest path
+#ifndef QUANTIZED_STACK_SIZE
+#define QUANTIZED_STACK_SIZE 96
+#endif
+
+kernel void Traverse(
+    global struct Resources * resources,
+    global struct Ray * rays,
+    global struct Sample * samples,
+    global float3 * normals,
+    global const uint * activePixels,
+    const uint numActive
+    ){
+
+    local struct Resources localResources;
+
+    localResources = *resources;
+
+    global const struct BVHNode * nodes = localResources.nodes;
+    global const struct QuantizedNode * quantizedNodes = localResources.quantizedNodes;
+    global const struct Object * objects = localResources.objects;
+    global const struct Instance * instances = localResources.instances;
+
+    if( get_global_id(0) >= numActive )
+        return;
+
+    int globalIndex = activePixels[ get_global_id(0) ];
+
+    struct Ray ray = rays[globalIndex];
+
+    struct Sample sample = {0};
+    sample.objectID = -1;
+    sample.instanceID = -1;
+
+    float minLength = INFINITY;
+    float length = -1.0f;
+
+    float3 inverseDirection = InverseDirection(ray.direction);
+    int3 octant = isless(ray.direction, (float3)(0.0f));
+
+    // Entry with nonzero count is a leaf range, otherwise a quantized node
+    int stack[ QUANTIZED_STACK_SIZE ];
+    uchar counts[ QUANTIZED_STACK_SIZE ];
+    float entries[ QUANTIZED_STACK_SIZE ];
+    int top = 0;
+
+    stack[top] = 0;
+    counts[top] = 0;
+    entries[top++] = 0.0f;
+
+    while ( top > 0 ) {
+
+        --top;
+
+        if( entries[top] >= minLength )
+            continue;
+
+        int index = stack[top];
+        int count = counts[top];
+
+        if ( count > 0 ) {
+
+            for(int objectID = index; objectID < index + count; ++objectID){
+
+                struct Object object = objects[ objectID ];
+
+                if ( object.type == INSTANCE ){
+
+                    // Mesh trees stay binary
+                    int meshObjectID = IntersectInstance(nodes, objects, instances + object.instanceID, &ray, &minLength);
+
+                    if( meshObjectID != -1 ){
+                        sample.point = ray.origin + ray.direction * minLength;
+                        sample.objectID = meshObjectID;
+                        sample.instanceID = object.instanceID;
+                    }
+
+                    continue;
+                }
+
+                if ( object.type == TRIANGLE ){
+                    length = IntersectTriangle(&ray, &object);
+                }else{
+                    length = IntersectSphere(&ray, &object);
+                }
+
+                if( (length < minLength) && (length > 0.01f) ){
+
+                    minLength = length;
+                    sample.point = ray.origin + ray.direction * length;
+                    sample.objectID = objectID;
+                    sample.instanceID = -1;
+
+                }
+            }
+
+            continue;
+        }
+
+        global const struct QuantizedNode * node = quantizedNodes + index;
+
+        float3 origin = vload3(0, node->origin);
+        float3 scale = QuantizedScale(node);
+        int numChildren = node->numChildren;
+        int first = top;
+
+        // Entered children are kept sorted, so the nearest one is visited first
+        for(int slot = 0; slot < numChildren; ++slot){
+
+            float entry = QuantizedChildIntersection(&ray, inverseDirection, octant, node, origin, scale, slot);
+
+            if( entry >= minLength )
+                continue;
+
+            int position = top++;
+
+            while( position > first && entries[position - 1] < entry ){
+                stack[position] = stack[position - 1];
+                counts[position] = counts[position - 1];
+                entries[position] = entries[position - 1];
+                --position;
+            }
+
+            stack[position] = node->children[slot];
+            counts[position] = node->primitiveCounts[slot];
+            entries[position] = entry;
+        }
+
+    }
+
+    samples[globalIndex] = sample;
+
+    if( sample.objectID == -1 )
+        return;
+
+    struct Object object = objects[ sample.objectID ];
+
+    // Triangles of instanced meshes are stored in mesh space
+    float3 point = sample.instanceID < 0 ? sample.point : PointToInstance(instances + sample.instanceID, sample.point);
+
+    if ( object.type == SPHERE){
+
+        normals[globalIndex] = normalize( point - object.position);
+
+    }else if( object.type == TRIANGLE ){
+
+        float3 A = object.verticeA;
+        float3 B = object.verticeB;
+        float3 C = object.verticeC;
+
+        float3 v0 = (B - A);
+        float3 v1 = (C - A);
+        float3 v2 = point - A;
+
+        float dot00 = dot(v0, v0);
+        float dot01 = dot(v0, v1);
+        float dot02 = dot(v0, v2);
+        float dot11 = dot(v1, v1);
+        float dot12 = dot(v1, v2);
+
+        float invDenom = 1.0f / (dot00 * dot11 - dot01 * dot01);
+        float u = (dot11 * dot02 - dot01 * dot12) * invDenom;
+        float v = (dot00 * dot12 - dot01 * dot02) * invDenom;
+        float w = 1.0f - u - v;
+
+        float3 normal = object.normalA * w + object.normalB * u + object.normalC * v;
+
+        if( sample.instanceID >= 0 )
+            normal = NormalToWorld(instances + sample.instanceID, normal);
+
+        normals[globalIndex] = normalize(normal);
+    }
+}
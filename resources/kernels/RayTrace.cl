@@ -1,20 +1,16 @@
 
 #include "resources/kernels/KernelStructs.h"
 #include "resources/kernels/ColorManipulation.h"
+#include "resources/kernels/Occlusion.h"
+#include "resources/kernels/Sampler.h"
 
 
 #define ALPHA_MIN 0.001f
 #define INPUT_IOR 1.0f
 
-float Rand(uint * seed){
-    *seed = *seed * 747796405u + 2891336453u;
-    uint word = ((*seed >> ((*seed >> 28u) + 4u)) ^ *seed) * 277803737u;
-    return ((word>>22u) ^ word)/(float)UINT_MAX;
-}
-
-float3 RandomDirection(uint * seed){
-    float latitude = ( 2.0f * Rand(seed) - 1.0f ) * M_PI_F;
-    float longitude = (Rand(seed) - 0.5f) * M_PI_F;
+float3 RandomDirection(struct Sampler * sampler){
+    float latitude = ( 2.0f * Next(sampler) - 1.0f ) * M_PI_F;
+    float longitude = (Next(sampler) - 0.5f) * M_PI_F;
 
     float cosLatitude = cos(latitude);
 
@@ -38,9 +34,9 @@ float3 Reflect(const float3 incident, const float3 normal) {
 
 }
 
-float3 DiffuseReflect(const float3 normal, uint * seed){
+float3 DiffuseReflect(const float3 normal, struct Sampler * sampler){
 
-    float3 randomDirection = RandomDirection(seed);
+    float3 randomDirection = RandomDirection(sampler);
     float cosDirection = dot(normal, randomDirection);
 
     return normalize(randomDirection  * cosDirection + normal );
@@ -217,14 +213,94 @@ float4 CalculateWeights(const struct Material material){
     return normalize(weights);
 }
 
+float4 SampleLight(
+    const struct Resources resources,
+    const float3 point,
+    const float3 normal,
+    global const int * lights,
+    const int numLights,
+    const int useBVH,
+    struct Sampler * sampler
+    ){
+
+    int lightID = min((int)(Next(sampler) * numLights), numLights - 1);
+
+    struct Object light = resources.objects[ lights[lightID] ];
+    struct Material lightMaterial = resources.materials[ light.materialID ];
+
+    float3 lightPoint;
+    float3 lightNormal;
+    float area;
+
+    if( light.type == TRIANGLE ){
+
+        float u = sqrt(Next(sampler));
+        float v = Next(sampler);
+
+        float3 e1 = light.verticeB - light.verticeA;
+        float3 e2 = light.verticeC - light.verticeA;
+        float3 normalArea = cross(e1, e2);
+
+        lightPoint = light.verticeA + e1 * (u * (1.0f - v)) + e2 * (u * v);
+        area = 0.5f * length(normalArea);
+        lightNormal = normalArea * (0.5f / area);
+
+    }else{
+
+        float z = 1.0f - 2.0f * Next(sampler);
+        float phi = 2.0f * M_PI_F * Next(sampler);
+        float r = sqrt(fmax(0.0f, 1.0f - z * z));
+
+        lightNormal = (float3)(r * cos(phi), r * sin(phi), z);
+        lightPoint = light.position + lightNormal * light.radius;
+        area = 4.0f * M_PI_F * light.radius * light.radius;
+    }
+
+    float3 toLight = lightPoint - point;
+    float lightDistance = length(toLight);
+
+    struct Ray shadowRay;
+    shadowRay.origin = point;
+    shadowRay.direction = toLight / lightDistance;
+
+    float cosSurface = dot(normal, shadowRay.direction);
+    float cosEmitter = fabs(dot(lightNormal, shadowRay.direction));
+
+    if( cosSurface <= 0.0f || cosEmitter <= 0.0f )
+        return 0.0f;
+
+    bool occluded;
+
+    if( useBVH == QUANTIZED_TRAVERSAL ){
+        occluded = QuantizedOcclusion(resources, &shadowRay, lightDistance * 0.999f);
+    }else if( useBVH == STACKLESS_TRAVERSAL ){
+        occluded = StacklessOcclusion(resources, &shadowRay, lightDistance * 0.999f);
+    }else if( useBVH == STACK_TRAVERSAL ){
+        occluded = BVHOcclusion(resources, &shadowRay, lightDistance * 0.999f);
+    }else{
+        occluded = LinearOcclusion(resources, &shadowRay, lightDistance * 0.999f);
+    }
+
+    if( occluded )
+        return 0.0f;
+
+    float4 radiance = lightMaterial.albedo * lightMaterial.emmissionIntensity;
+
+    return radiance * (cosSurface * cosEmitter * area * numLights / (lightDistance * lightDistance));
+}
+
 float4 ComputeColorSample(
     const struct Resources resources,
     struct Ray * ray,
     const struct Camera camera,
     const struct Sample sample,
     float4 * lightSample,
+    float * emissionWeight,
     float3 normal,
-    uint * seed
+    global const int * lights,
+    const int numLights,
+    const int useBVH,
+    struct Sampler * sampler
     ){
 
     global const unsigned int * textureData = resources.textureData;
@@ -240,7 +316,7 @@ float4 ComputeColorSample(
     float3 viewVector = normalize(camera.position - sample.point);
     float3 halfVector = normalize(lightVector + viewVector);
 
-    float3 diffusionDirection = DiffuseReflect(normal, seed);
+    float3 diffusionDirection = DiffuseReflect(normal, sampler);
     float3 reflectionDirection = Reflect(ray->direction, normal);
     float3 refractionDirecton = Refract(viewVector, normal, INPUT_IOR, material.indexOfRefraction);
 
@@ -256,7 +332,10 @@ float4 ComputeColorSample(
     float4 emission = material.albedo * material.emmissionIntensity;
     float isEmissive = dot(emission.xyz, (float3)(1.0f, 1.0f, 1.0f)) > 0.0f;
 
-    float4 texture = GetTexturePixel(textureData, &object, info, sample.point, normal);
+    // Triangles of instanced meshes are stored in mesh space
+    float3 localPoint = sample.instanceID < 0 ? sample.point : PointToInstance(resources.instances + sample.instanceID, sample.point);
+
+    float4 texture = GetTexturePixel(textureData, &object, info, localPoint, normal);
 
     float4 diffuseAlbedo = (1.0f - material.metallic) * material.diffuse * texture;
     float4 specularAlbedo = mix(material.specular, 1.0f, material.metallic);
@@ -270,13 +349,23 @@ float4 ComputeColorSample(
 
     float4 weights = CalculateWeights(material);
 
-    float4 colorSample = emission * isEmissive;
+    float4 colorSample = emission * isEmissive * (*emissionWeight);
     colorSample += (diffuseComponent + sheenComponent) * weights.z;
     colorSample += clearcoatComponent * weights.w;
     colorSample += specularComponent * weights.x;
     colorSample += transmissionComponent * weights.y;
     colorSample *=  *lightSample * (cosLight > 0.0f);
 
+    // Diffuse share of direct light comes from light sampling, so emission reached by next bounce only counts the rest
+    if( numLights > 0 ){
+
+        float diffuseShare = (1.0f - material.metallic) * (1.0f - material.transparency);
+        float4 reflectance = texture * material.albedo * (diffuseShare * ONE_OVER_PI);
+
+        colorSample += SampleLight(resources, sample.point, normal, lights, numLights, useBVH, sampler) * reflectance * (*lightSample);
+        *emissionWeight = 1.0f - diffuseShare;
+    }
+
     (*lightSample) *= texture * material.albedo * 2.0f * cosLight;
 
     return colorSample;
@@ -293,17 +382,35 @@ void kernel RayTrace(
     global float4 * colors,
     global float3 * normals,
     const struct Camera camera,
-    const int numFrames
+    const int numFrames,
+    global const uint * activePixels,
+    const uint numActive,
+    global uint * survivingPixels,
+    global uint * numSurviving,
+    const int depth,
+    const int minDepth,
+    const int maxDepth,
+    global float * emissionWeights,
+    global const int * lights,
+    const int numLights,
+    const int useBVH,
+    const int samplerType
     ){
 
     local struct Resources localResources;
     localResources = *resources;
 
-    uint x = get_global_id(0);
-    uint y = get_global_id(1);
+    if( get_global_id(0) >= numActive )
+        return;
+
+    uint index = activePixels[ get_global_id(0) ];
+    struct Sampler sampler = CreateSampler(samplerType, index, numFrames);
+
+    // Hash sampler gets distinct stream per bounce, Sobol sampler selects dimensions of bounce instead
+    if( samplerType == HASH_SAMPLER )
+        sampler.seed += depth * localResources.width * localResources.height;
 
-    uint index = y * localResources.width + x;
-    uint seed = (numFrames<<16) ^ (numFrames >>13) + index;
+    StartBounce(&sampler, depth);
 
     struct Sample sample = samples[index];
     struct Ray ray = rays[index];
@@ -320,15 +427,34 @@ void kernel RayTrace(
 
         float4 texel = ColorSample(textureData, u, v, info.width, info.height, info.offset);
 
-        accumulator[index] += texel * lightSample * 0.25f;
+        accumulator[index] += texel * lightSample;
         return;
     }
 
 
-    float4 colorSample = ComputeColorSample(localResources, &ray, camera, sample, &lightSample, normal, &seed);
+    float emissionWeight = depth == 0 ? 1.0f : emissionWeights[index];
 
-    rays[index] = ray;
-    light[index] = clamp(lightSample, 0.0f, 1.0f);
+    float4 colorSample = ComputeColorSample(localResources, &ray, camera, sample, &lightSample, &emissionWeight, normal, lights, numLights, useBVH, &sampler);
+
+    lightSample = clamp(lightSample, 0.0f, 1.0f);
     accumulator[index] = clamp(accumulator[index] + colorSample, 0.0f, 1.0f);
 
+    if( depth + 1 >= maxDepth )
+        return;
+
+    if( depth + 1 >= minDepth ){
+
+        float survival = fmin(fmax(lightSample.x, fmax(lightSample.y, lightSample.z)), 1.0f);
+
+        if( Next(&sampler) >= survival )
+            return;
+
+        lightSample /= survival;
+    }
+
+    rays[index] = ray;
+    light[index] = lightSample;
+    emissionWeights[index] = emissionWeight;
+    survivingPixels[ atomic_inc(numSurviving) ] = index;
+
 }
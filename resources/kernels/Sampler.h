@@ -0,0 +1,125 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#define HASH_SAMPLER 0
+#define SOBOL_SAMPLER 1
+
+#define SAMPLER_PRIMARY_DIMENSIONS 2
+#define SAMPLER_BOUNCE_DIMENSIONS 8
+#define SOBOL_DIMENSIONS 4
+#define SOBOL_BITS 32
+
+// Direction numbers of first four Sobol dimensions (Joe and Kuo), same as src/Sampler.cpp
+constant uint SOBOL_DIRECTIONS[SOBOL_DIMENSIONS][SOBOL_BITS] = {
+    {
+        0x80000000u, 0x40000000u, 0x20000000u, 0x10000000u, 0x08000000u, 0x04000000u, 0x02000000u, 0x01000000u,
+        0x00800000u, 0x00400000u, 0x00200000u, 0x00100000u, 0x00080000u, 0x00040000u, 0x00020000u, 0x00010000u,
+        0x00008000u, 0x00004000u, 0x00002000u, 0x00001000u, 0x00000800u, 0x00000400u, 0x00000200u, 0x00000100u,
+        0x00000080u, 0x00000040u, 0x00000020u, 0x00000010u, 0x00000008u, 0x00000004u, 0x00000002u, 0x00000001u
+    },
+    {
+        0x80000000u, 0xc0000000u, 0xa0000000u, 0xf0000000u, 0x88000000u, 0xcc000000u, 0xaa000000u, 0xff000000u,
+        0x80800000u, 0xc0c00000u, 0xa0a00000u, 0xf0f00000u, 0x88880000u, 0xcccc0000u, 0xaaaa0000u, 0xffff0000u,
+        0x80008000u, 0xc000c000u, 0xa000a000u, 0xf000f000u, 0x88008800u, 0xcc00cc00u, 0xaa00aa00u, 0xff00ff00u,
+        0x80808080u, 0xc0c0c0c0u, 0xa0a0a0a0u, 0xf0f0f0f0u, 0x88888888u, 0xccccccccu, 0xaaaaaaaau, 0xffffffffu
+    },
+    {
+        0x80000000u, 0xc0000000u, 0x60000000u, 0x90000000u, 0xe8000000u, 0x5c000000u, 0x8e000000u, 0xc5000000u,
+        0x68800000u, 0x9cc00000u, 0xee600000u, 0x55900000u, 0x80680000u, 0xc09c0000u, 0x60ee0000u, 0x90550000u,
+        0xe8808000u, 0x5cc0c000u, 0x8e606000u, 0xc5909000u, 0x6868e800u, 0x9c9c5c00u, 0xeeee8e00u, 0x5555c500u,
+        0x8000e880u, 0xc0005cc0u, 0x60008e60u, 0x9000c590u, 0xe8006868u, 0x5c009c9cu, 0x8e00eeeeu, 0xc5005555u
+    },
+    {
+        0x80000000u, 0xc0000000u, 0x20000000u, 0x50000000u, 0xf8000000u, 0x74000000u, 0xa2000000u, 0x93000000u,
+        0xd8800000u, 0x25400000u, 0x59e00000u, 0xe6d00000u, 0x78080000u, 0xb40c0000u, 0x82020000u, 0xc3050000u,
+        0x208f8000u, 0x51474000u, 0xfbea2000u, 0x75d93000u, 0xa0858800u, 0x914e5400u, 0xdbe79e00u, 0x25db6d00u,
+        0x58800080u, 0xe54000c0u, 0x79e00020u, 0xb6d00050u, 0x800800f8u, 0xc00c0074u, 0x200200a2u, 0x50050093u
+    }
+};
+
+struct Sampler{
+    int type;
+    uint pixel;
+    uint sample;
+    uint dimension;
+    uint seed;
+};
+
+float Rand(uint * seed){
+    *seed = *seed * 747796405u + 2891336453u;
+    uint word = ((*seed >> ((*seed >> 28u) + 4u)) ^ *seed) * 277803737u;
+    return ((word>>22u) ^ word)/(float)UINT_MAX;
+}
+
+uint ReverseBits(uint x){
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+uint Hash(uint x){
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+uint HashCombine(const uint seed, const uint value){
+    return seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+uint OwenScramble(uint x, const uint seed){
+    x = ReverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return ReverseBits(x);
+}
+
+float Sobol(const uint index, const uint dimension, const uint seed){
+
+    uint setSeed = HashCombine(seed, dimension / SOBOL_DIMENSIONS);
+    uint shuffledIndex = OwenScramble(index, setSeed);
+    uint component = dimension % SOBOL_DIMENSIONS;
+    uint value = 0;
+
+    // Index of lowest set bit, ctz is missing before OpenCL C 2.0
+    for(; shuffledIndex != 0; shuffledIndex &= shuffledIndex - 1)
+        value ^= SOBOL_DIRECTIONS[component][ 31 - clz(shuffledIndex & -shuffledIndex) ];
+
+    value = OwenScramble(value, HashCombine(setSeed, component + 1));
+
+    return (value >> 8) * (1.0f / (1 << 24));
+}
+
+struct Sampler CreateSampler(const int type, const uint pixel, const uint sample){
+
+    struct Sampler sampler;
+    sampler.type = type;
+    sampler.pixel = pixel;
+    sampler.sample = sample;
+    sampler.dimension = 0;
+    sampler.seed = type == HASH_SAMPLER ? (sample<<16) ^ (sample >>13) + pixel : Hash(pixel);
+
+    return sampler;
+}
+
+void StartBounce(struct Sampler * sampler, const uint depth){
+    sampler->dimension = SAMPLER_PRIMARY_DIMENSIONS + depth * SAMPLER_BOUNCE_DIMENSIONS;
+}
+
+float Next(struct Sampler * sampler){
+
+    if( sampler->type == HASH_SAMPLER )
+        return Rand(&sampler->seed);
+
+    return Sobol(sampler->sample, sampler->dimension++, sampler->seed);
+}
+
+#endif
@@ -0,0 +1,135 @@
+#include "resources/kernels/KernelStructs.h"
+#include "resources/kernels/Intersections.h"
+#include "resources/kernels/Instances.h"
+
+kernel void Traverse(
+    global struct Resources * resources,
+    global struct Ray * rays,
+    global struct Sample * samples,
+    global float3 * normals,
+    global const uint * activePixels,
+    const uint numActive
+    ){
+
+    local struct Resources localResources;
+
+    localResources = *resources;
+
+    global const struct BVHNode * nodes = localResources.nodes;
+    global const struct Object * objects = localResources.objects;
+    global const struct Instance * instances = localResources.instances;
+
+    if( get_global_id(0) >= numActive )
+        return;
+
+    int globalIndex = activePixels[ get_global_id(0) ];
+
+    struct Ray ray = rays[globalIndex];
+
+    struct Sample sample = {0};
+    sample.objectID = -1;
+    sample.instanceID = -1;
+
+    float minLength = INFINITY;
+    float length = -1.0f;
+
+    float3 inverseDirection = InverseDirection(ray.direction);
+    int3 octant = isless(ray.direction, (float3)(0.0f));
+
+    int numNodes = localResources.numNodes;
+    int nodeID = 0;
+
+    // Nodes are visited in depth first order, missed subtree is skipped by jumping past it
+    while ( nodeID < numNodes ) {
+
+        struct BVHNode node = nodes[ nodeID ];
+        bool isLeaf = node.primitiveCount > 0;
+
+        if( NodeIntersection(&ray, inverseDirection, octant, nodes + nodeID) >= minLength ){
+            nodeID = isLeaf ? nodeID + 1 : node.offset;
+            continue;
+        }
+
+        if ( isLeaf ) {
+
+            for(int objectID = node.offset; objectID < node.offset + node.primitiveCount; ++objectID){
+
+                struct Object object = objects[ objectID ];
+
+                if ( object.type == INSTANCE ){
+
+                    int meshObjectID = IntersectInstanceStackless(nodes, objects, instances + object.instanceID, &ray, &minLength);
+
+                    if( meshObjectID != -1 ){
+                        sample.point = ray.origin + ray.direction * minLength;
+                        sample.objectID = meshObjectID;
+                        sample.instanceID = object.instanceID;
+                    }
+
+                    continue;
+                }
+
+                if ( object.type == TRIANGLE ){
+                    length = IntersectTriangle(&ray, &object);
+                }else{
+                    length = IntersectSphere(&ray, &object);
+                }
+
+                if( (length < minLength) && (length > 0.01f) ){
+
+                    minLength = length;
+                    sample.point = ray.origin + ray.direction * length;
+                    sample.objectID = objectID;
+                    sample.instanceID = -1;
+
+                }
+            }
+
+        }
+
+        ++nodeID;
+    }
+
+    samples[globalIndex] = sample;
+
+    if( sample.objectID == -1 )
+        return;
+
+    struct Object object = objects[ sample.objectID ];
+
+    // Triangles of instanced meshes are stored in mesh space
+    float3 point = sample.instanceID < 0 ? sample.point : PointToInstance(instances + sample.instanceID, sample.point);
+
+    if ( object.type == SPHERE){
+
+        normals[globalIndex] = normalize( point - object.position);
+
+    }else if( object.type == TRIANGLE ){
+
+        float3 A = object.verticeA;
+        float3 B = object.verticeB;
+        float3 C = object.verticeC;
+
+        float3 v0 = (B - A);
+        float3 v1 = (C - A);
+        float3 v2 = point - A;
+
+        float dot00 = dot(v0, v0);
+        float dot01 = dot(v0, v1);
+        float dot02 = dot(v0, v2);
+        float dot11 = dot(v1, v1);
+        float dot12 = dot(v1, v2);
+
+        float invDenom = 1.0f / (dot00 * dot11 - dot01 * dot01);
+        float u = (dot11 * dot02 - dot01 * dot12) * invDenom;
+        float v = (dot00 * dot12 - dot01 * dot02) * invDenom;
+        float w = 1.0f - u - v;
+
+        float3 normal = object.normalA * w + object.normalB * u + object.normalC * v;
+
+        if( sample.instanceID >= 0 )
+            normal = NormalToWorld(instances + sample.instanceID, normal);
+
+        normals[globalIndex] = normalize(normal);
+    }
+}
@@ -5,20 +5,26 @@ void kernel Transfer(
     global const struct Material * materials,
     global const struct Texture * textureInfo,
     global const unsigned int * textureData,
-    global const struct BoundingBox * boxes,
+    global const struct BVHNode * nodes,
+    global const struct QuantizedNode * quantizedNodes,
+    global const struct Instance * instances,
     const int numObject,
     const int numMaterials,
     const int width,
-    const int height
+    const int height,
+    const int numNodes
     ){
 
     resources->objects = objects;
     resources->materials = materials;
     resources->textureInfo = textureInfo;
     resources->textureData = textureData;
-    resources->boxes = boxes;
+    resources->nodes = nodes;
+    resources->quantizedNodes = quantizedNodes;
+    resources->instances = instances;
     resources->numObject = numObject;
     resources->numMaterials = numMaterials;
     resources->width = width;
     resources->height = height;
+    resources->numNodes = numNodes;
 }
@@ -0,0 +1,326 @@
+#include "BVHCache.h"
+
+BVHCache::BVHCache(RenderingContext * _context){
+    this->context = _context;
+}
+
+uint64_t BVHCache::Hash(uint64_t hash, const void * data, const size_t & size){
+
+    const uint8_t * bytes = (const uint8_t *)data;
+    size_t offset = 0;
+
+    for(; offset + sizeof(uint32_t) <= size; offset += sizeof(uint32_t)){
+
+        uint32_t word;
+        memcpy(&word, bytes + offset, sizeof(uint32_t));
+
+        hash = (hash ^ word) * FNV_PRIME;
+    }
+
+    if( offset < size ){
+
+        uint32_t word = 0;
+        memcpy(&word, bytes + offset, size - offset);
+
+        hash = (hash ^ word) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+std::string BVHCache::GetTemporaryPath(const std::string & path){
+
+#ifdef __WIN32__
+    int32_t processID = _getpid();
+#else
+    int32_t processID = getpid();
+#endif
+
+    std::random_device device;
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%d.%08x.tmp", processID, (uint32_t)device());
+
+    return path + suffix;
+}
+
+uint64_t BVHCache::CalculateKey() const{
+
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    int32_t settings[4] = {BVH_CACHE_VERSION, (int32_t)context->bvhBuilder, (int32_t)context->maxLeafSize, (int32_t)context->objects.size()};
+    hash = Hash(hash, settings, sizeof(settings));
+
+    if( context->bvhBuilder == SBVH_BUILDER )
+        hash = Hash(hash, &context->splitBudget, sizeof(context->splitBudget));
+
+    if( context->treeletPasses > 0 )
+        hash = Hash(hash, &context->treeletPasses, sizeof(context->treeletPasses));
+
+    // Only fields that shape bounds are hashed, editing materials, normals or uvs keeps the cache valid
+    for(const Object & object : context->objects){
+
+        int32_t type = object.type;
+        hash = Hash(hash, &type, sizeof(type));
+
+        if( object.type == TRIANGLE ){
+
+            for(int32_t vertex = 0; vertex < 3; ++vertex){
+                const Vector3 & point = object.vertices[vertex];
+                float values[3] = {point.x, point.y, point.z};
+                hash = Hash(hash, values, sizeof(values));
+            }
+
+        }else if( object.type == INSTANCE ){
+
+            hash = Hash(hash, &object.instanceID, sizeof(object.instanceID));
+
+        }else{
+
+            float values[4] = {object.position.x, object.position.y, object.position.z, object.radius};
+            hash = Hash(hash, values, sizeof(values));
+        }
+
+    }
+
+    for(const Mesh & mesh : context->meshes){
+        int32_t range[2] = {mesh.firstObject, mesh.numObjects};
+        hash = Hash(hash, range, sizeof(range));
+    }
+
+    for(const Instance & instance : context->instances){
+
+        for(int32_t row = 0; row < 3; ++row){
+            const Vector3 & transform = instance.toWorld[row];
+            float values[4] = {transform.x, transform.y, transform.z, transform.w};
+            hash = Hash(hash, values, sizeof(values));
+        }
+
+        hash = Hash(hash, &instance.meshID, sizeof(instance.meshID));
+    }
+
+    return hash;
+}
+
+std::string BVHCache::GetPath(const uint64_t & key) const{
+
+    if( context->cacheDirectory.empty() )
+        return std::string();
+
+    char filename[32];
+    snprintf(filename, sizeof(filename), "%016llx.bvh", (unsigned long long)key);
+
+    return (std::filesystem::path(context->cacheDirectory) / filename).string();
+}
+
+bool BVHCache::Load(const std::string & path, const uint64_t & key, std::vector<int32_t> & order, std::vector<BoundingBox> & boxes, std::vector<BVHNode> & meshNodes, std::vector<Mesh> & meshes){
+
+    MappedFile file(path);
+
+    if( !file.IsOpen() || file.GetSize() < sizeof(CacheHeader) )
+        return false;
+
+    const uint8_t * data = file.GetData();
+
+    CacheHeader header;
+    memcpy(&header, data, sizeof(CacheHeader));
+
+    if( header.magic != BVH_CACHE_MAGIC || header.version != BVH_CACHE_VERSION || header.key != key )
+        return false;
+
+    // Spatial splits may have copied some objects
+    if( header.numObjects < context->objects.size() || header.numMeshes != meshes.size() )
+        return false;
+
+    size_t expectedSize = sizeof(CacheHeader);
+    expectedSize += sizeof(int32_t) * header.numObjects;
+    expectedSize += sizeof(BoundingBox) * header.numBoxes;
+    expectedSize += sizeof(BVHNode) * header.numNodes;
+    expectedSize += sizeof(Mesh) * header.numMeshes;
+
+    if( file.GetSize() != expectedSize ){
+        context->loggingService.Write(MessageType::ISSUE, "BVH cache file %s is truncated", path.c_str());
+        return false;
+    }
+
+    size_t offset = sizeof(CacheHeader);
+
+    std::vector<int32_t> loadedOrder(header.numObjects);
+    memcpy(loadedOrder.data(), data + offset, sizeof(int32_t) * header.numObjects);
+    offset += sizeof(int32_t) * header.numObjects;
+
+    std::vector<BoundingBox> loadedBoxes(header.numBoxes);
+    memcpy((void *)loadedBoxes.data(), data + offset, sizeof(BoundingBox) * header.numBoxes);
+    offset += sizeof(BoundingBox) * header.numBoxes;
+
+    std::vector<BVHNode> loadedNodes(header.numNodes);
+    memcpy((void *)loadedNodes.data(), data + offset, sizeof(BVHNode) * header.numNodes);
+    offset += sizeof(BVHNode) * header.numNodes;
+
+    std::vector<Mesh> loadedMeshes(header.numMeshes);
+    memcpy((void *)loadedMeshes.data(), data + offset, sizeof(Mesh) * header.numMeshes);
+
+    // Matching key and size don't rule out file damaged on disk, traversal would read out of bounds
+    if( !IsValid(loadedOrder, loadedBoxes, loadedNodes, loadedMeshes) ){
+        context->loggingService.Write(MessageType::ISSUE, "BVH cache file %s is corrupt", path.c_str());
+        return false;
+    }
+
+    order.swap(loadedOrder);
+    boxes.swap(loadedBoxes);
+    meshNodes.swap(loadedNodes);
+    meshes.swap(loadedMeshes);
+
+    context->loggingService.Write(MessageType::INFO, "BVH tree loaded from cache %s", path.c_str());
+
+    return true;
+}
+
+bool BVHCache::IsValid(const std::vector<int32_t> & order, const std::vector<BoundingBox> & boxes, const std::vector<BVHNode> & meshNodes, const std::vector<Mesh> & meshes) const{
+
+    int32_t numSourceObjects = context->objects.size();
+    int32_t numObjects = order.size();
+    int32_t numBoxes = boxes.size();
+    int32_t numNodes = meshNodes.size();
+
+    for(const int32_t & sourceID : order){
+        if( sourceID < 0 || sourceID >= numSourceObjects )
+            return false;
+    }
+
+    // Objects of meshes follow objects of the world
+    int32_t numWorldObjects = meshes.empty() ? numObjects : meshes[0].firstObject;
+    int32_t nextObject = numWorldObjects;
+
+    if( numWorldObjects < 0 || numWorldObjects > numObjects || numBoxes == 0 )
+        return false;
+
+    for(const Mesh & mesh : meshes){
+
+        if( mesh.firstObject != nextObject || mesh.numObjects <= 0 || mesh.firstObject + mesh.numObjects > numObjects )
+            return false;
+
+        if( mesh.rootNode < 0 || mesh.numNodes <= 0 || mesh.rootNode + mesh.numNodes > numNodes )
+            return false;
+
+        nextObject += mesh.numObjects;
+
+        // Mesh nodes are depth first ordered, children always follow their parent inside range of mesh
+        int32_t lastNode = mesh.rootNode + mesh.numNodes;
+
+        for(int32_t nodeID = mesh.rootNode; nodeID < lastNode; ++nodeID){
+
+            const BVHNode & node = meshNodes[nodeID];
+
+            if( node.primitiveCount < 0 )
+                return false;
+
+            if( node.primitiveCount > 0 ){
+
+                if( node.offset < mesh.firstObject || node.offset + node.primitiveCount > mesh.firstObject + mesh.numObjects )
+                    return false;
+
+            }else if( node.offset <= nodeID + 1 || node.offset >= lastNode ){
+                return false;
+            }
+        }
+    }
+
+    if( nextObject != numObjects )
+        return false;
+
+    // Walk from root has to reach every box exactly once through links agreeing with parents
+    std::vector<bool> visited(numBoxes, false);
+    std::vector<int32_t> stack(1, 0);
+    int32_t numVisited = 0;
+
+    if( boxes[0].parentID != -1 )
+        return false;
+
+    while( !stack.empty() ){
+
+        int32_t boxID = stack.back();
+        stack.pop_back();
+
+        if( visited[boxID] )
+            return false;
+
+        visited[boxID] = true;
+        ++numVisited;
+
+        const BoundingBox & box = boxes[boxID];
+
+        if( box.objectID != -1 ){
+
+            if( box.objectID < 0 || box.primitiveCount <= 0 || box.objectID + box.primitiveCount > numWorldObjects )
+                return false;
+
+            continue;
+        }
+
+        int32_t children[2] = {box.leftID, box.rightID};
+
+        for(const int32_t & childID : children){
+
+            if( childID < 0 || childID >= numBoxes || boxes[childID].parentID != boxID )
+                return false;
+
+            stack.emplace_back(childID);
+        }
+    }
+
+    return numVisited == numBoxes;
+}
+
+bool BVHCache::Save(const std::string & path, const uint64_t & key, const std::vector<int32_t> & order, const std::vector<BoundingBox> & boxes, const std::vector<BVHNode> & meshNodes, const std::vector<Mesh> & meshes){
+
+    std::error_code error;
+    std::filesystem::path filepath(path);
+    std::filesystem::create_directories(filepath.parent_path(), error);
+
+    // Every run writes its own file and renames it, so concurrent runs never map half written or mixed file
+    std::string temporaryPath = GetTemporaryPath(path);
+    std::ofstream file(temporaryPath, std::ios::out | std::ios::binary | std::ios::trunc);
+
+    if( !file.is_open() ){
+        context->loggingService.Write(MessageType::ISSUE, "Can't write BVH cache file %s", path.c_str());
+        return false;
+    }
+
+    CacheHeader header = {};
+    header.magic = BVH_CACHE_MAGIC;
+    header.version = BVH_CACHE_VERSION;
+    header.key = key;
+    header.numObjects = order.size();
+    header.numBoxes = boxes.size();
+    header.numNodes = meshNodes.size();
+    header.numMeshes = meshes.size();
+
+    file.write((const char *)&header, sizeof(CacheHeader));
+    file.write((const char *)order.data(), sizeof(int32_t) * order.size());
+    file.write((const char *)boxes.data(), sizeof(BoundingBox) * boxes.size());
+    file.write((const char *)meshNodes.data(), sizeof(BVHNode) * meshNodes.size());
+    file.write((const char *)meshes.data(), sizeof(Mesh) * meshes.size());
+    file.close();
+
+    if( file.fail() ){
+        std::filesystem::remove(temporaryPath, error);
+        context->loggingService.Write(MessageType::ISSUE, "Can't write BVH cache file %s", path.c_str());
+        return false;
+    }
+
+    std::filesystem::rename(temporaryPath, path, error);
+
+    if( error ){
+        std::filesystem::remove(temporaryPath, error);
+        return false;
+    }
+
+    context->loggingService.Write(MessageType::INFO, "BVH tree saved to cache %s", path.c_str());
+
+    return true;
+}
+
+BVHCache::~BVHCache(){
+
+}
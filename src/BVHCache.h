@@ -0,0 +1,78 @@
+#ifndef BVHCACHE_H
+#define BVHCACHE_H
+
+#include "BoundingBox.h"
+#include "BVHNode.h"
+#include "Instance.h"
+#include "MappedFile.h"
+#include "RenderingContext.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef __WIN32__
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#define BVH_CACHE_MAGIC 0x48564243
+#define BVH_CACHE_VERSION 1
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// File starts with header, followed by object order, world boxes, mesh nodes and meshes
+struct CacheHeader{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+
+    uint32_t numObjects;
+    uint32_t numBoxes;
+    uint32_t numNodes;
+    uint32_t numMeshes;
+};
+
+// Stores built trees on disk, so unchanged scenes skip the build on later runs
+class BVHCache{
+private:
+
+    RenderingContext * context;
+
+    /// @brief Checks that every index of loaded trees points inside its array and boxes form one tree
+    bool IsValid(const std::vector<int32_t> & order, const std::vector<BoundingBox> & boxes, const std::vector<BVHNode> & meshNodes, const std::vector<Mesh> & meshes) const;
+
+public:
+
+    /// @brief Mixes data into FNV-1a hash, one 32 bit word at a time, trailing bytes are zero padded
+    static uint64_t Hash(uint64_t hash, const void * data, const size_t & size);
+
+    /// @brief Returns name of file written before rename, unique for every process and call
+    static std::string GetTemporaryPath(const std::string & path);
+
+    BVHCache(RenderingContext * _context);
+
+    /// @brief Hashes everything that shapes the tree: geometry of objects, meshes, instances and builder settings
+    uint64_t CalculateKey() const;
+
+    /// @brief Returns path of cache file for key, empty when caching is disabled
+    std::string GetPath(const uint64_t & key) const;
+
+    /// @brief Reads memory mapped cache file, outputs are left untouched when it is missing or stale
+    /// @param order receives original index of every object in build order
+    /// @param boxes receives boxes of world tree
+    /// @param meshNodes receives nodes of mesh trees, placed before nodes of the world
+    /// @param meshes receives meshes with their tree ranges and bounds
+    bool Load(const std::string & path, const uint64_t & key, std::vector<int32_t> & order, std::vector<BoundingBox> & boxes, std::vector<BVHNode> & meshNodes, std::vector<Mesh> & meshes);
+
+    bool Save(const std::string & path, const uint64_t & key, const std::vector<int32_t> & order, const std::vector<BoundingBox> & boxes, const std::vector<BVHNode> & meshNodes, const std::vector<Mesh> & meshes);
+
+    ~BVHCache();
+};
+
+#endif
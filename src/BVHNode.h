@@ -0,0 +1,21 @@
+#ifndef BVHNODE_H
+#define BVHNODE_H
+
+#include <stdint.h>
+
+// Compact node of depth first flattened tree, two nodes fit in one cache line.
+// First child of inner node directly follows it, so only the second one is stored.
+struct BVHNode{
+    float minimalPosition[3];
+
+    // Leaf: first object of its range, inner node: index of second child
+    int32_t offset;
+
+    float maximalPosition[3];
+
+    // Number of objects in leaf, zero for inner nodes
+    int32_t primitiveCount;
+
+} __attribute((aligned(32)));
+
+#endif
@@ -1,14 +1,18 @@
 #include "BVHTree.h"
 
-BVHTree::BVHTree(RenderingContext * _context){
+BVHTree::BVHTree(RenderingContext * _context) : cache(_context){
     this->context = _context;
     context->boxes.clear();
+    context->nodes.clear();
+    context->linkedNodes.clear();
+    context->wideNodes.clear();
 }
 
 BoundingBox BVHTree::CreateLeaf(const uint32_t & objectID){
 
     BoundingBox box = BoundingBox();
     box.objectID = objectID;
+    box.primitiveCount = 1;
 
     Object & object = context->objects[objectID];
 
@@ -19,6 +23,26 @@ BoundingBox BVHTree::CreateLeaf(const uint32_t & objectID){
         box.minimalPosition = object.position-radiusVector;
         box.maximalPosition = object.position+radiusVector;
 
+    }else if( object.type == INSTANCE ){
+
+        const Instance & instance = context->instances[ object.instanceID ];
+        const BoundingBox & bounds = context->meshes[ instance.meshID ].bounds;
+
+        // Corners of mesh bounds moved to world
+        for(int32_t corner = 0; corner < 8; ++corner){
+
+            Vector3 point = Vector3(
+                corner & 1 ? bounds.maximalPosition.x : bounds.minimalPosition.x,
+                corner & 2 ? bounds.maximalPosition.y : bounds.minimalPosition.y,
+                corner & 4 ? bounds.maximalPosition.z : bounds.minimalPosition.z
+            );
+
+            point = instance.PointToWorld(point);
+
+            box.minimalPosition = Vector3::Minimal(box.minimalPosition, point);
+            box.maximalPosition = Vector3::Maximal(box.maximalPosition, point);
+        }
+
     }else {
 
         Vector3 A = object.vertices[0];
@@ -39,159 +63,2160 @@ BoundingBox BVHTree::CreateLeaf(const uint32_t & objectID){
     return box;
 }
 
+static const char * GetBuilderName(const BuilderType & builder){
+    return builder == LBVH_BUILDER ? "LBVH" : builder == SBVH_BUILDER ? "SBVH" : "SAH";
+}
+
 void BVHTree::BuildBVH(){
 
-    std::vector<int32_t> ids;
+    context->boxes.clear();
+    context->nodes.clear();
+    context->linkedNodes.clear();
+    context->wideNodes.clear();
 
-    for(int32_t id = 0; id < context->objects.size(); ++id){
-        ids.emplace_back(id);
-    }
+    if( context->objects.empty() )
+        return;
 
     Timepoint begin = Timer::GetCurrentTime();
 
-    Insert(ids);
+    std::vector<BVHNode> meshNodes;
+
+    uint64_t key = 0;
+    std::string cachePath;
+
+    if( !context->cacheDirectory.empty() ){
+        key = cache.CalculateKey();
+        cachePath = cache.GetPath(key);
+    }
+
+    bool cached = !cachePath.empty() && cache.Load(cachePath, key, order, context->boxes, meshNodes, context->meshes);
+
+    if( cached ){
+
+        ApplyOrder();
+
+    }else{
+
+        BuildTrees(meshNodes);
+
+        if( !cachePath.empty() )
+            cache.Save(cachePath, key, order, context->boxes, meshNodes, context->meshes);
+    }
+
+    MapCopies();
+
+    // Mesh nodes follow nodes of the world tree, so traversal still starts at zero
+    int32_t numWorldNodes = context->nodes.size();
+
+    for(BVHNode node : meshNodes){
+
+        if( node.primitiveCount == 0 )
+            node.offset += numWorldNodes;
+
+        context->nodes.emplace_back(node);
+    }
+
+    for(Mesh & mesh : context->meshes)
+        mesh.rootNode += numWorldNodes;
+
+    for(Instance & instance : context->instances){
+        instance.rootNode = context->meshes[instance.meshID].rootNode;
+        instance.numNodes = context->meshes[instance.meshID].numNodes;
+    }
+
+    if( context->stacklessTraversal )
+        LinkNodes();
+
+    if( context->wideBVH )
+        Collapse();
+
+    if( context->quantizedBVH )
+        Quantize();
+
+    CalculateStackSizes();
 
     Timepoint end = Timer::GetCurrentTime();
 
     double duration = Timer::GetDurationInSeconds(end - begin);
 
-    printf("BVH tree with %d nodes built in %0.6lf ms\n", context->boxes.size(), duration);
-    //CheckBalance(0);
+    printf("BVH tree with %d nodes %s in %0.6lf ms\n", context->nodes.size(), cached ? "loaded" : "built", duration * 1000.0);
+
+    if( !cached )
+        context->loggingService.Write(MessageType::INFO, "BVH tree built with %s builder on %d threads", GetBuilderName(context->bvhBuilder), GetNumChunks());
+
+    if( !context->meshes.empty() )
+        context->loggingService.Write(MessageType::INFO, "BVH tree shares %d nodes of %d meshes between %d instances", meshNodes.size(), context->meshes.size(), context->instances.size());
+
+    if( context->wideBVH )
+        context->loggingService.Write(MessageType::INFO, "BVH tree collapsed into %d nodes of width %d", context->wideNodes.size(), WIDE_NODE_WIDTH);
+
+    if( context->quantizedBVH )
+        context->loggingService.Write(MessageType::INFO, "BVH tree quantized into %d nodes of width %d taking %d bytes instead of %d", context->quantizedNodes.size(), QUANTIZED_NODE_WIDTH, context->quantizedNodes.size() * sizeof(QuantizedNode), numWorldNodes * sizeof(BVHNode));
+
+    ReportStatistics(CollectStatistics(numWorldNodes), duration, cached);
 }
 
-int32_t BVHTree::CalculateDepth(const int32_t & currentNode){
-    if( currentNode == -1 )
-        return 0;
+void BVHTree::BuildTrees(std::vector<BVHNode> & meshNodes){
+
+    order.resize(context->objects.size());
+    std::iota(order.begin(), order.end(), 0);
+
+    std::vector<Mesh> & meshes = context->meshes;
+
+    // Mesh trees go first, since bounds of their instances depend on them
+    for(uint32_t meshID = 0; meshID < meshes.size(); ++meshID){
+
+        Mesh & mesh = meshes[meshID];
+
+        uint32_t numCopies = BuildTree(mesh.firstObject, mesh.numObjects);
+
+        mesh.numObjects += numCopies;
+
+        for(uint32_t nextID = meshID + 1; nextID < meshes.size(); ++nextID)
+            meshes[nextID].firstObject += numCopies;
 
-    int32_t sizeLeft = CalculateDepth( context->boxes[currentNode].leftID );
-    int32_t sizeRight = CalculateDepth( context->boxes[currentNode].rightID );
+        mesh.bounds = context->boxes[0];
+        mesh.rootNode = meshNodes.size();
+        mesh.numNodes = context->nodes.size();
+
+        for(BVHNode node : context->nodes){
+
+            if( node.primitiveCount == 0 )
+                node.offset += mesh.rootNode;
+
+            meshNodes.emplace_back(node);
+        }
+
+    }
+
+    uint32_t numWorldObjects = context->meshes.empty() ? context->objects.size() : context->meshes[0].firstObject;
+
+    // Only world tree is kept in boxes, so refit ignores triangles of meshes
+    objectLeaves.assign(context->objects.size(), -1);
+
+    uint32_t numCopies = BuildTree(0, numWorldObjects);
+
+    // Copies of world objects push meshes further
+    for(Mesh & mesh : meshes)
+        mesh.firstObject += numCopies;
+
+    for(BVHNode & node : meshNodes){
+        if( node.primitiveCount > 0 )
+            node.offset += numCopies;
+    }
 
-    return 1 + sizeLeft + sizeRight;
 }
 
-void BVHTree::CheckBalance(const int32_t & currentNode){
-    if(currentNode == -1)
-        return;
+void BVHTree::ApplyOrder(){
+
+    std::vector<Object> & objects = context->objects;
+    std::vector<Object> ordered(order.size());
+
+    ParallelFor(order.size(), [this, &objects, &ordered](const uint32_t & chunk, const uint32_t & first, const uint32_t & last){
 
-    CheckBalance( context->boxes[currentNode].leftID );
-    CheckBalance( context->boxes[currentNode].rightID );
+        for(uint32_t index = first; index < last; ++index)
+            ordered[index] = objects[ order[index] ];
 
-    int32_t leftChild = context->boxes[currentNode].leftID;
-    int32_t rightChild = context->boxes[currentNode].rightID;
+    });
 
-    int32_t sizeLeft = CalculateDepth(leftChild);
-    int32_t sizeRight = CalculateDepth(rightChild);
+    objects.swap(ordered);
 
-    int32_t threshold = 2;
+    objectLeaves.assign(objects.size(), -1);
 
-    if( abs(sizeLeft - sizeRight) > threshold){
-        fprintf(stderr, "Unbalanced branch.\n");
+    Flatten();
+}
+
+void BVHTree::MapCopies(){
+
+    int32_t numSources = 0;
+
+    for(const int32_t & sourceID : order)
+        numSources = std::max(numSources, sourceID + 1);
+
+    copyOffsets.assign(numSources + 1, 0);
+    copies.resize(order.size());
+
+    for(const int32_t & sourceID : order)
+        ++copyOffsets[sourceID + 1];
+
+    for(int32_t sourceID = 0; sourceID < numSources; ++sourceID)
+        copyOffsets[sourceID + 1] += copyOffsets[sourceID];
+
+    // Objects are visited in current order, so copies of every object stay sorted
+    std::vector<int32_t> nextCopy(copyOffsets.begin(), copyOffsets.end() - 1);
+
+    for(int32_t objectID = 0; objectID < (int32_t)order.size(); ++objectID)
+        copies[ nextCopy[ order[objectID] ]++ ] = objectID;
+}
+
+uint32_t BVHTree::BuildTree(const uint32_t & first, const uint32_t & numObjects){
+
+    ThreadPool * pool = context->threadPool;
+
+    firstObject = first;
+
+    ids.resize(numObjects);
+    leaves.resize(numObjects);
+    centroids.resize(numObjects);
+
+    // Binary tree never has more than 2N-1 nodes, unused slots are trimmed after build
+    context->boxes.assign(2 * numObjects - 1, BoundingBox());
+
+    ParallelFor(numObjects, [this](const uint32_t & chunk, const uint32_t & first, const uint32_t & last){
+
+        for(uint32_t id = first; id < last; ++id){
+            ids[id] = id;
+            leaves[id] = CreateLeaf(firstObject + id);
+            centroids[id] = (leaves[id].minimalPosition + leaves[id].maximalPosition) * 0.5f;
+        }
+
+    });
+
+    if( context->bvhBuilder == LBVH_BUILDER ){
+
+        BuildLBVH();
+
+    }else{
+
+        tasks.clear();
+        tasks.push_back({0, numObjects, 0, -1});
+        busyWorkers = 0;
+        nextNode = 1;
+
+        if( context->bvhBuilder == SBVH_BUILDER ){
+
+            maxReferences = numObjects + (uint32_t)(numObjects * context->splitBudget);
+            numReferences = numObjects;
+            nextReference = 0;
+
+            // Leaves list references instead of objects, copies of split objects may take extra slots
+            ids.resize(maxReferences);
+            context->boxes.assign(2 * maxReferences - 1, BoundingBox());
+
+            BoundingBox rootBounds;
+            std::vector<BoundingBox> & references = tasks.back().references;
+            references.resize(numObjects);
+
+            for(uint32_t id = 0; id < numObjects; ++id){
+                references[id] = leaves[id];
+                references[id].objectID = id;
+                rootBounds.Expand(leaves[id]);
+            }
+
+            rootArea = CalculateArea(rootBounds);
+        }
+
+        if( pool != NULL ){
+            pool->Dispatch([this](const uint32_t & threadID){
+                BuildWorker();
+            });
+        }else{
+            BuildWorker();
+        }
+
+        context->boxes.resize(nextNode);
+
+        if( context->bvhBuilder == SBVH_BUILDER )
+            ids.resize(nextReference);
     }
 
+    uint32_t numCopies = ReorderObjects();
+
+    // Restructuring only changes inner boxes, so leaves keep their object ranges
+    if( context->treeletPasses > 0 )
+        OptimizeTreelets();
+
+    Flatten();
+
+    if( context->bvhBuilder == SBVH_BUILDER )
+        context->loggingService.Write(MessageType::INFO, "Spatial splits copied %d of %d objects", numCopies, numObjects);
+
+    return numCopies;
 }
 
-float BVHTree::CalculateArea(const BoundingBox & box){
+uint32_t BVHTree::GetNumChunks() const{
+    return context->threadPool != NULL ? context->threadPool->GetSize() : 1;
+}
 
-    Vector3 edgesLen = box.maximalPosition - box.minimalPosition;
+void BVHTree::ParallelFor(const uint32_t & count, const RangeTask & function){
 
-    float facesA = 2.0f * edgesLen.x * edgesLen.y;
-    float facesB = 2.0f * edgesLen.x * edgesLen.z;
-    float facesC = 2.0f * edgesLen.y * edgesLen.z;
+    uint32_t numChunks = GetNumChunks();
+    uint32_t chunkSize = (count + numChunks - 1) / numChunks;
+
+    if( context->threadPool == NULL ){
+        function(0, 0, count);
+        return;
+    }
+
+    context->threadPool->Dispatch([&function, count, chunkSize](const uint32_t & threadID){
+        uint32_t first = std::min(threadID * chunkSize, count);
+        uint32_t last = std::min(first + chunkSize, count);
+        function(threadID, first, last);
+    });
 
-    return facesA + facesB + facesC;
 }
 
+static uint32_t ExpandBits(uint32_t x){
+    x &= 0x3ff;
+    x = (x | x << 16) & 0x030000ff;
+    x = (x | x << 8) & 0x0300f00f;
+    x = (x | x << 4) & 0x030c30c3;
+    x = (x | x << 2) & 0x09249249;
+    return x;
+}
 
-int32_t BVHTree::FindBestAxis(const std::vector<int32_t> & ids){
+static uint64_t ExpandBits(uint64_t x){
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
 
-    float bestCost = INFINITY;
-    int32_t bestSplit = -1;
+int32_t BVHTree::CommonPrefix(const int32_t & first, const int32_t & second){
+
+    if( second < 0 || second >= (int32_t)codes.size() )
+        return -1;
+
+    uint64_t difference = codes[first] ^ codes[second];
+
+    // Equal codes are told apart by their position in sorted order
+    if( difference == 0 )
+        return 64 + __builtin_clz((uint32_t)(first ^ second));
+
+    return __builtin_clzll(difference);
+}
+
+void BVHTree::BuildLBVH(){
+
+    uint32_t numObjects = ids.size();
+    uint32_t numChunks = GetNumChunks();
+
+    BoundingBox centroidBounds;
+
+    for(uint32_t id = 0; id < numObjects; ++id){
+        centroidBounds.minimalPosition = Vector3::Minimal(centroidBounds.minimalPosition, centroids[id]);
+        centroidBounds.maximalPosition = Vector3::Maximal(centroidBounds.maximalPosition, centroids[id]);
+    }
+
+    Vector3 extent = centroidBounds.maximalPosition - centroidBounds.minimalPosition;
+    Vector3 scale = Vector3(
+        extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+        extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+        extent.z > 0.0f ? 1.0f / extent.z : 0.0f
+    );
+
+    // Large scenes get 21 bits per axis, otherwise 10 bits keep radix sort at four passes
+    bool longCodes = numObjects > LBVH_LONG_CODES_THRESHOLD;
+    uint32_t numPasses = longCodes ? 8 : 4;
+
+    codes.resize(numObjects);
+
+    ParallelFor(numObjects, [this, &centroidBounds, &scale, longCodes](const uint32_t & chunk, const uint32_t & first, const uint32_t & last){
+
+        for(uint32_t id = first; id < last; ++id){
+
+            Vector3 unit = (centroids[id] - centroidBounds.minimalPosition) * scale;
+
+            if( longCodes ){
+                uint64_t x = std::min(unit.x * 2097152.0f, 2097151.0f);
+                uint64_t y = std::min(unit.y * 2097152.0f, 2097151.0f);
+                uint64_t z = std::min(unit.z * 2097152.0f, 2097151.0f);
+                codes[id] = (ExpandBits(x) << 2) | (ExpandBits(y) << 1) | ExpandBits(z);
+            }else{
+                uint32_t x = std::min(unit.x * 1024.0f, 1023.0f);
+                uint32_t y = std::min(unit.y * 1024.0f, 1023.0f);
+                uint32_t z = std::min(unit.z * 1024.0f, 1023.0f);
+                codes[id] = (ExpandBits(x) << 2) | (ExpandBits(y) << 1) | ExpandBits(z);
+            }
+        }
+
+    });
+
+    // Least significant digit radix sort of ids by code, every chunk scatters its part to offsets counted in advance
+    std::vector<uint64_t> sortedCodes(numObjects);
+    std::vector<int32_t> sortedIDs(numObjects);
+    std::vector<uint32_t> offsets(numChunks * LBVH_RADIX);
+
+    for(uint32_t pass = 0; pass < numPasses; ++pass){
+
+        uint32_t shift = pass * LBVH_RADIX_BITS;
+
+        ParallelFor(numObjects, [this, &offsets, shift](const uint32_t & chunk, const uint32_t & first, const uint32_t & last){
+
+            uint32_t * histogram = offsets.data() + chunk * LBVH_RADIX;
+            std::fill(histogram, histogram + LBVH_RADIX, 0);
+
+            for(uint32_t index = first; index < last; ++index)
+                histogram[ (codes[index] >> shift) & (LBVH_RADIX - 1) ]++;
+
+        });
 
-    BoundingBox bestLeft, bestRight;
-    BoundingBox currentLeft, currentRight;
+        uint32_t sum = 0;
 
-    currentLeft.maximalPosition = Vector3(-INFINITY, -INFINITY, -INFINITY);
-    currentRight.maximalPosition = Vector3(-INFINITY, -INFINITY, -INFINITY);
-    currentLeft.minimalPosition = Vector3(INFINITY, INFINITY, INFINITY);
-    currentRight.minimalPosition = Vector3(INFINITY, INFINITY, INFINITY);
+        for(uint32_t digit = 0; digit < LBVH_RADIX; ++digit){
+            for(uint32_t chunk = 0; chunk < numChunks; ++chunk){
+                uint32_t count = offsets[chunk * LBVH_RADIX + digit];
+                offsets[chunk * LBVH_RADIX + digit] = sum;
+                sum += count;
+            }
+        }
+
+        ParallelFor(numObjects, [this, &offsets, &sortedCodes, &sortedIDs, shift](const uint32_t & chunk, const uint32_t & first, const uint32_t & last){
 
-    for (int32_t i = 0; i < ids.size(); ++i) {
+            uint32_t * offset = offsets.data() + chunk * LBVH_RADIX;
 
-        BoundingBox box = CreateLeaf(ids[i]);
+            for(uint32_t index = first; index < last; ++index){
+                uint32_t destination = offset[ (codes[index] >> shift) & (LBVH_RADIX - 1) ]++;
+                sortedCodes[destination] = codes[index];
+                sortedIDs[destination] = ids[index];
+            }
 
-        currentRight.minimalPosition = Vector3::Minimal(currentRight.minimalPosition, box.minimalPosition);
-        currentRight.maximalPosition = Vector3::Maximal(currentRight.maximalPosition, box.maximalPosition);
+        });
+
+        codes.swap(sortedCodes);
+        ids.swap(sortedIDs);
     }
 
-    for (int32_t id = 1; id < ids.size(); ++id) {
+    // Internal nodes take first N-1 slots with root at zero, leaves follow in sorted order (Karras 2012)
+    int32_t numInternal = numObjects - 1;
+    std::vector<BoundingBox> & boxes = context->boxes;
+
+    boxes[0].parentID = -1;
+
+    ParallelFor(numInternal, [this, &boxes, numInternal](const uint32_t & chunk, const uint32_t & first, const uint32_t & last){
+
+        for(int32_t node = first; node < (int32_t)last; ++node){
+
+            int32_t direction = CommonPrefix(node, node + 1) > CommonPrefix(node, node - 1) ? 1 : -1;
+            int32_t minimalPrefix = CommonPrefix(node, node - direction);
+
+            int32_t maximalLength = 2;
+
+            while( CommonPrefix(node, node + maximalLength * direction) > minimalPrefix )
+                maximalLength <<= 1;
+
+            int32_t length = 0;
+
+            for(int32_t step = maximalLength >> 1; step > 0; step >>= 1){
+                if( CommonPrefix(node, node + (length + step) * direction) > minimalPrefix )
+                    length += step;
+            }
+
+            int32_t other = node + length * direction;
+            int32_t nodePrefix = CommonPrefix(node, other);
+
+            int32_t split = 0;
+            int32_t step = length;
+
+            do{
+                step = (step + 1) >> 1;
+
+                if( CommonPrefix(node, node + (split + step) * direction) > nodePrefix )
+                    split += step;
+
+            }while( step > 1 );
 
-        BoundingBox box = CreateLeaf(ids[id]);
+            int32_t gamma = node + split * direction + std::min(direction, 0);
 
-        currentLeft.minimalPosition = Vector3::Minimal(currentLeft.minimalPosition, box.minimalPosition);
-        currentLeft.maximalPosition = Vector3::Maximal(currentLeft.maximalPosition, box.maximalPosition);
-        currentRight.minimalPosition = Vector3::Minimal(currentRight.minimalPosition, box.minimalPosition);
-        currentRight.maximalPosition = Vector3::Maximal(currentRight.maximalPosition, box.maximalPosition);
+            int32_t leftID = std::min(node, other) == gamma ? numInternal + gamma : gamma;
+            int32_t rightID = std::max(node, other) == gamma + 1 ? numInternal + gamma + 1 : gamma + 1;
 
-        float splitCost = CalculateArea(currentLeft) * id + CalculateArea(currentRight) * (ids.size() - id);
+            boxes[node].leftID = leftID;
+            boxes[node].rightID = rightID;
+            boxes[node].objectID = -1;
 
-        if (splitCost < bestCost) {
-            bestCost = splitCost;
-            bestSplit = id;
-            bestLeft = currentLeft;
-            bestRight = currentRight;
+            boxes[leftID].parentID = node;
+            boxes[rightID].parentID = node;
+        }
+
+    });
+
+    // Bounds are merged bottom up, second child to reach a node continues with its parent
+    std::vector<std::atomic<uint32_t>> arrivals(numInternal);
+
+    ParallelFor(numObjects, [this, &boxes, &arrivals, numInternal](const uint32_t & chunk, const uint32_t & first, const uint32_t & last){
+
+        for(uint32_t index = first; index < last; ++index){
+
+            int32_t nodeID = numInternal + index;
+            int32_t parentID = boxes[nodeID].parentID;
+
+            boxes[nodeID] = leaves[ ids[index] ];
+            boxes[nodeID].objectID = firstObject + index;
+            boxes[nodeID].parentID = parentID;
+
+            while( parentID != -1 && arrivals[parentID].fetch_add(1, std::memory_order_acq_rel) == 1 ){
+
+                BoundingBox & parent = boxes[parentID];
+                parent.minimalPosition = Vector3::Minimal(boxes[parent.leftID].minimalPosition, boxes[parent.rightID].minimalPosition);
+                parent.maximalPosition = Vector3::Maximal(boxes[parent.leftID].maximalPosition, boxes[parent.rightID].maximalPosition);
+
+                parentID = parent.parentID;
+            }
+        }
+
+    });
+}
+
+void BVHTree::BuildWorker(){
+
+    while( true ){
+
+        BuildTask task;
+
+        {
+            std::unique_lock<std::mutex> guard(taskLock);
+
+            taskReady.wait(guard, [this](){
+                return !tasks.empty() || busyWorkers == 0;
+            });
+
+            if( tasks.empty() )
+                return;
+
+            task = std::move(tasks.back());
+            tasks.pop_back();
+            busyWorkers++;
+        }
+
+        if( context->bvhBuilder == SBVH_BUILDER ){
+            BuildSpatial(std::move(task));
+        }else{
+            Build(task);
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(taskLock);
+
+            if( --busyWorkers == 0 && tasks.empty() )
+                taskReady.notify_all();
         }
     }
 
-    return bestSplit;
 }
 
-int32_t BVHTree::Insert(std::vector<int32_t> & ids, const int32_t & parentID, const uint32_t & depth){
+void BVHTree::Build(BuildTask task){
 
-    if( ids.empty() )
-        return -1;
+    while( true ){
+
+        BoundingBox bounds;
+        uint32_t middle = Split(task.begin, task.end, bounds);
+
+        if( middle == task.end ){
+
+            // Objects of the leaf are moved to its range by reordering after build
+            bounds.objectID = firstObject + task.begin;
+            bounds.primitiveCount = task.end - task.begin;
+            bounds.parentID = task.parentID;
+
+            context->boxes[task.nodeID] = bounds;
+            return;
+        }
+
+        // Siblings take two consecutive slots
+        int32_t leftID = nextNode.fetch_add(2);
+        int32_t rightID = leftID + 1;
 
-    if( ids.size() == 1 ){
-        BoundingBox box = CreateLeaf( ids[0] );
-        int32_t boxID = context->boxes.size();
-        context->boxes.emplace_back(box);
-        return boxID;
+        bounds.parentID = task.parentID;
+        bounds.leftID = leftID;
+        bounds.rightID = rightID;
+
+        context->boxes[task.nodeID] = bounds;
+
+        BuildTask right = {middle, task.end, rightID, task.nodeID};
+
+        if( task.end - middle >= PARALLEL_BUILD_THRESHOLD ){
+
+            std::lock_guard<std::mutex> guard(taskLock);
+            tasks.push_back(right);
+            taskReady.notify_one();
+
+        }else{
+            Build(right);
+        }
+
+        task = {task.begin, middle, leftID, task.nodeID};
     }
 
-    int32_t currentNodeID = context->boxes.size();
+}
+
+uint32_t BVHTree::ReorderObjects(){
 
-    int32_t splitAxis = depth%3;
-    int32_t bestSplit = ids.size() >> 1;
-    // TODO : Heuristic split
+    Object * objects = context->objects.data() + firstObject;
+    int32_t * originalIDs = order.data() + firstObject;
 
-    std::vector<Object> & objects = context->objects;
+    std::vector<Object> ordered(ids.size());
+    std::vector<int32_t> orderedIDs(ids.size());
 
-    std::nth_element(ids.begin(), ids.begin() + bestSplit, ids.end(),
-        [splitAxis, &objects](const int32_t & a, const int32_t & b){
-            return objects[a].position[splitAxis] < objects[b].position[splitAxis];
+    ParallelFor(ids.size(), [this, objects, originalIDs, &ordered, &orderedIDs](const uint32_t & chunk, const uint32_t & first, const uint32_t & last){
+
+        for(uint32_t index = first; index < last; ++index){
+            ordered[index] = objects[ ids[index] ];
+            orderedIDs[index] = originalIDs[ ids[index] ];
         }
-    );
 
-    std::vector<int32_t> left(ids.begin(), ids.begin() + bestSplit);
-    std::vector<int32_t> right(ids.begin() + bestSplit, ids.end());
+    });
+
+    // Objects referenced by several leaves of spatial split tree are copied once per leaf
+    uint32_t numCopies = ids.size() - leaves.size();
+    uint32_t end = firstObject + leaves.size();
+
+    if( numCopies > 0 ){
+        context->objects.insert(context->objects.begin() + end, numCopies, Object{});
+        order.insert(order.begin() + end, numCopies, -1);
+    }
+
+    std::copy(ordered.begin(), ordered.end(), context->objects.begin() + firstObject);
+    std::copy(orderedIDs.begin(), orderedIDs.end(), order.begin() + firstObject);
+
+    return numCopies;
+}
+
+static void StoreBounds(BVHNode & node, const BoundingBox & box){
+
+    node.minimalPosition[0] = box.minimalPosition.x;
+    node.minimalPosition[1] = box.minimalPosition.y;
+    node.minimalPosition[2] = box.minimalPosition.z;
+
+    node.maximalPosition[0] = box.maximalPosition.x;
+    node.maximalPosition[1] = box.maximalPosition.y;
+    node.maximalPosition[2] = box.maximalPosition.z;
+}
+
+static void StoreBounds(WideNode & node, const int32_t & slot, const BoundingBox & box){
+
+    node.minimalX[slot] = box.minimalPosition.x;
+    node.minimalY[slot] = box.minimalPosition.y;
+    node.minimalZ[slot] = box.minimalPosition.z;
+
+    node.maximalX[slot] = box.maximalPosition.x;
+    node.maximalY[slot] = box.maximalPosition.y;
+    node.maximalZ[slot] = box.maximalPosition.z;
+}
+
+void BVHTree::Flatten(){
+
+    std::vector<BoundingBox> & boxes = context->boxes;
+    std::vector<BVHNode> & nodes = context->nodes;
+
+    nodes.resize(boxes.size());
+    boxNodes.resize(boxes.size());
+    levels.resize(boxes.size());
+    objectLeaves.resize(context->objects.size(), -1);
+    boxSlots.assign(boxes.size(), -1);
+    dirty.assign(boxes.size(), false);
+
+    // Each entry holds box and flattened node waiting for index of its second child
+    std::vector< std::pair<int32_t, int32_t> > stack;
+    stack.emplace_back(0, -1);
+
+    int32_t nodeID = 0;
+
+    while( !stack.empty() ){
 
-    BoundingBox temp = BoundingBox();
-    temp.parentID = parentID;
+        int32_t boxID = stack.back().first;
+        int32_t parentID = stack.back().second;
+        stack.pop_back();
 
-    context->boxes.emplace_back(temp);
+        const BoundingBox & box = boxes[boxID];
+        BVHNode & node = nodes[nodeID];
 
-    int32_t leftChildID = Insert(left, currentNodeID, depth + 1);
-    int32_t rightChildID = Insert(right, currentNodeID, depth + 1);
+        if( parentID != -1 )
+            nodes[parentID].offset = nodeID;
 
-    if( leftChildID > 0)
-        context->boxes[currentNodeID].minimalPosition = Vector3::Minimal(context->boxes[leftChildID].minimalPosition, context->boxes[rightChildID].minimalPosition);
+        StoreBounds(node, box);
 
-    if( rightChildID > 0)
-        context->boxes[currentNodeID].maximalPosition = Vector3::Maximal(context->boxes[leftChildID].maximalPosition, context->boxes[rightChildID].maximalPosition);
+        // Parent box always precedes its children in depth first order
+        boxNodes[boxID] = nodeID;
+        levels[boxID] = box.parentID != -1 ? levels[box.parentID] + 1 : 0;
+
+        if( box.objectID != -1 ){
+            node.offset = box.objectID;
+            node.primitiveCount = box.primitiveCount;
+
+            for(int32_t objectID = box.objectID; objectID < box.objectID + box.primitiveCount; ++objectID)
+                objectLeaves[objectID] = boxID;
+
+        }else{
+            node.primitiveCount = 0;
+            stack.emplace_back(box.rightID, nodeID);
+            stack.emplace_back(box.leftID, -1);
+        }
+
+        ++nodeID;
+    }
+
+}
+
+void BVHTree::LinkNodes(){
+
+    std::vector<BVHNode> & nodes = context->nodes;
+    std::vector<BVHNode> & linkedNodes = context->linkedNodes;
+
+    linkedNodes = nodes;
+
+    // Subtree of inner node ends where subtree of its second child does, which always lies further
+    for(int32_t nodeID = nodes.size() - 1; nodeID >= 0; --nodeID){
+
+        if( nodes[nodeID].primitiveCount > 0 )
+            continue;
+
+        int32_t secondID = nodes[nodeID].offset;
+
+        linkedNodes[nodeID].offset = nodes[secondID].primitiveCount > 0 ? secondID + 1 : linkedNodes[secondID].offset;
+    }
+
+}
+
+int32_t BVHTree::OpenChildren(const int32_t & boxID, const int32_t & width, int32_t * children){
+
+    std::vector<BoundingBox> & boxes = context->boxes;
+    int32_t numChildren = 0;
+
+    if( boxes[boxID].objectID != -1 ){
+        children[numChildren++] = boxID;
+    }else{
+        children[numChildren++] = boxes[boxID].leftID;
+        children[numChildren++] = boxes[boxID].rightID;
+    }
+
+    // Inner child of largest area is replaced by its own children, as it is the most likely to be entered
+    while( numChildren < width ){
+
+        int32_t best = -1;
+        float bestArea = -1.0f;
+
+        for(int32_t slot = 0; slot < numChildren; ++slot){
+
+            const BoundingBox & child = boxes[ children[slot] ];
+
+            if( child.objectID == -1 && CalculateArea(child) > bestArea ){
+                best = slot;
+                bestArea = CalculateArea(child);
+            }
+
+        }
+
+        if( best == -1 )
+            break;
+
+        int32_t openedID = children[best];
+        children[best] = boxes[openedID].leftID;
+        children[numChildren++] = boxes[openedID].rightID;
+    }
 
-    context->boxes[currentNodeID].rightID = rightChildID;
-    context->boxes[currentNodeID].leftID  = leftChildID;
+    return numChildren;
+}
+
+void BVHTree::Collapse(){
+
+    std::vector<BoundingBox> & boxes = context->boxes;
+    std::vector<WideNode> & wideNodes = context->wideNodes;
+
+    wideNodes.clear();
+    wideNodes.emplace_back();
+
+    // Each entry holds box and wide node created for it
+    std::vector< std::pair<int32_t, int32_t> > stack;
+    stack.emplace_back(0, 0);
+
+    while( !stack.empty() ){
+
+        int32_t boxID = stack.back().first;
+        int32_t wideID = stack.back().second;
+        stack.pop_back();
+
+        int32_t children[WIDE_NODE_WIDTH];
+        int32_t numChildren = OpenChildren(boxID, WIDE_NODE_WIDTH, children);
+
+        WideNode node;
+
+        for(int32_t slot = 0; slot < numChildren; ++slot){
+
+            const BoundingBox & child = boxes[ children[slot] ];
+
+            StoreBounds(node, slot, child);
+            boxSlots[ children[slot] ] = wideID * WIDE_NODE_WIDTH + slot;
+
+            if( child.objectID != -1 ){
+                node.children[slot] = child.objectID;
+                node.primitiveCounts[slot] = child.primitiveCount;
+            }else{
+                node.children[slot] = wideNodes.size();
+                stack.emplace_back(children[slot], wideNodes.size());
+                wideNodes.emplace_back();
+            }
+
+        }
+
+        wideNodes[wideID] = node;
+    }
+
+}
+
+void BVHTree::Quantize(){
+
+    std::vector<BoundingBox> & boxes = context->boxes;
+    std::vector<QuantizedNode> & quantizedNodes = context->quantizedNodes;
+
+    quantizedNodes.assign(1, QuantizedNode());
+    quantizedBoxes.assign(1, 0);
+    quantizedChildren.assign(QUANTIZED_NODE_WIDTH, -1);
+    quantizedSlots.assign(boxes.size(), -1);
+
+    std::vector<int32_t> stack;
+    stack.emplace_back(0);
+
+    while( !stack.empty() ){
+
+        int32_t nodeID = stack.back();
+        stack.pop_back();
+
+        int32_t children[QUANTIZED_NODE_WIDTH];
+        int32_t numChildren = OpenChildren(quantizedBoxes[nodeID], QUANTIZED_NODE_WIDTH, children);
+
+        for(int32_t slot = 0; slot < numChildren; ++slot){
+
+            const BoundingBox & child = boxes[ children[slot] ];
+            int32_t index = nodeID * QUANTIZED_NODE_WIDTH + slot;
+
+            quantizedChildren[index] = children[slot];
+            quantizedSlots[ children[slot] ] = index;
+
+            if( child.objectID != -1 ){
+                quantizedNodes[nodeID].children[slot] = child.objectID;
+                quantizedNodes[nodeID].primitiveCounts[slot] = child.primitiveCount;
+            }else{
+                quantizedNodes[nodeID].children[slot] = quantizedNodes.size();
+                stack.emplace_back(quantizedNodes.size());
+
+                quantizedNodes.emplace_back();
+                quantizedBoxes.emplace_back(children[slot]);
+                quantizedChildren.resize(quantizedChildren.size() + QUANTIZED_NODE_WIDTH, -1);
+            }
+
+        }
+
+        quantizedNodes[nodeID].numChildren = numChildren;
+
+        QuantizeBounds(nodeID);
+    }
+
+}
+
+void BVHTree::QuantizeBounds(const int32_t & nodeID){
+
+    QuantizedNode & node = context->quantizedNodes[nodeID];
+    const BoundingBox & box = context->boxes[ quantizedBoxes[nodeID] ];
+
+    float scales[3];
+
+    // Smallest power of two step whose grid still covers the whole node
+    for(int32_t axis = 0; axis < 3; ++axis){
+
+        float extent = box.maximalPosition[axis] - box.minimalPosition[axis];
+        int32_t exponent = QUANTIZED_MIN_EXPONENT;
+
+        if( extent > 0.0f ){
+
+            exponent = (int32_t)std::ceil(std::log2(extent / QUANTIZED_GRID_STEPS));
+
+            if( std::ldexp((float)QUANTIZED_GRID_STEPS, exponent) < extent )
+                ++exponent;
+        }
+
+        exponent = std::min(std::max(exponent, QUANTIZED_MIN_EXPONENT), QUANTIZED_MAX_EXPONENT);
+
+        node.origin[axis] = box.minimalPosition[axis];
+        node.exponents[axis] = exponent;
+        scales[axis] = QuantizedNode::Scale(exponent);
+    }
+
+    for(int32_t slot = 0; slot < QUANTIZED_NODE_WIDTH; ++slot){
+
+        int32_t childID = quantizedChildren[nodeID * QUANTIZED_NODE_WIDTH + slot];
+
+        if( childID == -1 )
+            continue;
+
+        const BoundingBox & child = context->boxes[childID];
+
+        for(int32_t axis = 0; axis < 3; ++axis){
+
+            float origin = node.origin[axis];
+            float scale = scales[axis];
+
+            int32_t minimal = (int32_t)std::floor((child.minimalPosition[axis] - origin) / scale);
+            int32_t maximal = (int32_t)std::ceil((child.maximalPosition[axis] - origin) / scale);
+
+            minimal = std::min(std::max(minimal, 0), QUANTIZED_GRID_STEPS);
+            maximal = std::min(std::max(maximal, 0), QUANTIZED_GRID_STEPS);
+
+            // Decoding rounds too, so offsets are moved until decoded bounds enclose the child
+            while( minimal > 0 && origin + minimal * scale > child.minimalPosition[axis] )
+                --minimal;
+
+            while( maximal < QUANTIZED_GRID_STEPS && origin + maximal * scale < child.maximalPosition[axis] )
+                ++maximal;
+
+            node.minimal[axis][slot] = minimal;
+            node.maximal[axis][slot] = maximal;
+        }
+
+    }
+
+}
+
+void BVHTree::RefitBox(const int32_t & boxID){
+
+    BoundingBox & box = context->boxes[boxID];
+
+    if( box.objectID != -1 ){
+
+        box.minimalPosition = Vector3(INFINITY, INFINITY, INFINITY);
+        box.maximalPosition = Vector3(-INFINITY, -INFINITY, -INFINITY);
+
+        for(int32_t objectID = box.objectID; objectID < box.objectID + box.primitiveCount; ++objectID)
+            box.Expand( CreateLeaf(objectID) );
+
+    }else{
+        box.minimalPosition = Vector3::Minimal(context->boxes[box.leftID].minimalPosition, context->boxes[box.rightID].minimalPosition);
+        box.maximalPosition = Vector3::Maximal(context->boxes[box.leftID].maximalPosition, context->boxes[box.rightID].maximalPosition);
+    }
+
+    int32_t nodeID = boxNodes[boxID];
+
+    StoreBounds(context->nodes[nodeID], box);
+
+    if( !context->linkedNodes.empty() )
+        StoreBounds(context->linkedNodes[nodeID], box);
+
+    if( !context->wideNodes.empty() && boxSlots[boxID] != -1 )
+        StoreBounds(context->wideNodes[ boxSlots[boxID] / WIDE_NODE_WIDTH ], boxSlots[boxID] % WIDE_NODE_WIDTH, box);
+}
+
+void BVHTree::Refit(const std::vector<int32_t> & sourceIDs){
+
+    std::vector<BoundingBox> & boxes = context->boxes;
+
+    // Spatial splits copy object into every leaf it was clipped into, all of them have moved
+    std::vector<int32_t> objectIDs;
+
+    for(const int32_t & sourceID : sourceIDs)
+        GetCopies(sourceID, objectIDs);
+
+    context->changedObjects.insert(context->changedObjects.end(), objectIDs.begin(), objectIDs.end());
+
+    if( boxes.empty() )
+        return;
+
+    // Every box above a moved object is refitted once, boxes are grouped by depth
+    for(const int32_t & objectID : objectIDs){
+
+        int32_t boxID = objectLeaves[objectID];
+
+        while( boxID != -1 && !dirty[boxID] ){
+
+            dirty[boxID] = true;
+
+            if( levels[boxID] >= (int32_t)dirtyLevels.size() )
+                dirtyLevels.resize(levels[boxID] + 1);
+
+            dirtyLevels[ levels[boxID] ].emplace_back(boxID);
+            boxID = boxes[boxID].parentID;
+        }
+
+    }
+
+    // Deepest level goes first, so children are final before their parents merge them
+    for(int32_t level = dirtyLevels.size() - 1; level >= 0; --level){
+
+        std::vector<int32_t> & levelBoxes = dirtyLevels[level];
+
+        if( levelBoxes.size() >= PARALLEL_REFIT_THRESHOLD ){
+
+            ParallelFor(levelBoxes.size(), [this, &levelBoxes](const uint32_t & chunk, const uint32_t & first, const uint32_t & last){
+                for(uint32_t index = first; index < last; ++index)
+                    RefitBox(levelBoxes[index]);
+            });
+
+        }else{
+
+            for(const int32_t & boxID : levelBoxes)
+                RefitBox(boxID);
+
+        }
+
+        for(const int32_t & boxID : levelBoxes){
+            dirty[boxID] = false;
+            context->changedNodes.emplace_back(boxNodes[boxID]);
+
+            if( !context->quantizedNodes.empty() && quantizedSlots[boxID] != -1 )
+                context->changedQuantizedNodes.emplace_back(quantizedSlots[boxID] / QUANTIZED_NODE_WIDTH);
+        }
+
+        levelBoxes.clear();
+    }
+
+    // Grid of a node depends on all its children, so each node with a changed child is quantized again once
+    std::vector<int32_t> & changedQuantizedNodes = context->changedQuantizedNodes;
+
+    std::sort(changedQuantizedNodes.begin(), changedQuantizedNodes.end());
+    changedQuantizedNodes.erase(std::unique(changedQuantizedNodes.begin(), changedQuantizedNodes.end()), changedQuantizedNodes.end());
+
+    ParallelFor(changedQuantizedNodes.size(), [this, &changedQuantizedNodes](const uint32_t & chunk, const uint32_t & first, const uint32_t & last){
+        for(uint32_t index = first; index < last; ++index)
+            QuantizeBounds(changedQuantizedNodes[index]);
+    });
+}
+
+void BVHTree::RestructureTreelet(const int32_t & rootID){
+
+    std::vector<BoundingBox> & boxes = context->boxes;
+    BoundingBox & root = boxes[rootID];
+
+    costs[rootID] = SAH_TRAVERSAL_COST * CalculateArea(root) + costs[root.leftID] + costs[root.rightID];
+
+    // Treelet grows by opening its leaf of largest area, leaves of the tree can't be opened
+    int32_t treeletLeaves[TREELET_SIZE] = {root.leftID, root.rightID};
+    int32_t treeletNodes[TREELET_SIZE - 1] = {rootID};
+    int32_t numLeaves = 2;
+
+    while( numLeaves < TREELET_SIZE ){
+
+        int32_t opened = -1;
+        float openedArea = -1.0f;
+
+        for(int32_t slot = 0; slot < numLeaves; ++slot){
+
+            const BoundingBox & box = boxes[ treeletLeaves[slot] ];
+            float area = CalculateArea(box);
+
+            if( box.objectID == -1 && area > openedArea ){
+                opened = slot;
+                openedArea = area;
+            }
+        }
+
+        if( opened == -1 )
+            break;
+
+        int32_t openedID = treeletLeaves[opened];
+
+        treeletNodes[numLeaves - 1] = openedID;
+        treeletLeaves[opened] = boxes[openedID].leftID;
+        treeletLeaves[numLeaves++] = boxes[openedID].rightID;
+    }
+
+    // Two leaves have only one topology
+    if( numLeaves < 3 )
+        return;
+
+    uint32_t numSubsets = 1 << numLeaves;
+
+    BoundingBox bounds[TREELET_SUBSETS];
+    float subsetCosts[TREELET_SUBSETS];
+    uint32_t partitions[TREELET_SUBSETS];
+    int32_t subsetLeaves[TREELET_SUBSETS];
+
+    for(int32_t slot = 0; slot < numLeaves; ++slot){
+        bounds[1 << slot] = boxes[ treeletLeaves[slot] ];
+        subsetCosts[1 << slot] = costs[ treeletLeaves[slot] ];
+        subsetLeaves[1 << slot] = treeletLeaves[slot];
+    }
+
+    // Every proper subset has lower mask than its superset, so cheapest topologies of parts are already known
+    for(uint32_t subset = 1; subset < numSubsets; ++subset){
+
+        uint32_t lowest = subset & (~subset + 1);
+
+        if( subset == lowest )
+            continue;
+
+        bounds[subset] = bounds[subset ^ lowest];
+        bounds[subset].Expand(bounds[lowest]);
+
+        float bestCost = INFINITY;
+        uint32_t bestPartition = lowest;
+
+        // Left part always holds lowest leaf, which skips mirrored partitions
+        for(uint32_t part = (subset - 1) & subset; part > 0; part = (part - 1) & subset){
+
+            if( (part & lowest) == 0 )
+                continue;
+
+            float cost = subsetCosts[part] + subsetCosts[subset ^ part];
+
+            if( cost < bestCost ){
+                bestCost = cost;
+                bestPartition = part;
+            }
+        }
+
+        subsetCosts[subset] = SAH_TRAVERSAL_COST * CalculateArea(bounds[subset]) + bestCost;
+        partitions[subset] = bestPartition;
+    }
+
+    uint32_t treelet = numSubsets - 1;
+
+    if( subsetCosts[treelet] >= costs[rootID] * TREELET_COST_TOLERANCE )
+        return;
+
+    // Root keeps its slot and parent, opened boxes take remaining inner nodes
+    std::pair<int32_t, uint32_t> stack[TREELET_SIZE];
+    int32_t size = 0;
+    int32_t nextInner = 1;
+
+    stack[size++] = std::make_pair(rootID, treelet);
+
+    while( size > 0 ){
+
+        int32_t boxID = stack[size - 1].first;
+        uint32_t subset = stack[size - 1].second;
+        --size;
+
+        BoundingBox & box = boxes[boxID];
+        box.minimalPosition = bounds[subset].minimalPosition;
+        box.maximalPosition = bounds[subset].maximalPosition;
+
+        costs[boxID] = subsetCosts[subset];
+
+        uint32_t parts[2] = {partitions[subset], subset ^ partitions[subset]};
+        int32_t children[2];
+
+        for(int32_t side = 0; side < 2; ++side){
+
+            if( (parts[side] & (parts[side] - 1)) == 0 ){
+                children[side] = subsetLeaves[ parts[side] ];
+            }else{
+                children[side] = treeletNodes[nextInner++];
+                stack[size++] = std::make_pair(children[side], parts[side]);
+            }
+
+            boxes[ children[side] ].parentID = boxID;
+        }
+
+        box.leftID = children[0];
+        box.rightID = children[1];
+    }
+
+}
+
+void BVHTree::OptimizeTreelets(){
+
+    std::vector<BoundingBox> & boxes = context->boxes;
+
+    if( boxes.size() < 3 )
+        return;
+
+    Timepoint begin = Timer::GetCurrentTime();
+
+    float initialCost = CalculateCost(0);
+    float initialSteps = MeasureSteps();
+
+    std::vector<int32_t> leafIDs;
+
+    for(uint32_t boxID = 0; boxID < boxes.size(); ++boxID){
+        if( boxes[boxID].objectID != -1 )
+            leafIDs.emplace_back(boxID);
+    }
+
+    costs.resize(boxes.size());
+
+    for(uint32_t pass = 0; pass < context->treeletPasses; ++pass){
+
+        // Second child to reach a box restructures treelet under it and continues with its parent (Karras 2013)
+        std::vector<std::atomic<uint32_t>> arrivals(boxes.size());
+
+        ParallelFor(leafIDs.size(), [this, &boxes, &leafIDs, &arrivals](const uint32_t & chunk, const uint32_t & first, const uint32_t & last){
+
+            for(uint32_t index = first; index < last; ++index){
+
+                const BoundingBox & leaf = boxes[ leafIDs[index] ];
+                costs[ leafIDs[index] ] = SAH_INTERSECTION_COST * leaf.primitiveCount * CalculateArea(leaf);
+
+                int32_t parentID = leaf.parentID;
+
+                while( parentID != -1 && arrivals[parentID].fetch_add(1, std::memory_order_acq_rel) == 1 ){
+                    RestructureTreelet(parentID);
+                    parentID = boxes[parentID].parentID;
+                }
+            }
+
+        });
+    }
+
+    Timepoint end = Timer::GetCurrentTime();
+
+    context->loggingService.Write(MessageType::INFO, "Treelet restructuring lowered SAH cost from %f to %f in %d passes (%0.3lf ms)", initialCost, CalculateCost(0), context->treeletPasses, Timer::GetDurationInSeconds(end - begin) * 1000.0);
+    context->loggingService.Write(MessageType::INFO, "Treelet restructuring changed traversal steps per ray from %f to %f", initialSteps, MeasureSteps());
+}
+
+static float IntersectBounds(const Ray & ray, const Vector3 & inverseDirection, const BoundingBox & box){
+
+    Vector3 lower = (box.minimalPosition - ray.origin) * inverseDirection;
+    Vector3 upper = (box.maximalPosition - ray.origin) * inverseDirection;
+
+    Vector3 nearest = Vector3::Minimal(lower, upper);
+    Vector3 farthest = Vector3::Maximal(lower, upper);
+
+    float entry = std::max(std::max(nearest.x, nearest.y), std::max(nearest.z, 0.0f));
+    float exit = std::min(std::min(farthest.x, farthest.y), farthest.z);
+
+    return entry <= exit ? entry : INFINITY;
+}
+
+static float IntersectTriangle(const Ray & ray, const Object & object){
+
+    Vector3 edgeA = object.vertices[1] - object.vertices[0];
+    Vector3 edgeB = object.vertices[2] - object.vertices[0];
+
+    Vector3 normal = Vector3::CrossProduct(ray.direction, edgeB);
+    float determinant = Vector3::DotProduct(edgeA, normal);
+
+    if( fabsf(determinant) < TREELET_MEASURED_EPSILON )
+        return INFINITY;
+
+    float inverse = 1.0f / determinant;
+    Vector3 offset = ray.origin - object.vertices[0];
+
+    float u = Vector3::DotProduct(offset, normal) * inverse;
+
+    if( u < 0.0f || u > 1.0f )
+        return INFINITY;
+
+    Vector3 cross = Vector3::CrossProduct(offset, edgeA);
+    float v = Vector3::DotProduct(ray.direction, cross) * inverse;
+
+    if( v < 0.0f || u + v > 1.0f )
+        return INFINITY;
+
+    float length = Vector3::DotProduct(edgeB, cross) * inverse;
+
+    return length > 0.0f ? length : INFINITY;
+}
+
+float BVHTree::MeasureSteps(){
+
+    const std::vector<BoundingBox> & boxes = context->boxes;
+
+    Vector3 center = (boxes[0].minimalPosition + boxes[0].maximalPosition) * 0.5f;
+    float radius = (boxes[0].maximalPosition - center).Magnitude();
+
+    std::vector<uint64_t> steps(GetNumChunks(), 0);
+
+    // Same rays are traced for every tree, seeded by their index
+    ParallelFor(TREELET_MEASURED_RAYS, [this, &boxes, &steps, center, radius](const uint32_t & chunk, const uint32_t & first, const uint32_t & last){
+
+        // Restructured trees are not balanced, so stack of each worker grows with their depth
+        std::vector< std::pair<int32_t, float> > stack;
+
+        for(uint32_t rayID = first; rayID < last; ++rayID){
+
+            uint32_t seed = rayID + 1;
+
+            Vector3 direction = Vector3(Random::UniformRandom(seed), Random::UniformRandom(seed), Random::UniformRandom(seed)).Normalize();
+            Vector3 target = boxes[0].minimalPosition + (boxes[0].maximalPosition - boxes[0].minimalPosition) * Vector3(Random::Rand(seed), Random::Rand(seed), Random::Rand(seed));
+
+            Ray ray;
+            ray.origin = center + direction * radius;
+            ray.direction = (target - ray.origin).Normalize();
+
+            Vector3 inverseDirection = Vector3(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+
+            float minLength = INFINITY;
+
+            stack.clear();
+            stack.emplace_back(0, 0.0f);
+
+            while( !stack.empty() ){
+
+                int32_t boxID = stack.back().first;
+                float entry = stack.back().second;
+                stack.pop_back();
+
+                if( entry >= minLength )
+                    continue;
+
+                const BoundingBox & box = boxes[boxID];
+
+                ++steps[chunk];
+
+                if( box.objectID != -1 ){
+
+                    for(int32_t id = box.objectID; id < box.objectID + box.primitiveCount; ++id){
+
+                        const Object & object = context->objects[id];
+
+                        // Other objects are hit at their bounds, trees of instanced meshes are measured on their own
+                        float length = object.type == TRIANGLE ? IntersectTriangle(ray, object) : IntersectBounds(ray, inverseDirection, CreateLeaf(id));
+
+                        minLength = std::min(minLength, length);
+                    }
+
+                    continue;
+                }
+
+                float leftEntry = IntersectBounds(ray, inverseDirection, boxes[box.leftID]);
+                float rightEntry = IntersectBounds(ray, inverseDirection, boxes[box.rightID]);
+
+                int32_t nearID = box.leftID;
+                int32_t farID = box.rightID;
+
+                if( rightEntry < leftEntry ){
+                    std::swap(nearID, farID);
+                    std::swap(leftEntry, rightEntry);
+                }
+
+                if( rightEntry < minLength )
+                    stack.emplace_back(farID, rightEntry);
+
+                if( leftEntry < minLength )
+                    stack.emplace_back(nearID, leftEntry);
+            }
+        }
+
+    });
+
+    return std::accumulate(steps.begin(), steps.end(), (uint64_t)0) / (float)TREELET_MEASURED_RAYS;
+}
+
+float BVHTree::CalculateCost(const int32_t & currentNode){
+
+    const BoundingBox & box = context->boxes[currentNode];
+    float rootArea = CalculateArea(context->boxes[0]);
+
+    if( box.objectID != -1 )
+        return SAH_INTERSECTION_COST * box.primitiveCount * CalculateArea(box) / rootArea;
+
+    float cost = SAH_TRAVERSAL_COST * CalculateArea(box) / rootArea;
+
+    return cost + CalculateCost(box.leftID) + CalculateCost(box.rightID);
+}
+
+int32_t BVHTree::CalculateStackSize(const int32_t & rootNode){
+
+    const std::vector<BVHNode> & nodes = context->nodes;
+
+    // Each entry holds node and number of entries its ancestors left on stack
+    std::vector< std::pair<int32_t, int32_t> > pending;
+    pending.emplace_back(rootNode, 0);
+
+    int32_t size = 1;
+
+    while( !pending.empty() ){
+
+        int32_t nodeID = pending.back().first;
+        int32_t waiting = pending.back().second;
+        pending.pop_back();
+
+        if( nodes[nodeID].primitiveCount > 0 )
+            continue;
+
+        // Popped node is replaced by both children
+        size = std::max(size, waiting + 2);
+
+        pending.emplace_back(nodeID + 1, waiting + 1);
+        pending.emplace_back(nodes[nodeID].offset, waiting + 1);
+    }
+
+    return size;
+}
+
+template<typename Node>
+static int32_t CalculateCollapsedStackSize(const std::vector<Node> & nodes){
+
+    std::vector< std::pair<int32_t, int32_t> > pending;
+    pending.emplace_back(0, 0);
+
+    int32_t size = 1;
+
+    while( !pending.empty() ){
+
+        const Node & node = nodes[ pending.back().first ];
+        int32_t waiting = pending.back().second;
+        pending.pop_back();
+
+        int32_t numChildren = 0;
+
+        for(int32_t child : node.children)
+            numChildren += child != -1;
+
+        // Leaf children are pushed as well, all but nearest one stay on stack while it is walked
+        size = std::max(size, waiting + numChildren);
+
+        for(int32_t slot = 0; slot < numChildren; ++slot){
+            if( node.primitiveCounts[slot] == 0 )
+                pending.emplace_back(node.children[slot], waiting + numChildren - 1);
+        }
+    }
+
+    return size;
+}
+
+void BVHTree::CalculateStackSizes(){
+
+    context->stackSize = CalculateStackSize(0);
+    context->wideStackSize = 1;
+    context->instanceStackSize = 1;
+
+    if( !context->wideNodes.empty() )
+        context->wideStackSize = CalculateCollapsedStackSize(context->wideNodes);
+
+    if( !context->quantizedNodes.empty() )
+        context->wideStackSize = std::max(context->wideStackSize, CalculateCollapsedStackSize(context->quantizedNodes));
+
+    for(const Mesh & mesh : context->meshes)
+        context->instanceStackSize = std::max(context->instanceStackSize, CalculateStackSize(mesh.rootNode));
+
+    context->loggingService.Write(MessageType::INFO, "Traversal stacks hold %d binary, %d wide and %d instance entries", context->stackSize, context->wideStackSize, context->instanceStackSize);
+}
+
+static float CalculateNodeArea(const BVHNode & node){
+
+    float x = node.maximalPosition[0] - node.minimalPosition[0];
+    float y = node.maximalPosition[1] - node.minimalPosition[1];
+    float z = node.maximalPosition[2] - node.minimalPosition[2];
+
+    return 2.0f * (x * y + x * z + y * z);
+}
+
+BVHStatistics BVHTree::CollectStatistics(const int32_t & numNodes){
+
+    const std::vector<BVHNode> & nodes = context->nodes;
+
+    BVHStatistics statistics = {};
+
+    if( numNodes == 0 )
+        return statistics;
+
+    // Single object scenes may have flat root
+    float rootArea = CalculateNodeArea(nodes[0]);
+    float inverseArea = rootArea > 0.0f ? 1.0f / rootArea : 0.0f;
+
+    std::vector<uint32_t> depths(numNodes, 0);
+    uint64_t sumDepths = 0;
+
+    double innerArea = 0.0;
+    double leafArea = 0.0;
+    double objectArea = 0.0;
+    double sharedArea = 0.0;
+
+    for(int32_t nodeID = 0; nodeID < numNodes; ++nodeID){
+
+        const BVHNode & node = nodes[nodeID];
+        float area = CalculateNodeArea(node);
+        uint32_t depth = depths[nodeID];
+
+        statistics.maxDepth = std::max(statistics.maxDepth, depth);
+
+        if( node.primitiveCount > 0 ){
+
+            uint32_t bin = node.primitiveCount > 1 ? 32 - __builtin_clz(node.primitiveCount - 1) : 0;
+
+            statistics.numLeaves++;
+            statistics.numReferences += node.primitiveCount;
+            statistics.leafSizes[ std::min(bin, (uint32_t)BVH_STATISTICS_BINS - 1) ]++;
+
+            sumDepths += depth;
+            leafArea += area;
+            objectArea += area * node.primitiveCount;
+
+            continue;
+        }
+
+        const BVHNode & left = nodes[nodeID + 1];
+        const BVHNode & right = nodes[node.offset];
+
+        statistics.numInnerNodes++;
+        innerArea += area;
+
+        // Children always follow their parent, so their depth is known before they are reached
+        depths[nodeID + 1] = depth + 1;
+        depths[node.offset] = depth + 1;
+
+        BVHNode shared = {};
+        bool overlaps = true;
+
+        for(int32_t axis = 0; axis < 3; ++axis){
+            shared.minimalPosition[axis] = std::max(left.minimalPosition[axis], right.minimalPosition[axis]);
+            shared.maximalPosition[axis] = std::min(left.maximalPosition[axis], right.maximalPosition[axis]);
+            overlaps &= shared.minimalPosition[axis] <= shared.maximalPosition[axis];
+        }
+
+        if( overlaps )
+            sharedArea += CalculateNodeArea(shared);
+    }
+
+    // Every node is entered by the share of rays hitting root given by ratio of their areas
+    statistics.cost = (SAH_TRAVERSAL_COST * innerArea + SAH_INTERSECTION_COST * objectArea) * inverseArea;
+    statistics.expectedNodes = (innerArea + leafArea) * inverseArea;
+    statistics.expectedObjects = objectArea * inverseArea;
+    statistics.overlap = sharedArea * inverseArea;
+    statistics.averageDepth = sumDepths / (float)statistics.numLeaves;
+
+    return statistics;
+}
+
+void BVHTree::ReportStatistics(const BVHStatistics & statistics, const double & duration, const bool & cached){
+
+    static const char * binNames[BVH_STATISTICS_BINS] = {"1", "2", "3-4", "5-8", "9-16", "17-32", "33-64", "65-128", "129-255"};
+
+    char histogram[256] = {0};
+    int32_t length = 0;
+
+    for(int32_t bin = 0; bin < BVH_STATISTICS_BINS; ++bin){
+        if( statistics.leafSizes[bin] > 0 )
+            length += snprintf(histogram + length, sizeof(histogram) - length, " %s:%d", binNames[bin], statistics.leafSizes[bin]);
+    }
+
+    context->loggingService.Write(MessageType::INFO, "BVH tree has %d inner nodes and %d leaves referencing %d objects", statistics.numInnerNodes, statistics.numLeaves, statistics.numReferences);
+    context->loggingService.Write(MessageType::INFO, "BVH tree SAH cost : %f", statistics.cost);
+    context->loggingService.Write(MessageType::INFO, "BVH tree depth : %d at most, %f per leaf on average", statistics.maxDepth, statistics.averageDepth);
+    context->loggingService.Write(MessageType::INFO, "BVH tree expects %f visited nodes and %f intersected objects per ray", statistics.expectedNodes, statistics.expectedObjects);
+    context->loggingService.Write(MessageType::INFO, "BVH tree children overlap by %f of root area", statistics.overlap);
+    context->loggingService.Write(MessageType::INFO, "BVH tree leaf sizes :%s", histogram);
+
+    if( context->statisticsPath.empty() )
+        return;
+
+    FILE * file = fopen(context->statisticsPath.c_str(), "ab");
+
+    if( file == nullptr ){
+        context->loggingService.Write(MessageType::ISSUE, "Can't open BVH statistics file %s", context->statisticsPath.c_str());
+        return;
+    }
+
+    // Rows of later runs are appended below one header, so builder settings can be compared
+    fseek(file, 0, SEEK_END);
+
+    if( ftell(file) == 0 ){
+
+        fprintf(file, "builder;leaf size;split budget;treelet passes;cached;time ms;inner nodes;leaves;references;max depth;average depth;sah cost;expected nodes;expected objects;overlap");
+
+        for(int32_t bin = 0; bin < BVH_STATISTICS_BINS; ++bin)
+            fprintf(file, ";leaves %s", binNames[bin]);
+
+        fprintf(file, "\n");
+    }
+
+    fprintf(file, "%s;%d;%f;%d;%d;%f;%d;%d;%d;%d;%f;%f;%f;%f;%f",
+        GetBuilderName(context->bvhBuilder),
+        context->maxLeafSize,
+        context->splitBudget,
+        context->treeletPasses,
+        cached,
+        duration * 1000.0,
+        statistics.numInnerNodes,
+        statistics.numLeaves,
+        statistics.numReferences,
+        statistics.maxDepth,
+        statistics.averageDepth,
+        statistics.cost,
+        statistics.expectedNodes,
+        statistics.expectedObjects,
+        statistics.overlap
+    );
+
+    for(int32_t bin = 0; bin < BVH_STATISTICS_BINS; ++bin)
+        fprintf(file, ";%d", statistics.leafSizes[bin]);
+
+    fprintf(file, "\n");
+    fclose(file);
+
+    context->loggingService.Write(MessageType::INFO, "BVH statistics appended to %s", context->statisticsPath.c_str());
+}
+
+float BVHTree::CalculateArea(const BoundingBox & box){
+
+    Vector3 edgesLen = box.maximalPosition - box.minimalPosition;
+
+    float facesA = 2.0f * edgesLen.x * edgesLen.y;
+    float facesB = 2.0f * edgesLen.x * edgesLen.z;
+    float facesC = 2.0f * edgesLen.y * edgesLen.z;
+
+    return facesA + facesB + facesC;
+}
+
+
+int32_t BVHTree::FindBin(const int32_t & objectID, const BoundingBox & centroidBounds, const int32_t & axis){
+
+    float minimal = centroidBounds.minimalPosition[axis];
+    float extent = centroidBounds.maximalPosition[axis] - minimal;
+
+    if( extent <= 0.0f )
+        return 0;
+
+    int32_t bin = (centroids[objectID][axis] - minimal) * (SAH_BINS / extent);
+
+    return std::min(bin, SAH_BINS - 1);
+}
+
+float BVHTree::FindBestSplit(const uint32_t & begin, const uint32_t & end, const BoundingBox & bounds, const BoundingBox & centroidBounds, int32_t & axis, int32_t & bin){
+
+    float bestCost = INFINITY;
+
+    BoundingBox bins[3][SAH_BINS];
+    uint32_t counts[3][SAH_BINS] = {};
+
+    for(uint32_t index = begin; index < end; ++index){
+
+        int32_t id = ids[index];
+
+        for(int32_t currentAxis = 0; currentAxis < 3; ++currentAxis){
+            int32_t currentBin = FindBin(id, centroidBounds, currentAxis);
+            bins[currentAxis][currentBin].Expand(leaves[id]);
+            counts[currentAxis][currentBin]++;
+        }
+    }
+
+    for(int32_t currentAxis = 0; currentAxis < 3; ++currentAxis){
+
+        if( centroidBounds.maximalPosition[currentAxis] <= centroidBounds.minimalPosition[currentAxis] )
+            continue;
+
+        // Sweep from right to store cost of every right side, then from left to evaluate splits
+        float rightCosts[SAH_BINS];
+        uint32_t rightCounts[SAH_BINS];
+
+        BoundingBox right;
+        uint32_t numRight = 0;
+
+        for(int32_t index = SAH_BINS - 1; index > 0; --index){
+            right.Expand(bins[currentAxis][index]);
+            numRight += counts[currentAxis][index];
+
+            rightCounts[index - 1] = numRight;
+            rightCosts[index - 1] = numRight > 0 ? CalculateArea(right) * numRight : 0.0f;
+        }
+
+        BoundingBox left;
+        uint32_t numLeft = 0;
+
+        for(int32_t index = 0; index < SAH_BINS - 1; ++index){
+            left.Expand(bins[currentAxis][index]);
+            numLeft += counts[currentAxis][index];
+
+            if( numLeft == 0 || rightCounts[index] == 0 )
+                continue;
+
+            float cost = CalculateArea(left) * numLeft + rightCosts[index];
+
+            if( cost < bestCost ){
+                bestCost = cost;
+                axis = currentAxis;
+                bin = index;
+            }
+        }
+    }
+
+    return SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * bestCost / CalculateArea(bounds);
+}
+
+uint32_t BVHTree::Split(const uint32_t & begin, const uint32_t & end, BoundingBox & bounds){
+
+    BoundingBox centroidBounds;
+
+    for(uint32_t index = begin; index < end; ++index){
+        int32_t id = ids[index];
+        bounds.Expand(leaves[id]);
+        centroidBounds.minimalPosition = Vector3::Minimal(centroidBounds.minimalPosition, centroids[id]);
+        centroidBounds.maximalPosition = Vector3::Maximal(centroidBounds.maximalPosition, centroids[id]);
+    }
+
+    uint32_t count = end - begin;
+
+    if( count == 1 )
+        return end;
+
+    int32_t splitAxis = 0;
+    int32_t splitBin = 0;
+
+    float splitCost = FindBestSplit(begin, end, bounds, centroidBounds, splitAxis, splitBin);
+
+    if( count <= context->maxLeafSize && SAH_INTERSECTION_COST * count <= splitCost )
+        return end;
+
+    std::vector<int32_t>::iterator first = ids.begin() + begin;
+    std::vector<int32_t>::iterator last = ids.begin() + end;
+    std::vector<int32_t>::iterator middle = first;
+
+    if( splitCost < INFINITY ){
+        middle = std::partition(first, last,
+            [this, &centroidBounds, splitAxis, splitBin](const int32_t & id){
+                return FindBin(id, centroidBounds, splitAxis) <= splitBin;
+            }
+        );
+    }
+
+    // Centroids can't be told apart by bins, split in half along widest axis instead
+    if( middle == first || middle == last ){
+
+        Vector3 extent = centroidBounds.maximalPosition - centroidBounds.minimalPosition;
+        splitAxis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        middle = first + ((end - begin) >> 1);
+
+        std::vector<Vector3> & centers = centroids;
+
+        std::nth_element(first, middle, last,
+            [splitAxis, &centers](const int32_t & a, const int32_t & b){
+                return centers[a][splitAxis] < centers[b][splitAxis];
+            }
+        );
+    }
+
+    return middle - ids.begin();
+}
+
+static float GetAxis(const Vector3 & vector, const int32_t & axis){
+    return (&vector.x)[axis];
+}
+
+static void SetAxis(Vector3 & vector, const int32_t & axis, const float & value){
+    (&vector.x)[axis] = value;
+}
+
+BoundingBox BVHTree::ClipReference(const BoundingBox & reference, const int32_t & axis, const float & minimal, const float & maximal){
+
+    const Object & object = context->objects[ firstObject + reference.objectID ];
+
+    BoundingBox clipped = reference;
+
+    if( object.type == TRIANGLE ){
+
+        BoundingBox polygon;
+
+        // Vertices inside the slab and points where edges cross its planes bound the clipped triangle
+        for(int32_t edge = 0; edge < 3; ++edge){
+
+            const Vector3 & start = object.vertices[edge];
+            const Vector3 & end = object.vertices[ (edge + 1) % 3 ];
+
+            float startPosition = GetAxis(start, axis);
+            float endPosition = GetAxis(end, axis);
+
+            if( startPosition >= minimal && startPosition <= maximal ){
+                polygon.minimalPosition = Vector3::Minimal(polygon.minimalPosition, start);
+                polygon.maximalPosition = Vector3::Maximal(polygon.maximalPosition, start);
+            }
+
+            float planes[2] = {minimal, maximal};
+
+            for(int32_t plane = 0; plane < 2; ++plane){
+
+                if( (startPosition - planes[plane]) * (endPosition - planes[plane]) >= 0.0f )
+                    continue;
+
+                float t = (planes[plane] - startPosition) / (endPosition - startPosition);
+
+                Vector3 point = start + (end - start) * t;
+                SetAxis(point, axis, planes[plane]);
+
+                polygon.minimalPosition = Vector3::Minimal(polygon.minimalPosition, point);
+                polygon.maximalPosition = Vector3::Maximal(polygon.maximalPosition, point);
+            }
+
+        }
+
+        // Reference may already be clipped by planes of ancestors
+        if( GetAxis(polygon.minimalPosition, axis) <= GetAxis(polygon.maximalPosition, axis) ){
+            clipped.minimalPosition = Vector3::Maximal(clipped.minimalPosition, polygon.minimalPosition);
+            clipped.maximalPosition = Vector3::Minimal(clipped.maximalPosition, polygon.maximalPosition);
+        }
+
+    }
+
+    SetAxis(clipped.minimalPosition, axis, std::max(GetAxis(clipped.minimalPosition, axis), minimal));
+    SetAxis(clipped.maximalPosition, axis, std::min(GetAxis(clipped.maximalPosition, axis), maximal));
+
+    // Rounding may leave box inverted on other axes, collapse it onto the slab instead
+    for(int32_t current = 0; current < 3; ++current){
+        if( GetAxis(clipped.minimalPosition, current) > GetAxis(clipped.maximalPosition, current) )
+            SetAxis(clipped.maximalPosition, current, GetAxis(clipped.minimalPosition, current));
+    }
+
+    return clipped;
+}
+
+float BVHTree::FindReferenceSplit(const std::vector<BoundingBox> & references, const BoundingBox & bounds, const BoundingBox & centroidBounds, int32_t & axis, int32_t & bin, BoundingBox & leftBounds, BoundingBox & rightBounds){
+
+    float bestCost = INFINITY;
+
+    BoundingBox bins[3][SAH_BINS];
+    uint32_t counts[3][SAH_BINS] = {};
+
+    for(const BoundingBox & reference : references){
+
+        Vector3 centroid = (reference.minimalPosition + reference.maximalPosition) * 0.5f;
+
+        for(int32_t currentAxis = 0; currentAxis < 3; ++currentAxis){
+
+            float minimal = GetAxis(centroidBounds.minimalPosition, currentAxis);
+            float extent = GetAxis(centroidBounds.maximalPosition, currentAxis) - minimal;
+
+            int32_t currentBin = extent > 0.0f ? (int32_t)(SAH_BINS * (GetAxis(centroid, currentAxis) - minimal) / extent) : 0;
+            currentBin = std::min(std::max(currentBin, 0), SAH_BINS - 1);
+
+            bins[currentAxis][currentBin].Expand(reference);
+            counts[currentAxis][currentBin]++;
+        }
+    }
+
+    for(int32_t currentAxis = 0; currentAxis < 3; ++currentAxis){
+
+        if( GetAxis(centroidBounds.maximalPosition, currentAxis) <= GetAxis(centroidBounds.minimalPosition, currentAxis) )
+            continue;
+
+        BoundingBox rightBoxes[SAH_BINS];
+        uint32_t rightCounts[SAH_BINS];
+
+        BoundingBox right;
+        uint32_t numRight = 0;
+
+        for(int32_t index = SAH_BINS - 1; index > 0; --index){
+            right.Expand(bins[currentAxis][index]);
+            numRight += counts[currentAxis][index];
+
+            rightBoxes[index - 1] = right;
+            rightCounts[index - 1] = numRight;
+        }
+
+        BoundingBox left;
+        uint32_t numLeft = 0;
+
+        for(int32_t index = 0; index < SAH_BINS - 1; ++index){
+            left.Expand(bins[currentAxis][index]);
+            numLeft += counts[currentAxis][index];
+
+            if( numLeft == 0 || rightCounts[index] == 0 )
+                continue;
+
+            float cost = CalculateArea(left) * numLeft + CalculateArea(rightBoxes[index]) * rightCounts[index];
+
+            if( cost < bestCost ){
+                bestCost = cost;
+                axis = currentAxis;
+                bin = index;
+                leftBounds = left;
+                rightBounds = rightBoxes[index];
+            }
+        }
+    }
+
+    return SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * bestCost / CalculateArea(bounds);
+}
+
+float BVHTree::FindSpatialSplit(const std::vector<BoundingBox> & references, const BoundingBox & bounds, int32_t & axis, float & position){
+
+    float bestCost = INFINITY;
+
+    for(int32_t currentAxis = 0; currentAxis < 3; ++currentAxis){
+
+        float origin = GetAxis(bounds.minimalPosition, currentAxis);
+        float binWidth = (GetAxis(bounds.maximalPosition, currentAxis) - origin) / SAH_BINS;
+
+        if( binWidth <= 0.0f )
+            continue;
+
+        BoundingBox bins[SAH_BINS];
+        uint32_t entries[SAH_BINS] = {};
+        uint32_t exits[SAH_BINS] = {};
+
+        // Reference is counted where it enters and leaves, its clipped parts grow every bin it spans
+        for(const BoundingBox & reference : references){
+
+            int32_t firstBin = (int32_t)((GetAxis(reference.minimalPosition, currentAxis) - origin) / binWidth);
+            int32_t lastBin = (int32_t)((GetAxis(reference.maximalPosition, currentAxis) - origin) / binWidth);
+
+            firstBin = std::min(std::max(firstBin, 0), SAH_BINS - 1);
+            lastBin = std::min(std::max(lastBin, firstBin), SAH_BINS - 1);
+
+            for(int32_t currentBin = firstBin; currentBin <= lastBin; ++currentBin){
+
+                float minimal = origin + binWidth * currentBin;
+                float maximal = currentBin == SAH_BINS - 1 ? GetAxis(bounds.maximalPosition, currentAxis) : minimal + binWidth;
+
+                bins[currentBin].Expand(ClipReference(reference, currentAxis, minimal, maximal));
+            }
+
+            entries[firstBin]++;
+            exits[lastBin]++;
+        }
+
+        float rightCosts[SAH_BINS];
+        uint32_t rightCounts[SAH_BINS];
+
+        BoundingBox right;
+        uint32_t numRight = 0;
+
+        for(int32_t index = SAH_BINS - 1; index > 0; --index){
+            right.Expand(bins[index]);
+            numRight += exits[index];
+
+            rightCounts[index - 1] = numRight;
+            rightCosts[index - 1] = numRight > 0 ? CalculateArea(right) * numRight : 0.0f;
+        }
+
+        BoundingBox left;
+        uint32_t numLeft = 0;
+
+        for(int32_t index = 0; index < SAH_BINS - 1; ++index){
+            left.Expand(bins[index]);
+            numLeft += entries[index];
+
+            if( numLeft == 0 || rightCounts[index] == 0 )
+                continue;
+
+            float cost = CalculateArea(left) * numLeft + rightCosts[index];
+
+            if( cost < bestCost ){
+                bestCost = cost;
+                axis = currentAxis;
+                position = origin + binWidth * (index + 1);
+            }
+        }
+    }
+
+    return SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * bestCost / CalculateArea(bounds);
+}
+
+bool BVHTree::SplitReferences(const std::vector<BoundingBox> & references, BoundingBox & bounds, std::vector<BoundingBox> & left, std::vector<BoundingBox> & right){
+
+    BoundingBox centroidBounds;
+
+    for(const BoundingBox & reference : references){
+        Vector3 centroid = (reference.minimalPosition + reference.maximalPosition) * 0.5f;
+        bounds.Expand(reference);
+        centroidBounds.minimalPosition = Vector3::Minimal(centroidBounds.minimalPosition, centroid);
+        centroidBounds.maximalPosition = Vector3::Maximal(centroidBounds.maximalPosition, centroid);
+    }
+
+    uint32_t count = references.size();
+
+    if( count == 1 )
+        return false;
+
+    int32_t splitAxis = 0;
+    int32_t splitBin = 0;
+    BoundingBox leftBounds;
+    BoundingBox rightBounds;
+
+    float splitCost = FindReferenceSplit(references, bounds, centroidBounds, splitAxis, splitBin, leftBounds, rightBounds);
+
+    int32_t spatialAxis = 0;
+    float spatialPosition = 0.0f;
+    float spatialCost = INFINITY;
+
+    // Spatial splits only pay off where children of object split overlap
+    BoundingBox overlap;
+    overlap.minimalPosition = Vector3::Maximal(leftBounds.minimalPosition, rightBounds.minimalPosition);
+    overlap.maximalPosition = Vector3::Minimal(leftBounds.maximalPosition, rightBounds.maximalPosition);
+
+    bool overlapping = splitCost == INFINITY || (
+        overlap.minimalPosition.x < overlap.maximalPosition.x &&
+        overlap.minimalPosition.y < overlap.maximalPosition.y &&
+        overlap.minimalPosition.z < overlap.maximalPosition.z &&
+        CalculateArea(overlap) > SBVH_OVERLAP_THRESHOLD * rootArea
+    );
+
+    if( overlapping && numReferences < maxReferences )
+        spatialCost = FindSpatialSplit(references, bounds, spatialAxis, spatialPosition);
+
+    float bestCost = std::min(splitCost, spatialCost);
+
+    if( count <= context->maxLeafSize && SAH_INTERSECTION_COST * count <= bestCost )
+        return false;
+
+    left.clear();
+    right.clear();
+
+    if( spatialCost < splitCost ){
+
+        // Sides as binned, every straddling reference counted on both
+        BoundingBox spatialLeft;
+        BoundingBox spatialRight;
+        uint32_t numLeft = 0;
+        uint32_t numRight = 0;
+
+        for(const BoundingBox & reference : references){
+
+            if( GetAxis(reference.minimalPosition, spatialAxis) < spatialPosition ){
+                spatialLeft.Expand(ClipReference(reference, spatialAxis, -INFINITY, spatialPosition));
+                numLeft++;
+            }
+
+            if( GetAxis(reference.maximalPosition, spatialAxis) > spatialPosition ){
+                spatialRight.Expand(ClipReference(reference, spatialAxis, spatialPosition, INFINITY));
+                numRight++;
+            }
+        }
+
+        for(const BoundingBox & reference : references){
+
+            float minimal = GetAxis(reference.minimalPosition, spatialAxis);
+            float maximal = GetAxis(reference.maximalPosition, spatialAxis);
+
+            if( maximal <= spatialPosition ){
+                left.emplace_back(reference);
+                continue;
+            }
+
+            if( minimal >= spatialPosition ){
+                right.emplace_back(reference);
+                continue;
+            }
+
+            // Straddling reference stays whole on one side when that is cheaper than duplicating it
+            BoundingBox mergedLeft = spatialLeft;
+            BoundingBox mergedRight = spatialRight;
+            mergedLeft.Expand(reference);
+            mergedRight.Expand(reference);
+
+            float duplicateCost = CalculateArea(spatialLeft) * numLeft + CalculateArea(spatialRight) * numRight;
+            float leftCost = CalculateArea(mergedLeft) * numLeft + CalculateArea(spatialRight) * (numRight - 1);
+            float rightCost = CalculateArea(spatialLeft) * (numLeft - 1) + CalculateArea(mergedRight) * numRight;
+
+            if( leftCost < duplicateCost && leftCost <= rightCost ){
+                left.emplace_back(reference);
+                spatialLeft = mergedLeft;
+                numRight--;
+            }else if( rightCost < duplicateCost ){
+                right.emplace_back(reference);
+                spatialRight = mergedRight;
+                numLeft--;
+            }else{
+                left.emplace_back(ClipReference(reference, spatialAxis, -INFINITY, spatialPosition));
+                right.emplace_back(ClipReference(reference, spatialAxis, spatialPosition, INFINITY));
+            }
+        }
+
+        uint32_t numCopies = left.size() + right.size() - count;
+
+        // Budget is shared by all workers, object split is used once it runs out
+        if( !left.empty() && !right.empty() && numReferences.fetch_add(numCopies) + numCopies <= maxReferences )
+            return true;
+
+        if( !left.empty() && !right.empty() )
+            numReferences -= numCopies;
+
+        left.clear();
+        right.clear();
+    }
+
+    if( splitCost < INFINITY ){
+
+        float minimal = GetAxis(centroidBounds.minimalPosition, splitAxis);
+        float extent = GetAxis(centroidBounds.maximalPosition, splitAxis) - minimal;
+
+        for(const BoundingBox & reference : references){
+
+            Vector3 centroid = (reference.minimalPosition + reference.maximalPosition) * 0.5f;
+
+            int32_t bin = (int32_t)(SAH_BINS * (GetAxis(centroid, splitAxis) - minimal) / extent);
+            bin = std::min(std::max(bin, 0), SAH_BINS - 1);
+
+            if( bin <= splitBin ){
+                left.emplace_back(reference);
+            }else{
+                right.emplace_back(reference);
+            }
+        }
+
+    }
+
+    // Centroids can't be told apart by bins, split in half along widest axis instead
+    if( left.empty() || right.empty() ){
+
+        Vector3 extent = centroidBounds.maximalPosition - centroidBounds.minimalPosition;
+        splitAxis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+        std::vector<BoundingBox> sorted = references;
+        std::vector<BoundingBox>::iterator middle = sorted.begin() + (count >> 1);
+
+        std::nth_element(sorted.begin(), middle, sorted.end(),
+            [splitAxis](const BoundingBox & a, const BoundingBox & b){
+                return GetAxis(a.minimalPosition, splitAxis) + GetAxis(a.maximalPosition, splitAxis) < GetAxis(b.minimalPosition, splitAxis) + GetAxis(b.maximalPosition, splitAxis);
+            }
+        );
+
+        left.assign(sorted.begin(), middle);
+        right.assign(middle, sorted.end());
+    }
+
+    return true;
+}
+
+void BVHTree::BuildSpatial(BuildTask task){
+
+    std::vector<BoundingBox> left;
+    std::vector<BoundingBox> right;
+
+    while( true ){
+
+        BoundingBox bounds;
+
+        if( !SplitReferences(task.references, bounds, left, right) ){
+
+            uint32_t count = task.references.size();
+            uint32_t first = nextReference.fetch_add(count);
+
+            for(uint32_t index = 0; index < count; ++index)
+                ids[first + index] = task.references[index].objectID;
+
+            // Leaf keeps clipped bounds, its objects are copied to its range by reordering after build
+            bounds.objectID = firstObject + first;
+            bounds.primitiveCount = count;
+            bounds.parentID = task.parentID;
+
+            context->boxes[task.nodeID] = bounds;
+            return;
+        }
+
+        int32_t leftID = nextNode.fetch_add(2);
+        int32_t rightID = leftID + 1;
+
+        bounds.parentID = task.parentID;
+        bounds.leftID = leftID;
+        bounds.rightID = rightID;
+
+        context->boxes[task.nodeID] = bounds;
+
+        BuildTask rightTask = {0, 0, rightID, task.nodeID, std::move(right)};
+
+        if( rightTask.references.size() >= PARALLEL_BUILD_THRESHOLD ){
+
+            std::lock_guard<std::mutex> guard(taskLock);
+            tasks.push_back(std::move(rightTask));
+            taskReady.notify_one();
+
+        }else{
+            BuildSpatial(std::move(rightTask));
+        }
+
+        task = {0, 0, leftID, task.nodeID, std::move(left)};
+
+        left = std::vector<BoundingBox>();
+        right = std::vector<BoundingBox>();
+    }
+
+}
+
+const std::vector<int32_t> & BVHTree::GetOrder() const{
+    return order;
+}
+
+void BVHTree::GetCopies(const int32_t & sourceID, std::vector<int32_t> & objectIDs) const{
+
+    // Objects keep their original order without BVH
+    if( copyOffsets.empty() ){
+        objectIDs.emplace_back(sourceID);
+        return;
+    }
 
-    return currentNodeID;
+    objectIDs.insert(objectIDs.end(), copies.begin() + copyOffsets[sourceID], copies.begin() + copyOffsets[sourceID + 1]);
 }
 
 uint32_t BVHTree::GetSize() const{
@@ -2,36 +2,293 @@
 #define BVHTREE_H
 
 #include "BoundingBox.h"
+#include "BVHCache.h"
+#include "Random.h"
+#include "Ray.h"
 #include "RenderingContext.h"
 #include "Timer.h"
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <numeric>
 #include <stdio.h>
 
+#define SAH_BINS 16
+#define SAH_TRAVERSAL_COST 1.0f
+#define SAH_INTERSECTION_COST 1.0f
+
+// Subtrees with fewer objects are built by the worker that split them off
+#define PARALLEL_BUILD_THRESHOLD 2048
+
+// Scenes with more objects are sorted by 63 bit Morton codes instead of 30 bit ones
+#define LBVH_LONG_CODES_THRESHOLD (1 << 20)
+#define LBVH_RADIX_BITS 8
+#define LBVH_RADIX (1 << LBVH_RADIX_BITS)
+
+// Spatial splits are only tried where children of object split overlap by more than this fraction of root area
+#define SBVH_OVERLAP_THRESHOLD 1e-5f
+
+// Restructured treelets have this many leaves, their topologies are enumerated over all 2^n leaf subsets
+#define TREELET_SIZE 7
+#define TREELET_SUBSETS (1 << TREELET_SIZE)
+
+// Restructured treelet has to be this much cheaper, so float noise alone never changes the tree
+#define TREELET_COST_TOLERANCE 0.9999f
+
+// Rays traced through tree to compare traversal steps before and after restructuring
+#define TREELET_MEASURED_RAYS 16384
+#define TREELET_MEASURED_EPSILON 1e-12f
+
+// Levels with fewer changed boxes are refitted on calling thread
+#define PARALLEL_REFIT_THRESHOLD 1024
+
+// Leaves are counted in power of two bins of their object counts: 1, 2, 3-4, ... 129-255
+#define BVH_STATISTICS_BINS 9
+
+using RangeTask = std::function<void(const uint32_t & chunk, const uint32_t & begin, const uint32_t & end)>;
+
+// Subtree over objects ids[begin, end), its root is stored at nodeID
+struct BuildTask{
+    uint32_t begin;
+    uint32_t end;
+    int32_t nodeID;
+    int32_t parentID;
+
+    // Clipped object references of spatial split builder, which ignores the ids range
+    std::vector<BoundingBox> references;
+};
+
+// Quality measures of world tree, gathered in one pass over its flattened nodes
+struct BVHStatistics{
+    uint32_t numInnerNodes;
+    uint32_t numLeaves;
+
+    // Objects referenced by leaves, spatial splits reference some objects more than once
+    uint32_t numReferences;
+
+    uint32_t maxDepth;
+    float averageDepth;
+
+    // Surface area heuristic cost, equal to traversal and intersection costs of expected numbers below
+    float cost;
+
+    // Expected numbers of visited nodes and intersected objects of ray hitting root
+    float expectedNodes;
+    float expectedObjects;
+
+    // Area of boxes shared by both children of inner nodes, normalized by root area
+    float overlap;
+
+    uint32_t leafSizes[BVH_STATISTICS_BINS];
+};
+
 class BVHTree{
 private:
 
     RenderingContext * context;
 
-    BoundingBox CreateLeaf(const uint32_t & objectID);
+    BVHCache cache;
+
+    // Original index of every object in build order, cached to restore order without build
+    std::vector<int32_t> order;
+
+    // Inverse of order, copies of original object sourceID are copies[ copyOffsets[sourceID] .. copyOffsets[sourceID + 1] )
+    std::vector<int32_t> copyOffsets;
+    std::vector<int32_t> copies;
+
+    // Bounds and centroids of all objects, computed once per build
+    std::vector<BoundingBox> leaves;
+    std::vector<Vector3> centroids;
+
+    // Objects partitioned in place, every subtree owns contiguous range
+    std::vector<int32_t> ids;
+
+    // Index of first object of tree being built, ids are relative to it
+    uint32_t firstObject;
+
+    // Morton codes of centroids, sorted together with ids
+    std::vector<uint64_t> codes;
+
+    // Subtrees waiting for a free worker
+    std::vector<BuildTask> tasks;
+    std::mutex taskLock;
+    std::condition_variable taskReady;
+    uint32_t busyWorkers;
+
+    // First free node slot
+    std::atomic<int32_t> nextNode;
+
+    // Spatial split builder writes leaf references to ids, duplicates are limited by budget
+    std::atomic<uint32_t> nextReference;
+    std::atomic<uint32_t> numReferences;
+    uint32_t maxReferences;
+
+    // Bounds of root of tree being built, spatial splits are tried only for large overlaps
+    float rootArea;
+
+    // Surface area heuristic cost of subtree of every box, not normalized by root area
+    std::vector<float> costs;
+
+    // Leaf box of every object, flattened node and wide node slot of every box
+    std::vector<int32_t> objectLeaves;
+    std::vector<int32_t> boxNodes;
+    std::vector<int32_t> boxSlots;
+
+    // Box of every quantized node, box of every quantized node slot and quantized slot of every box
+    std::vector<int32_t> quantizedBoxes;
+    std::vector<int32_t> quantizedChildren;
+    std::vector<int32_t> quantizedSlots;
 
-    void Insert(const uint32_t & objectID);
+    // Depth of every box, refit updates changed boxes level by level
+    std::vector<int32_t> levels;
+    std::vector<bool> dirty;
+    std::vector< std::vector<int32_t> > dirtyLevels;
+
+    BoundingBox CreateLeaf(const uint32_t & objectID);
 
     float CalculateArea(const BoundingBox & box);
 
-    int32_t FindBestAxis(const std::vector<int32_t> & ids);
+    int32_t FindBin(const int32_t & objectID, const BoundingBox & centroidBounds, const int32_t & axis);
+
+    /// @brief Evaluates surface area heuristic over centroid bins of every axis
+    /// @param begin first object of the node
+    /// @param end one past last object of the node
+    /// @param bounds bounds of the node
+    /// @param centroidBounds bounds of centroids of the objects
+    /// @param axis receives axis of the cheapest split
+    /// @param bin receives last bin of the left side of the cheapest split
+    /// @return cost of the cheapest split, infinity when centroids can't be separated
+    float FindBestSplit(const uint32_t & begin, const uint32_t & end, const BoundingBox & bounds, const BoundingBox & centroidBounds, int32_t & axis, int32_t & bin);
+
+    /// @brief Partitions objects of the node in place
+    /// @param bounds receives bounds of the node
+    /// @return index of first object of the right child, end when objects are cheaper to intersect as one leaf
+    uint32_t Split(const uint32_t & begin, const uint32_t & end, BoundingBox & bounds);
+
+    /// @brief Builds trees of all meshes into meshNodes and then tree of the world into boxes and nodes
+    void BuildTrees(std::vector<BVHNode> & meshNodes);
+
+    /// @brief Moves objects to cached build order and flattens cached boxes
+    void ApplyOrder();
+
+    /// @brief Builds and flattens tree over consecutive objects into boxes and nodes
+    /// @return number of object copies made by spatial splits, they are inserted after the range
+    uint32_t BuildTree(const uint32_t & first, const uint32_t & numObjects);
+
+    /// @brief Builds subtree, handing large right children over to other workers
+    void Build(BuildTask task);
+
+    /// @brief Takes subtrees from the shared list until the whole tree is built
+    void BuildWorker();
+
+    /// @brief Returns bounds of part of reference lying between two planes along axis
+    BoundingBox ClipReference(const BoundingBox & reference, const int32_t & axis, const float & minimal, const float & maximal);
+
+    /// @brief Evaluates surface area heuristic over centroid bins of references
+    /// @param leftBounds receives bounds of the left side of the cheapest split
+    /// @param rightBounds receives bounds of the right side of the cheapest split
+    float FindReferenceSplit(const std::vector<BoundingBox> & references, const BoundingBox & bounds, const BoundingBox & centroidBounds, int32_t & axis, int32_t & bin, BoundingBox & leftBounds, BoundingBox & rightBounds);
+
+    /// @brief Evaluates surface area heuristic of planes between spatial bins, references are clipped to every bin they span
+    /// @param position receives position of the cheapest splitting plane
+    float FindSpatialSplit(const std::vector<BoundingBox> & references, const BoundingBox & bounds, int32_t & axis, float & position);
+
+    /// @brief Divides references by cheaper of object and spatial split, references straddling spatial split are clipped into both sides
+    /// @param bounds receives bounds of the node
+    /// @return false when references are cheaper to intersect as one leaf
+    bool SplitReferences(const std::vector<BoundingBox> & references, BoundingBox & bounds, std::vector<BoundingBox> & left, std::vector<BoundingBox> & right);
+
+    /// @brief Builds subtree of spatial split BVH, handing large right children over to other workers
+    void BuildSpatial(BuildTask task);
+
+    /// @brief Rebuilds treelet under box with topology of lowest cost, opened boxes are reused as its inner nodes
+    /// @param rootID root of the treelet, its children are already final
+    void RestructureTreelet(const int32_t & rootID);
+
+    /// @brief Restructures treelets bottom up in parallel, repeated for configured number of passes
+    void OptimizeTreelets();
+
+    /// @brief Traces rays from bounding sphere of the tree towards its objects
+    /// @return average number of boxes visited by closest hit traversal
+    float MeasureSteps();
+
+    /// @brief Groups current indices of objects by their original index
+    void MapCopies();
 
-    int32_t Insert(std::vector<int32_t> & ids, const int32_t & parentID = -1, const uint32_t & depth = 0);
+    /// @brief Moves objects to build order, so every leaf covers consecutive objects
+    /// @return number of object copies inserted after the range
+    uint32_t ReorderObjects();
 
-    void CheckBalance(const int32_t & currentNode = -1);
+    /// @brief Stores boxes as compact nodes in depth first order
+    void Flatten();
 
-    int32_t CalculateDepth(const int32_t & currentNode = -1);
+    /// @brief Copies nodes, replacing second child of every inner node with first node past its subtree
+    void LinkNodes();
+
+    /// @brief Gathers children of box for collapsed node, opening inner child of largest area until node is full
+    /// @param children receives at most width boxes, a leaf box is its own only child
+    /// @return number of gathered children
+    int32_t OpenChildren(const int32_t & boxID, const int32_t & width, int32_t * children);
+
+    /// @brief Collapses boxes into wide nodes, opening child of largest area until node is full
+    void Collapse();
+
+    /// @brief Collapses boxes into quantized nodes of width 8
+    void Quantize();
+
+    /// @brief Encodes bounds of children of quantized node on grid spanning its box
+    void QuantizeBounds(const int32_t & nodeID);
+
+    /// @brief Returns length of common prefix of two sorted codes, -1 when second is out of range
+    int32_t CommonPrefix(const int32_t & first, const int32_t & second);
+
+    /// @brief Builds tree in linear time from radix sorted Morton codes of centroids
+    void BuildLBVH();
+
+    uint32_t GetNumChunks() const;
+
+    /// @brief Splits range into one contiguous chunk per worker
+    void ParallelFor(const uint32_t & count, const RangeTask & function);
+
+    /// @brief Recomputes bounds of box from its objects or children and copies them to traversed nodes
+    void RefitBox(const int32_t & boxID);
+
+    float CalculateCost(const int32_t & currentNode);
+
+    /// @brief Returns number of entries traversal stack needs at most for binary tree, entered node leaves its other child on stack
+    /// @param rootNode first node of tree, its subtree is stored in depth first order
+    int32_t CalculateStackSize(const int32_t & rootNode);
+
+    /// @brief Sizes traversal stacks of binary, collapsed and instanced trees, refit keeps topology so sizes stay valid
+    void CalculateStackSizes();
+
+    /// @brief Walks flattened world tree once, children of every node follow it in depth first order
+    /// @param numNodes number of nodes of world tree
+    BVHStatistics CollectStatistics(const int32_t & numNodes);
+
+    /// @brief Writes statistics to log and appends them as one row to configured file
+    /// @param duration build or load time in seconds
+    void ReportStatistics(const BVHStatistics & statistics, const double & duration, const bool & cached);
 
 public:
     BVHTree( RenderingContext * _context );
 
     void BuildBVH();
 
+    /// @brief Returns original index of every object in build order, copies made by spatial splits share it
+    const std::vector<int32_t> & GetOrder() const;
+
+    /// @brief Appends indices in current order of all copies of object, spatial splits may leave several
+    /// @param sourceID original index of object
+    void GetCopies(const int32_t & sourceID, std::vector<int32_t> & objectIDs) const;
+
+    /// @brief Updates bounds of boxes above objects which have moved, topology of tree is kept
+    /// @param sourceIDs original indices of moved objects, every copy of them must already hold new placement
+    void Refit(const std::vector<int32_t> & sourceIDs);
+
     uint32_t GetSize() const;
 
     std::vector<BoundingBox> & GetData() const;
@@ -14,23 +14,21 @@ struct BoundingBox{
     Vector3 minimalPosition;
     Vector3 maximalPosition;
 
+    // Leaf covers objects [objectID, objectID + primitiveCount)
+    int32_t primitiveCount;
+
     BoundingBox(){
         this->minimalPosition = Vector3(INFINITY, INFINITY, INFINITY);
         this->maximalPosition = Vector3(-INFINITY, -INFINITY, -INFINITY);
         this->objectID = -1;
+        this->primitiveCount = 0;
         this->leftID = -1;
         this->rightID = -1;
     }
 
     void Expand(const BoundingBox& other) {
-
-        minimalPosition.x = std::fmin(minimalPosition.x, other.minimalPosition.x);
-        minimalPosition.y = std::fmin(minimalPosition.y, other.minimalPosition.y);
-        minimalPosition.z = std::fmin(minimalPosition.z, other.minimalPosition.z);
-
-        maximalPosition.x = std::fmax(maximalPosition.x, other.maximalPosition.x);
-        maximalPosition.y = std::fmax(maximalPosition.y, other.maximalPosition.y);
-        maximalPosition.z = std::fmax(maximalPosition.z, other.maximalPosition.z);
+        minimalPosition = Vector3::Minimal(minimalPosition, other.minimalPosition);
+        maximalPosition = Vector3::Maximal(maximalPosition, other.maximalPosition);
     }
 
     float SurfaceArea(){
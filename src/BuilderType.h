@@ -0,0 +1,13 @@
+#ifndef BUILDERTYPE_H
+#define BUILDERTYPE_H
+
+#define BUILDER_TYPE_SIZE 3
+#define BUILDER_TYPES {"sah", "lbvh", "sbvh"}
+
+enum BuilderType{
+    SAH_BUILDER,
+    LBVH_BUILDER,
+    SBVH_BUILDER
+};
+
+#endif
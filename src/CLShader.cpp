@@ -18,14 +18,14 @@ CLShader::CLShader(RenderingContext * _context) : ComputeShader(_context){
     }
 
     size_t tempSize = sizeof(Object)*context->objects.size();
-    LocalBuffer * objects = ComputeEnvironment::CreateBuffer(deviceContext, tempSize, context->objects.data());
+    objects = ComputeEnvironment::CreateBuffer(deviceContext, tempSize, context->objects.data());
     buffers.emplace_back(objects);
 
     tempSize = sizeof(Material) * context->materials.size();
     LocalBuffer * materials = ComputeEnvironment::CreateBuffer(deviceContext, tempSize, context->materials.data());
     buffers.emplace_back(materials);
 
-    LocalBuffer * resources = ComputeEnvironment::CreateBuffer(deviceContext, 64, CL_MEM_READ_WRITE);
+    LocalBuffer * resources = ComputeEnvironment::CreateBuffer(deviceContext, 128, CL_MEM_READ_WRITE);
     buffers.emplace_back(resources);
 
     tempSize = sizeof(Color) * context->width * context->height;
@@ -44,9 +44,24 @@ CLShader::CLShader(RenderingContext * _context) : ComputeShader(_context){
     LocalBuffer * textureData = ComputeEnvironment::CreateBuffer(deviceContext, tempSize, context->textureData.data());
     buffers.emplace_back(textureData);
 
-    tempSize = sizeof(BoundingBox) * context->boxes.size();
-    LocalBuffer * boxBuffer = ComputeEnvironment::CreateBuffer(deviceContext, tempSize, context->boxes.data());
-    buffers.emplace_back(boxBuffer);
+    // Quantized nodes replace binary ones of the world tree, binary nodes are kept only for trees of instanced meshes
+    bool quantized = context->bvhAcceleration && !context->quantizedNodes.empty();
+
+    // Stackless kernel walks nodes whose offsets point past their subtrees, quantized kernel takes precedence
+    // and walks mesh trees with a stack, so it needs second children in offsets
+    std::vector<BVHNode> & nodes = context->stacklessTraversal && !quantized ? context->linkedNodes : context->nodes;
+
+    tempSize = !quantized || !context->meshes.empty() ? sizeof(BVHNode) * nodes.size() : 0;
+    nodeBuffer = ComputeEnvironment::CreateBuffer(deviceContext, tempSize, nodes.data());
+    buffers.emplace_back(nodeBuffer);
+
+    tempSize = sizeof(QuantizedNode) * context->quantizedNodes.size();
+    quantizedBuffer = ComputeEnvironment::CreateBuffer(deviceContext, tempSize, context->quantizedNodes.data());
+    buffers.emplace_back(quantizedBuffer);
+
+    tempSize = sizeof(Instance) * context->instances.size();
+    LocalBuffer * instanceBuffer = ComputeEnvironment::CreateBuffer(deviceContext, tempSize, context->instances.data());
+    buffers.emplace_back(instanceBuffer);
 
     tempSize = sizeof(Ray) * context->width * context->height;
     LocalBuffer * rayBuffer = ComputeEnvironment::CreateBuffer(deviceContext, tempSize, CL_MEM_READ_WRITE);
@@ -68,6 +83,38 @@ CLShader::CLShader(RenderingContext * _context) : ComputeShader(_context){
     LocalBuffer * normalBuffer = ComputeEnvironment::CreateBuffer(deviceContext, tempSize, CL_MEM_READ_WRITE);
     buffers.emplace_back(normalBuffer);
 
+    tempSize = sizeof(PixelStatistics) * context->width * context->height;
+    LocalBuffer * statisticsBuffer = ComputeEnvironment::CreateBuffer(deviceContext, tempSize, CL_MEM_READ_WRITE);
+    buffers.emplace_back(statisticsBuffer);
+
+    std::vector<uint32_t> pixelIDs(context->width * context->height);
+
+    for(uint32_t id = 0; id < pixelIDs.size(); ++id)
+        pixelIDs[id] = id;
+
+    tempSize = sizeof(uint32_t) * pixelIDs.size();
+    activePixelsBuffer = ComputeEnvironment::CreateBuffer(deviceContext, tempSize, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, pixelIDs.data());
+    buffers.emplace_back(activePixelsBuffer);
+
+    numActiveBuffer = ComputeEnvironment::CreateBuffer(deviceContext, sizeof(uint32_t), CL_MEM_READ_WRITE);
+    buffers.emplace_back(numActiveBuffer);
+
+    for(int32_t id = 0; id < 2; ++id){
+        pathBuffers[id] = ComputeEnvironment::CreateBuffer(deviceContext, tempSize, CL_MEM_READ_WRITE);
+        buffers.emplace_back(pathBuffers[id]);
+    }
+
+    numSurvivingBuffer = ComputeEnvironment::CreateBuffer(deviceContext, sizeof(uint32_t), CL_MEM_READ_WRITE);
+    buffers.emplace_back(numSurvivingBuffer);
+
+    tempSize = sizeof(float) * context->width * context->height;
+    LocalBuffer * emissionBuffer = ComputeEnvironment::CreateBuffer(deviceContext, tempSize, CL_MEM_READ_WRITE);
+    buffers.emplace_back(emissionBuffer);
+
+    tempSize = sizeof(int32_t) * context->lights.size();
+    LocalBuffer * emitterBuffer = ComputeEnvironment::CreateBuffer(deviceContext, tempSize, context->lights.data());
+    buffers.emplace_back(emitterBuffer);
+
     globalRange = cl::NDRange(context->width, context->height, 1);
 
     cl_device_type type;
@@ -80,20 +127,32 @@ CLShader::CLShader(RenderingContext * _context) : ComputeShader(_context){
 
     if( type == CL_DEVICE_TYPE_CPU){
         localRange = cl::NDRange(1, 1, 1);
+        groupSize = 1;
     }else{
         localRange = cl::NDRange(8, 4, 1);
+        groupSize = 32;
     }
 
     int numObjects = context->objects.size();
     int numMaterials = context->materials.size();
+    // Stackless traversal of world tree ends before nodes of meshes
+    int numNodes = context->meshes.empty() ? nodes.size() : context->meshes[0].rootNode;
+
+    std::string stackOptions = GetStackOptions();
 
     transferKernel = ComputeEnvironment::CreateKernel(deviceContext, device, "resources/kernels/Transfer.cl", "Transfer");
     rayGenerationKernel = ComputeEnvironment::CreateKernel(deviceContext, device, "resources/kernels/CastRays.cl", "CastRays");
-    raytracingKernel = ComputeEnvironment::CreateKernel(deviceContext, device, "resources/kernels/RayTrace.cl", "RayTrace");
-
-    if( context->bvhAcceleration ){
+    raytracingKernel = ComputeEnvironment::CreateKernel(deviceContext, device, "resources/kernels/RayTrace.cl", "RayTrace", stackOptions);
+
+    if( quantized ){
+        context->loggingService.Write(MessageType::INFO, "Enabling quantized BVH traversal kernel");
+        intersectionKernel = ComputeEnvironment::CreateKernel(deviceContext, device, "resources/kernels/QuantizedTraverse.cl", "Traverse", stackOptions);
+    }else if( context->bvhAcceleration && context->stacklessTraversal ){
+        context->loggingService.Write(MessageType::INFO, "Enabling stackless BVH traversal kernel");
+        intersectionKernel = ComputeEnvironment::CreateKernel(deviceContext, device, "resources/kernels/StacklessTraverse.cl", "Traverse", stackOptions);
+    }else if( context->bvhAcceleration ){
         context->loggingService.Write(MessageType::INFO, "Enabling BVH accelerated traversal kernel");
-        intersectionKernel = ComputeEnvironment::CreateKernel(deviceContext, device, "resources/kernels/BVHTraverse.cl", "Traverse");
+        intersectionKernel = ComputeEnvironment::CreateKernel(deviceContext, device, "resources/kernels/BVHTraverse.cl", "Traverse", stackOptions);
     }else{
         context->loggingService.Write(MessageType::INFO, "Enabling linear traversal kernel");
         intersectionKernel = ComputeEnvironment::CreateKernel(deviceContext, device, "resources/kernels/LinearTraverse.cl", "Traverse");
@@ -104,16 +163,20 @@ CLShader::CLShader(RenderingContext * _context) : ComputeShader(_context){
     transferKernel.setArg(2, materials->buffer);
     transferKernel.setArg(3, textureInfo->buffer);
     transferKernel.setArg(4, textureData->buffer);
-    transferKernel.setArg(5, boxBuffer->buffer);
-    transferKernel.setArg(6, numObjects);
-    transferKernel.setArg(7, numMaterials);
-    transferKernel.setArg(8, sizeof(uint32_t), &context->width);
-    transferKernel.setArg(9, sizeof(uint32_t), &context->height);
+    transferKernel.setArg(5, nodeBuffer->buffer);
+    transferKernel.setArg(6, quantizedBuffer->buffer);
+    transferKernel.setArg(7, instanceBuffer->buffer);
+    transferKernel.setArg(8, numObjects);
+    transferKernel.setArg(9, numMaterials);
+    transferKernel.setArg(10, sizeof(uint32_t), &context->width);
+    transferKernel.setArg(11, sizeof(uint32_t), &context->height);
+    transferKernel.setArg(12, numNodes);
 
     intersectionKernel.setArg(0, resources->buffer);
     intersectionKernel.setArg(1, rayBuffer->buffer);
     intersectionKernel.setArg(2, sampleBuffer->buffer);
     intersectionKernel.setArg(3, normalBuffer->buffer);
+    intersectionKernel.setArg(4, activePixelsBuffer->buffer);
 
     rayGenerationKernel.setArg(0, resources->buffer);
     rayGenerationKernel.setArg(1, rayBuffer->buffer);
@@ -123,6 +186,8 @@ CLShader::CLShader(RenderingContext * _context) : ComputeShader(_context){
     rayGenerationKernel.setArg(5, normalBuffer->buffer);
     rayGenerationKernel.setArg(6, sizeof(Camera), &context->camera);
     rayGenerationKernel.setArg(7, sizeof(uint32_t), &context->frameCounter);
+    rayGenerationKernel.setArg(8, activePixelsBuffer->buffer);
+    rayGenerationKernel.setArg(10, (int)context->samplerType);
 
     raytracingKernel.setArg(0, resources->buffer);
     raytracingKernel.setArg(1, rayBuffer->buffer);
@@ -133,6 +198,26 @@ CLShader::CLShader(RenderingContext * _context) : ComputeShader(_context){
     raytracingKernel.setArg(6, normalBuffer->buffer);
     raytracingKernel.setArg(7, sizeof(Camera), &context->camera);
     raytracingKernel.setArg(8, sizeof(uint32_t), &context->frameCounter);
+    raytracingKernel.setArg(9, activePixelsBuffer->buffer);
+    raytracingKernel.setArg(12, numSurvivingBuffer->buffer);
+    raytracingKernel.setArg(14, sizeof(uint32_t), &context->minDepth);
+    raytracingKernel.setArg(15, sizeof(uint32_t), &context->maxDepth);
+
+    int numLights = context->lights.size();
+    int useBVH = 0;
+
+    // Matches traversal modes of resources/kernels/Occlusion.h
+    if( quantized ){
+        useBVH = 3;
+    }else if( context->bvhAcceleration && numNodes > 0 ){
+        useBVH = context->stacklessTraversal ? 2 : 1;
+    }
+
+    raytracingKernel.setArg(16, emissionBuffer->buffer);
+    raytracingKernel.setArg(17, emitterBuffer->buffer);
+    raytracingKernel.setArg(18, numLights);
+    raytracingKernel.setArg(19, useBVH);
+    raytracingKernel.setArg(20, (int)context->samplerType);
 
     context->loggingService.Write(MessageType::INFO, "Transfering data to accelerator");
     queue.enqueueNDRangeKernel(transferKernel, cl::NullRange, cl::NDRange(1), cl::NDRange(1));
@@ -147,16 +232,101 @@ CLShader::CLShader(RenderingContext * _context) : ComputeShader(_context){
     correctionKernel.setArg(5, sizeof(float), &context->gamma);
     correctionKernel.setArg(6, depthBuffer->buffer);
     correctionKernel.setArg(7, normalBuffer->buffer);
+    correctionKernel.setArg(8, statisticsBuffer->buffer);
+    correctionKernel.setArg(9, sizeof(float), &context->convergenceThreshold);
 
     depthKernel = ComputeEnvironment::CreateKernel(deviceContext, device, "resources/kernels/DepthMapping.cl", "DepthMapping");
     depthKernel.setArg(0, resources->buffer);
     depthKernel.setArg(1, rayBuffer->buffer);
     depthKernel.setArg(2, sampleBuffer->buffer);
     depthKernel.setArg(3, depthBuffer->buffer);
+    depthKernel.setArg(4, activePixelsBuffer->buffer);
+
+    compactionKernel = ComputeEnvironment::CreateKernel(deviceContext, device, "resources/kernels/CompactPixels.cl", "CompactPixels");
+    compactionKernel.setArg(0, statisticsBuffer->buffer);
+    compactionKernel.setArg(1, activePixelsBuffer->buffer);
+    compactionKernel.setArg(2, numActiveBuffer->buffer);
+
+    if( context->convergenceThreshold > 0.0f ){
+        context->loggingService.Write(MessageType::INFO, "Adaptive sampling with convergence threshold %f", context->convergenceThreshold);
+    }
+}
+
+cl::NDRange CLShader::ActiveRange(const uint32_t & numActive){
+    return cl::NDRange((numActive + groupSize - 1) / groupSize * groupSize);
+}
+
+uint32_t CLShader::CompactPixels(){
+
+    uint32_t numActive = context->width * context->height;
+
+    if( context->convergenceThreshold <= 0.0f )
+        return numActive;
+
+    numActive = 0;
+
+    compactionKernel.setArg(3, sizeof(uint32_t), &context->frameCounter);
+
+    queue.enqueueWriteBuffer(numActiveBuffer->buffer, CL_FALSE, 0, sizeof(uint32_t), &numActive);
+    queue.enqueueNDRangeKernel(compactionKernel, cl::NullRange, globalRange, localRange);
+    queue.enqueueReadBuffer(numActiveBuffer->buffer, CL_TRUE, 0, sizeof(uint32_t), &numActive);
+
+    return numActive;
+}
+
+std::string CLShader::GetStackOptions(){
+
+    if( !context->bvhAcceleration || context->nodes.empty() )
+        return std::string();
+
+    // Sizes are computed by BVHTree, wide size covers quantized tree as well
+    char options[256];
+    snprintf(options, sizeof(options), " -D STACK_SIZE=%d -D OCCLUSION_STACK_SIZE=%d -D QUANTIZED_STACK_SIZE=%d -D QUANTIZED_OCCLUSION_STACK_SIZE=%d -D INSTANCE_STACK_SIZE=%d",
+        context->stackSize, context->stackSize, context->wideStackSize, context->wideStackSize, context->instanceStackSize);
+
+    return std::string(options);
+}
+
+void CLShader::UploadRanges(LocalBuffer * buffer, const void * data, const size_t & elementSize, std::vector<int32_t> & ids){
+
+    std::sort(ids.begin(), ids.end());
+
+    size_t begin = 0;
+
+    // Consecutive elements are merged into one transfer
+    while( begin < ids.size() ){
+
+        size_t end = begin + 1;
+
+        while( end < ids.size() && ids[end] <= ids[end - 1] + 1 )
+            ++end;
+
+        size_t offset = elementSize * ids[begin];
+        size_t size = elementSize * (ids[end - 1] - ids[begin] + 1);
+
+        queue.enqueueWriteBuffer(buffer->buffer, CL_FALSE, offset, size, (const char *)data + offset);
+
+        begin = end;
+    }
+
+    ids.clear();
 }
 
 void CLShader::Render(Color * _pixels){
 
+    bool quantized = context->bvhAcceleration && !context->quantizedNodes.empty();
+    std::vector<BVHNode> & nodes = context->stacklessTraversal && !quantized ? context->linkedNodes : context->nodes;
+
+    // Without instanced meshes binary nodes were never uploaded
+    if( !quantized || !context->meshes.empty() ){
+        UploadRanges(nodeBuffer, nodes.data(), sizeof(BVHNode), context->changedNodes);
+    }else{
+        context->changedNodes.clear();
+    }
+
+    UploadRanges(quantizedBuffer, context->quantizedNodes.data(), sizeof(QuantizedNode), context->changedQuantizedNodes);
+    UploadRanges(objects, context->objects.data(), sizeof(Object), context->changedObjects);
+
     rayGenerationKernel.setArg(6, sizeof(Camera), &context->camera);
     rayGenerationKernel.setArg(7, sizeof(uint32_t), &context->frameCounter);
 
@@ -165,15 +335,41 @@ void CLShader::Render(Color * _pixels){
 
     correctionKernel.setArg(4, sizeof(uint32_t), &context->frameCounter);
 
-    queue.enqueueNDRangeKernel(rayGenerationKernel, cl::NullRange, globalRange, localRange);
+    uint32_t numActive = CompactPixels();
+
+    cl::NDRange groupRange = cl::NDRange(groupSize);
+
+    if( numActive > 0 ){
+        rayGenerationKernel.setArg(9, sizeof(uint32_t), &numActive);
+        queue.enqueueNDRangeKernel(rayGenerationKernel, cl::NullRange, ActiveRange(numActive), groupRange);
+    }
+
+    LocalBuffer * activePaths = activePixelsBuffer;
+
+    for(uint32_t depth = 0; depth < context->maxDepth && numActive > 0; ++depth){
+
+        LocalBuffer * survivingPaths = pathBuffers[depth % 2];
+        cl::NDRange activeRange = ActiveRange(numActive);
+
+        intersectionKernel.setArg(4, activePaths->buffer);
+        intersectionKernel.setArg(5, sizeof(uint32_t), &numActive);
+        queue.enqueueNDRangeKernel(intersectionKernel, cl::NullRange, activeRange, groupRange);
+
+        if( depth == 0 ){
+            depthKernel.setArg(5, sizeof(uint32_t), &numActive);
+            queue.enqueueNDRangeKernel(depthKernel, cl::NullRange, activeRange, groupRange);
+        }
+
+        raytracingKernel.setArg(9, activePaths->buffer);
+        raytracingKernel.setArg(10, sizeof(uint32_t), &numActive);
+        raytracingKernel.setArg(11, survivingPaths->buffer);
+        raytracingKernel.setArg(13, depth);
 
-    queue.enqueueNDRangeKernel(intersectionKernel, cl::NullRange, globalRange, localRange);
-    queue.enqueueNDRangeKernel(depthKernel, cl::NullRange, globalRange, localRange);
-    queue.enqueueNDRangeKernel(raytracingKernel, cl::NullRange, globalRange, localRange);
+        queue.enqueueFillBuffer(numSurvivingBuffer->buffer, (cl_uint)0, 0, sizeof(cl_uint));
+        queue.enqueueNDRangeKernel(raytracingKernel, cl::NullRange, activeRange, groupRange);
+        queue.enqueueReadBuffer(numSurvivingBuffer->buffer, CL_TRUE, 0, sizeof(uint32_t), &numActive);
 
-    for(int i = 1; i < 4; ++i){
-        queue.enqueueNDRangeKernel(intersectionKernel, cl::NullRange, globalRange, localRange);
-        queue.enqueueNDRangeKernel(raytracingKernel, cl::NullRange, globalRange, localRange);
+        activePaths = survivingPaths;
     }
 
     queue.enqueueNDRangeKernel(correctionKernel, cl::NullRange, globalRange, localRange);
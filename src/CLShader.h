@@ -5,6 +5,8 @@
 #include "ComputeEnvironment.h"
 #include "Ray.h"
 #include "Sample.h"
+#include <algorithm>
+#include <string>
 #include <vector>
 
 class CLShader : public ComputeShader{
@@ -21,6 +23,7 @@ private:
     cl::Kernel depthKernel;
     cl::Kernel raytracingKernel;
     cl::Kernel correctionKernel;
+    cl::Kernel compactionKernel;
 
     std::vector< LocalBuffer* > buffers;
 
@@ -31,6 +34,32 @@ private:
     cl::NDRange globalRange;
     cl::NDRange localRange;
 
+    LocalBuffer * objects;
+    LocalBuffer * nodeBuffer;
+    LocalBuffer * quantizedBuffer;
+
+    LocalBuffer * activePixelsBuffer;
+    LocalBuffer * numActiveBuffer;
+
+    LocalBuffer * pathBuffers[2];
+    LocalBuffer * numSurvivingBuffer;
+
+    uint32_t groupSize;
+
+    /// @brief Rounds number of active paths up to multiple of work group size
+    cl::NDRange ActiveRange(const uint32_t & numActive);
+
+    /// @brief Collects pixels which have not converged yet into list of active pixels
+    /// @return number of active pixels
+    uint32_t CompactPixels();
+
+    /// @brief Returns macro definitions which size traversal stacks of kernels for trees of current scene
+    std::string GetStackOptions();
+
+    /// @brief Writes listed elements of host array to buffer, one transfer per run of consecutive ids
+    /// @param ids indices of changed elements, cleared after upload
+    void UploadRanges(LocalBuffer * buffer, const void * data, const size_t & elementSize, std::vector<int32_t> & ids);
+
 public:
 
     CLShader(RenderingContext * _context);
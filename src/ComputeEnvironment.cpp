@@ -208,7 +208,182 @@ cl::Device ComputeEnvironment::GetDefaultDevice(const cl::Platform & platform){
     return defaultDevice;
 }
 
-cl::Kernel ComputeEnvironment::CreateKernel(const cl::Context & deviceContext, const cl::Device & device, const char * filepath, const char * kernelName){
+uint64_t ComputeEnvironment::HashSources(uint64_t hash, const std::string & filepath, std::vector<std::string> & visited){
+
+    if( std::find(visited.begin(), visited.end(), filepath) != visited.end() )
+        return hash;
+
+    visited.emplace_back(filepath);
+
+    std::fstream input(filepath, std::ios::in);
+
+    if( !input.is_open() )
+        return hash;
+
+    std::string line;
+
+    while( std::getline(input, line) ){
+
+        hash = BVHCache::Hash(hash, line.c_str(), line.length() + 1);
+
+        // Headers are included relative to working directory, just like compiler resolves them
+        size_t directive = line.find("#include \"");
+
+        if( directive == std::string::npos )
+            continue;
+
+        size_t begin = directive + 10;
+        size_t end = line.find('"', begin);
+
+        if( end != std::string::npos )
+            hash = HashSources(hash, line.substr(begin, end - begin), visited);
+    }
+
+    return hash;
+}
+
+uint64_t ComputeEnvironment::CalculateProgramKey(const cl::Device & device, const char * filepath, const std::string & options){
+
+    cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+
+    std::string properties[] = {
+        platform.getInfo<CL_PLATFORM_NAME>(),
+        platform.getInfo<CL_PLATFORM_VERSION>(),
+        device.getInfo<CL_DEVICE_NAME>(),
+        device.getInfo<CL_DEVICE_VERSION>(),
+        device.getInfo<CL_DRIVER_VERSION>(),
+        options
+    };
+
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    uint32_t version = PROGRAM_CACHE_VERSION;
+    hash = BVHCache::Hash(hash, &version, sizeof(version));
+
+    for(const std::string & property : properties)
+        hash = BVHCache::Hash(hash, property.c_str(), property.length() + 1);
+
+    std::vector<std::string> visited;
+
+    return HashSources(hash, filepath, visited);
+}
+
+std::string ComputeEnvironment::GetProgramPath(const uint64_t & key){
+
+    if( context->cacheDirectory.empty() )
+        return std::string();
+
+    char filename[32];
+    snprintf(filename, sizeof(filename), "%016llx.clbin", (unsigned long long)key);
+
+    return (std::filesystem::path(context->cacheDirectory) / filename).string();
+}
+
+cl::Program ComputeEnvironment::LoadProgram(const cl::Context & deviceContext, const cl::Device & device, const std::string & path, const uint64_t & key, const std::string & options){
+
+    MappedFile file(path);
+
+    if( !file.IsOpen() || file.GetSize() < sizeof(ProgramHeader) )
+        return cl::Program();
+
+    const uint8_t * data = file.GetData();
+
+    ProgramHeader header;
+    memcpy(&header, data, sizeof(ProgramHeader));
+
+    if( header.magic != PROGRAM_CACHE_MAGIC || header.version != PROGRAM_CACHE_VERSION || header.key != key )
+        return cl::Program();
+
+    if( file.GetSize() != sizeof(ProgramHeader) + header.binarySize ){
+        context->loggingService.Write(MessageType::ISSUE, "Program cache file %s is truncated", path.c_str());
+        return cl::Program();
+    }
+
+    // C API is used directly, since binaries are typed differently by every version of C++ bindings
+    cl_device_id deviceID = device();
+    size_t binarySize = header.binarySize;
+    const unsigned char * binary = data + sizeof(ProgramHeader);
+
+    if( BVHCache::Hash(FNV_OFFSET_BASIS, binary, binarySize) != header.binaryHash ){
+        context->loggingService.Write(MessageType::ISSUE, "Program cache file %s is corrupt", path.c_str());
+        return cl::Program();
+    }
+
+    cl_int binaryStatus;
+    cl_int status;
+
+    cl_program handle = clCreateProgramWithBinary(deviceContext(), 1, &deviceID, &binarySize, &binary, &binaryStatus, &status);
+
+    if( status != CL_SUCCESS || binaryStatus != CL_SUCCESS )
+        return cl::Program();
+
+    cl::Program program(handle);
+
+    if( clBuildProgram(handle, 1, &deviceID, options.c_str(), NULL, NULL) != CL_SUCCESS ){
+        context->loggingService.Write(MessageType::WARNING, "Driver rejected cached program %s, rebuilding it", path.c_str());
+        return cl::Program();
+    }
+
+    return program;
+}
+
+bool ComputeEnvironment::SaveProgram(const cl::Program & program, const std::string & path, const uint64_t & key){
+
+    // Program is built for single device, so it has exactly one binary
+    size_t binarySize = 0;
+
+    if( clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, NULL) != CL_SUCCESS || binarySize == 0 )
+        return false;
+
+    std::vector<unsigned char> binary(binarySize);
+    unsigned char * binaryPointer = binary.data();
+
+    if( clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(unsigned char *), &binaryPointer, NULL) != CL_SUCCESS )
+        return false;
+
+    std::error_code error;
+    std::filesystem::path filepath(path);
+    std::filesystem::create_directories(filepath.parent_path(), error);
+
+    // Every run writes its own file and renames it, so concurrent runs never map half written or mixed file
+    std::string temporaryPath = BVHCache::GetTemporaryPath(path);
+    std::ofstream file(temporaryPath, std::ios::out | std::ios::binary | std::ios::trunc);
+
+    if( !file.is_open() ){
+        context->loggingService.Write(MessageType::ISSUE, "Can't write program cache file %s", path.c_str());
+        return false;
+    }
+
+    ProgramHeader header = {};
+    header.magic = PROGRAM_CACHE_MAGIC;
+    header.version = PROGRAM_CACHE_VERSION;
+    header.key = key;
+    header.binarySize = binarySize;
+    header.binaryHash = BVHCache::Hash(FNV_OFFSET_BASIS, binary.data(), binarySize);
+
+    file.write((const char *)&header, sizeof(ProgramHeader));
+    file.write((const char *)binary.data(), binarySize);
+    file.close();
+
+    if( file.fail() ){
+        std::filesystem::remove(temporaryPath, error);
+        context->loggingService.Write(MessageType::ISSUE, "Can't write program cache file %s", path.c_str());
+        return false;
+    }
+
+    std::filesystem::rename(temporaryPath, path, error);
+
+    if( error ){
+        std::filesystem::remove(temporaryPath, error);
+        return false;
+    }
+
+    return true;
+}
+
+cl::Kernel ComputeEnvironment::CreateKernel(const cl::Context & deviceContext, const cl::Device & device, const char * filepath, const char * kernelName, const std::string & options){
+
+    Timepoint begin = Timer::GetCurrentTime();
 
     cl::Program::Sources sources;
 
@@ -232,16 +407,43 @@ cl::Kernel ComputeEnvironment::CreateKernel(const cl::Context & deviceContext, c
         exit(-1);
     }
 
-    sources.push_back({kernel_code.c_str(), kernel_code.length()});
+    std::string buildOptions = std::string(PROGRAM_BUILD_OPTIONS) + options;
 
-    cl::Program program(deviceContext, sources);
+    uint64_t key = 0;
+    std::string cachePath;
 
-    if(program.build() != CL_SUCCESS){
-        std::string buildLog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
-        context->loggingService.Write(MessageType::ISSUE, "Program build log : %s", buildLog.c_str());
-        exit(-1);
+    if( !context->cacheDirectory.empty() ){
+        key = CalculateProgramKey(device, filepath, buildOptions);
+        cachePath = GetProgramPath(key);
+    }
+
+    cl::Program program;
+
+    if( !cachePath.empty() )
+        program = LoadProgram(deviceContext, device, cachePath, key, buildOptions);
+
+    bool cached = program() != NULL;
+
+    if( !cached ){
+
+        sources.push_back({kernel_code.c_str(), kernel_code.length()});
+
+        program = cl::Program(deviceContext, sources);
+
+        if(program.build(buildOptions.c_str()) != CL_SUCCESS){
+            std::string buildLog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+            context->loggingService.Write(MessageType::ISSUE, "Program build log : %s", buildLog.c_str());
+            exit(-1);
+        }
+
+        if( !cachePath.empty() && SaveProgram(program, cachePath, key) )
+            context->loggingService.Write(MessageType::INFO, "Program %s saved to cache %s", filepath, cachePath.c_str());
     }
 
+    Timepoint end = Timer::GetCurrentTime();
+
+    context->loggingService.Write(MessageType::INFO, "Program %s %s in %0.3lf ms", filepath, cached ? "loaded from cache" : "built", Timer::GetDurationInSeconds(end - begin) * 1000.0);
+
     context->loggingService.Write(MessageType::INFO, "Discovered programs : %s", program.getInfo<CL_PROGRAM_KERNEL_NAMES>().c_str());
 
     if(!program()){
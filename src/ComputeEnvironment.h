@@ -29,22 +29,60 @@
 
 #endif
 
+#include "BVHCache.h"
+#include "MappedFile.h"
 #include "RenderingContext.h"
+#include "Timer.h"
 
+#include <algorithm>
+#include <filesystem>
 #include <fstream>
 #include <string>
 #include <vector>
 
+// Options passed to every program build, together with options of program they are part of the binary cache key
+#define PROGRAM_BUILD_OPTIONS ""
+
+#define PROGRAM_CACHE_MAGIC 0x4E494243
+#define PROGRAM_CACHE_VERSION 2
+
 struct LocalBuffer{
     size_t size;
     cl::Buffer buffer;
 };
 
+// Cached program binary follows header
+struct ProgramHeader{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint64_t binarySize;
+
+    // Hash of binary, so file damaged on disk is rebuilt instead of handed to driver
+    uint64_t binaryHash;
+};
+
 class ComputeEnvironment {
 private:
 
     static RenderingContext * context;
 
+    /// @brief Mixes source file and all files it includes into hash, every file is hashed once
+    /// @param visited paths of already hashed files
+    static uint64_t HashSources(uint64_t hash, const std::string & filepath, std::vector<std::string> & visited);
+
+    /// @brief Hashes everything the compiled binary depends on: device, driver, build options and sources
+    static uint64_t CalculateProgramKey(const cl::Device & device, const char * filepath, const std::string & options);
+
+    /// @brief Returns path of cached binary for key, empty when caching is disabled
+    static std::string GetProgramPath(const uint64_t & key);
+
+    /// @brief Creates and builds program from memory mapped binary
+    /// @return empty program when file is missing, stale or rejected by driver
+    static cl::Program LoadProgram(const cl::Context & deviceContext, const cl::Device & device, const std::string & path, const uint64_t & key, const std::string & options);
+
+    static bool SaveProgram(const cl::Program & program, const std::string & path, const uint64_t & key);
+
 public:
 
 
@@ -73,11 +111,12 @@ public:
     /// @return read only buffer filled with data
     static LocalBuffer * CreateBuffer(const cl::Context & deviceContext, const size_t & _size, const void * data);
 
-    /// @brief Creates OpenCL kernel
+    /// @brief Creates OpenCL kernel, compiled program is cached in cache directory when one is set
     /// @param filepath 
     /// @param kernelName 
+    /// @param options build options appended to PROGRAM_BUILD_OPTIONS, e.g. macro definitions
     /// @return kernel object
-    static cl::Kernel CreateKernel(const cl::Context & deviceContext, const cl::Device & device, const char * filepath, const char * kernelName);
+    static cl::Kernel CreateKernel(const cl::Context & deviceContext, const cl::Device & device, const char * filepath, const char * kernelName, const std::string & options = "");
 
     /// @brief Creates handle to selected device
     static cl::Device GetDefaultDevice(const cl::Platform & platform);
@@ -16,6 +16,7 @@ Configurator::Configurator(RenderingContext * _context){
 
     this->serializer = new SceneSerializer(context);
     this->tree = new BVHTree(context);
+    this->animationTime = 0.0f;
 
     Initialize();
 }
@@ -47,7 +48,106 @@ void Configurator::Initialize(){
 
 }
 
+void Configurator::CollectLights(){
+
+    context->lights.clear();
+
+    // Triangles of instanced meshes are kept in mesh space, so only objects of the world are sampled
+    int32_t numWorldObjects = context->meshes.empty() ? context->objects.size() : context->meshes[0].firstObject;
+
+    // Copies made by spatial splits share original index and are sampled once
+    const std::vector<int32_t> & order = tree->GetOrder();
+    std::vector<bool> collected(order.size(), false);
+
+    for(int32_t id = 0; id < numWorldObjects; ++id){
+
+        if( context->objects[id].type == INSTANCE )
+            continue;
+
+        if( !order.empty() ){
+
+            if( collected[ order[id] ] )
+                continue;
+
+            collected[ order[id] ] = true;
+        }
+
+        const Material & material = context->materials[ context->objects[id].materialID ];
+        const Color & albedo = material.albedo;
+
+        if( material.emmissionIntensity > 0.0f && (albedo.R + albedo.G + albedo.B) > 0.0f )
+            context->lights.emplace_back(id);
+    }
+
+    context->loggingService.Write(MessageType::INFO, "Sampling %d emissive objects directly", context->lights.size());
+}
+
+void Configurator::CollectAnimatedObjects(){
+
+    int32_t numWorldObjects = context->meshes.empty() ? context->objects.size() : context->meshes[0].firstObject;
+
+    const std::vector<int32_t> & order = tree->GetOrder();
+    std::vector<bool> collected(order.size(), false);
+
+    for(int32_t id = 0; id < numWorldObjects; ++id){
+
+        const Object & object = context->objects[id];
+
+        if( object.type == INSTANCE || context->materials[ object.materialID ].emmissionIntensity <= 0.0f )
+            continue;
+
+        // All copies made by spatial splits are moved together under original index
+        int32_t sourceID = order.empty() ? id : order[id];
+
+        if( !order.empty() ){
+
+            if( collected[sourceID] )
+                continue;
+
+            collected[sourceID] = true;
+        }
+
+        animatedObjects.emplace_back(sourceID);
+        animatedOrigins.emplace_back(object);
+    }
+
+    context->loggingService.Write(MessageType::INFO, "Animating %d emissive objects", animatedObjects.size());
+}
+
+void Configurator::Animate(const double & deltaTime){
+
+    if( animatedObjects.empty() )
+        return;
+
+    animationTime += deltaTime;
+
+    const Vector3 offset = worldUp * (ANIMATION_AMPLITUDE * sinf(animationTime * ANIMATION_SPEED));
+
+    std::vector<int32_t> objectIDs;
+
+    for(size_t index = 0; index < animatedObjects.size(); ++index){
+
+        Object object = animatedOrigins[index];
+
+        object.position = object.position + offset;
+
+        for(int32_t vertex = 0; vertex < 3; ++vertex)
+            object.vertices[vertex] = object.vertices[vertex] + offset;
+
+        objectIDs.clear();
+        tree->GetCopies(animatedObjects[index], objectIDs);
+
+        for(const int32_t & objectID : objectIDs)
+            context->objects[objectID] = object;
+    }
+
+    tree->Refit(animatedObjects);
+
+    context->frameCounter = 0;
+}
+
 Configurator::~Configurator(){
+    delete context->threadPool;
     delete tree;
     delete serializer;
 }
@@ -63,9 +163,27 @@ void Configurator::ShowHelp(){
     fprintf(stdout,"  -S              Enable memory sharing\n");
     fprintf(stdout,"  -H              Show help menu\n");
     fprintf(stdout,"  -B              Build BVH tree\n");
+    fprintf(stdout,"  -b <builder>    Set BVH builder, sah (default), lbvh or sbvh\n");
+    fprintf(stdout,"  -x <budget>     Set fraction of extra object references spatial splits may create (default 0.3)\n");
+    fprintf(stdout,"  -l <size>       Set maximal number of objects in BVH leaf (at most 255)\n");
+    fprintf(stdout,"  -o <passes>     Restructure BVH treelets to lower SAH cost after build (default 0)\n");
+    fprintf(stdout,"  -C <directory>  Cache built BVH trees and compiled kernels in directory and reuse them\n");
+    fprintf(stdout,"  -M <file>       Append BVH statistics to CSV file\n");
+    fprintf(stdout,"  -W              Collapse BVH into wide nodes tested with SIMD (CPU, requires -B)\n");
+    fprintf(stdout,"  -q              Store BVH in 8 wide nodes with 8 bit child bounds (CPU and GPU, requires -B)\n");
+    fprintf(stdout,"  -s              Walk BVH without stack on GPU, skipping missed subtrees\n");
+    fprintf(stdout,"  -P              Trace primary rays in SIMD packets (CPU, requires -B, not with -W or -q)\n");
+    fprintf(stdout,"  -Q              Trace paths in wavefront stages (CPU)\n");
+    fprintf(stdout,"  -N              Sample emissive objects directly at every hit\n");
+    fprintf(stdout,"  -R <sampler>    Set random sampler, hash (default) or sobol\n");
     fprintf(stdout,"  -O              Enable camera orbiting around center\n");
+    fprintf(stdout,"  -a              Move emissive objects every frame, refitting BVH around them\n");
     fprintf(stdout,"  -T <threads>    Set number of threads\n");
+    fprintf(stdout,"  -t <size>       Set size of tiles rendered by threads\n");
     fprintf(stdout,"  -F <frames>     Set number of frames to render\n");
+    fprintf(stdout,"  -D <depth>      Set maximal number of bounces per path\n");
+    fprintf(stdout,"  -d <depth>      Set number of bounces before russian roulette may end a path\n");
+    fprintf(stdout,"  -A <threshold>  Stop sampling pixels whose relative error is below threshold\n");
 
 }
 
@@ -87,6 +205,9 @@ void Configurator::ParseArgs(const size_t & size, char **args){
         } else if (arg[1] == 'O' && arg[2] == '\0' && context->followCenter == false) {
             fprintf(stdout, "Camera self movement enabled.\n");
             context->followCenter = true;
+        } else if (arg[1] == 'a' && arg[2] == '\0' && context->animatedLights == false) {
+            fprintf(stdout, "Emissive object movement enabled.\n");
+            context->animatedLights = true;
         } else if (arg[1] == 'L' && arg[2] == '\0' && filepath == NULL) {
             if (i + 1 < size && args[i + 1][0] != '-') {
                 filepath = args[i + 1];
@@ -95,6 +216,22 @@ void Configurator::ParseArgs(const size_t & size, char **args){
                 fprintf(stderr, "Error: -L flag requires a scene file path\n");
                 exit(-1);
             }
+        } else if (arg[1] == 'C' && arg[2] == '\0') {
+            if (i + 1 < size && args[i + 1][0] != '-') {
+                context->cacheDirectory = args[i + 1];
+                i++;
+            } else {
+                fprintf(stderr, "Error: -C flag requires a cache directory\n");
+                exit(-1);
+            }
+        } else if (arg[1] == 'M' && arg[2] == '\0') {
+            if (i + 1 < size && args[i + 1][0] != '-') {
+                context->statisticsPath = args[i + 1];
+                i++;
+            } else {
+                fprintf(stderr, "Error: -M flag requires a file path\n");
+                exit(-1);
+            }
         } else if (arg[1] == 'w' && arg[2] == '\0') {
             if (i + 1 < size && args[i + 1][0] != '-') {
                 context->width = std::max(atoi(args[i+1]), 100);
@@ -120,6 +257,14 @@ void Configurator::ParseArgs(const size_t & size, char **args){
                 fprintf(stderr, "Error: -T flag requires number of threads\n");
                 exit(-1);
             }
+        } else if (arg[1] == 't' && arg[2] == '\0') {
+            if (i + 1 < size && args[i + 1][0] != '-') {
+                context->tileSize = std::max(atoi(args[i+1]), 1);
+                i++;
+            } else {
+                fprintf(stderr, "Error: -t flag requires tile size\n");
+                exit(-1);
+            }
         } else if (arg[1] == 'F' && arg[2] == '\0' && context->boundedFrames == false) {
             if (i + 1 < size && args[i + 1][0] != '-') {
                 context->numBoundedFrames = std::max(atoi(args[i+1]), 1);
@@ -129,18 +274,117 @@ void Configurator::ParseArgs(const size_t & size, char **args){
                 fprintf(stderr, "Error: -F flag requires number of frames\n");
                 exit(-1);
             }
+        } else if (arg[1] == 'D' && arg[2] == '\0') {
+            if (i + 1 < size && args[i + 1][0] != '-') {
+                context->maxDepth = std::max(atoi(args[i+1]), 1);
+                i++;
+            } else {
+                fprintf(stderr, "Error: -D flag requires path depth\n");
+                exit(-1);
+            }
+        } else if (arg[1] == 'd' && arg[2] == '\0') {
+            if (i + 1 < size && args[i + 1][0] != '-') {
+                context->minDepth = std::max(atoi(args[i+1]), 1);
+                i++;
+            } else {
+                fprintf(stderr, "Error: -d flag requires path depth\n");
+                exit(-1);
+            }
+        } else if (arg[1] == 'l' && arg[2] == '\0') {
+            if (i + 1 < size && args[i + 1][0] != '-') {
+                context->maxLeafSize = std::min(std::max(atoi(args[i+1]), 1), QUANTIZED_MAX_LEAF_SIZE);
+                i++;
+            } else {
+                fprintf(stderr, "Error: -l flag requires leaf size\n");
+                exit(-1);
+            }
+        } else if (arg[1] == 'x' && arg[2] == '\0') {
+            if (i + 1 < size && args[i + 1][0] != '-') {
+                context->splitBudget = std::max((float)atof(args[i+1]), 0.0f);
+                i++;
+            } else {
+                fprintf(stderr, "Error: -x flag requires split budget\n");
+                exit(-1);
+            }
+        } else if (arg[1] == 'o' && arg[2] == '\0') {
+            if (i + 1 < size && args[i + 1][0] != '-') {
+                context->treeletPasses = std::max(atoi(args[i+1]), 0);
+                i++;
+            } else {
+                fprintf(stderr, "Error: -o flag requires number of passes\n");
+                exit(-1);
+            }
+        } else if (arg[1] == 'A' && arg[2] == '\0') {
+            if (i + 1 < size && args[i + 1][0] != '-') {
+                context->convergenceThreshold = std::max((float)atof(args[i+1]), 0.0f);
+                i++;
+            } else {
+                fprintf(stderr, "Error: -A flag requires convergence threshold\n");
+                exit(-1);
+            }
         } else if (arg[1] == 'S' && arg[2] == '\0' && context->memorySharing == false) {
             fprintf(stdout, "Memory sharing enabled.\n");
             context->memorySharing = true;
         } else if (arg[1] == 'B' && arg[2] == '\0' && context->bvhAcceleration == false) {
             fprintf(stdout, "BVH tree enabled.\n");
             context->bvhAcceleration = true;
+        } else if (arg[1] == 'W' && arg[2] == '\0' && context->wideBVH == false) {
+            fprintf(stdout, "Wide BVH enabled.\n");
+            context->wideBVH = true;
+        } else if (arg[1] == 'q' && arg[2] == '\0' && context->quantizedBVH == false) {
+            fprintf(stdout, "Quantized BVH enabled.\n");
+            context->quantizedBVH = true;
+        } else if (arg[1] == 's' && arg[2] == '\0' && context->stacklessTraversal == false) {
+            fprintf(stdout, "Stackless BVH traversal enabled.\n");
+            context->stacklessTraversal = true;
+        } else if (arg[1] == 'P' && arg[2] == '\0' && context->packetTraversal == false) {
+            fprintf(stdout, "Ray packets enabled.\n");
+            context->packetTraversal = true;
+        } else if (arg[1] == 'Q' && arg[2] == '\0' && context->wavefront == false) {
+            fprintf(stdout, "Wavefront path tracing enabled.\n");
+            context->wavefront = true;
+        } else if (arg[1] == 'N' && arg[2] == '\0' && context->lightSampling == false) {
+            fprintf(stdout, "Light sampling enabled.\n");
+            context->lightSampling = true;
+        } else if (arg[1] == 'R' && arg[2] == '\0') {
+            if (i + 1 < size && strcmp(args[i + 1], "hash") == 0) {
+                context->samplerType = HASH_SAMPLER;
+                i++;
+            } else if (i + 1 < size && strcmp(args[i + 1], "sobol") == 0) {
+                context->samplerType = SOBOL_SAMPLER;
+                i++;
+            } else {
+                fprintf(stderr, "Error: -R flag requires sampler name (hash or sobol)\n");
+                exit(-1);
+            }
+        } else if (arg[1] == 'b' && arg[2] == '\0') {
+            const char * builders[] = BUILDER_TYPES;
+            size_t builder = BUILDER_TYPE_SIZE;
+
+            for(size_t pos = 0; i + 1 < size && pos < BUILDER_TYPE_SIZE; ++pos){
+                if( strcmp(args[i + 1], builders[pos]) == 0 )
+                    builder = pos;
+            }
+
+            if (builder < BUILDER_TYPE_SIZE) {
+                context->bvhBuilder = BuilderType(builder);
+                i++;
+            } else {
+                fprintf(stderr, "Error: -b flag requires builder name (sah, lbvh or sbvh)\n");
+                exit(-1);
+            }
         } else if (arg[1] == 'H' && arg[2] == '\0') {
             ShowHelp();
             exit(0);
         }
     }
 
+    // Packets are traced through binary nodes, which wide and quantized layouts replace
+    if( context->packetTraversal && (context->wideBVH || context->quantizedBVH) ){
+        fprintf(stderr, "Error: -P flag can't be combined with -W or -q\n");
+        exit(-1);
+    }
+
     context->width = std::max((uint32_t)32, (context->width+16)/32 * 32);
     context->height = std::max((uint32_t)32, (context->height+16)/32 * 32);
 
@@ -151,7 +395,15 @@ void Configurator::ParseArgs(const size_t & size, char **args){
     if( filepath != NULL )
         serializer->LoadFromFile(filepath);
 
+    context->threadPool = new ThreadPool(context->numThreads);
+
     if( context->bvhAcceleration == true )
         tree->BuildBVH();
 
+    if( context->lightSampling == true )
+        CollectLights();
+
+    if( context->animatedLights == true )
+        CollectAnimatedObjects();
+
 }
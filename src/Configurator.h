@@ -5,8 +5,14 @@
 #include "ComputeEnvironment.h"
 #include "BVHTree.h"
 
+#include <cmath>
+#include <cstring>
 #include <thread>
 
+// Animated emissive objects bob vertically around their placement from scene file
+#define ANIMATION_AMPLITUDE 100.0f
+#define ANIMATION_SPEED 1.5f
+
 class Configurator{
 private:
     
@@ -16,8 +22,17 @@ private:
     
     BVHTree * tree;
 
+    // Original indices of animated objects with their placement at start
+    std::vector<int32_t> animatedObjects;
+    std::vector<Object> animatedOrigins;
+    float animationTime;
+
     void Initialize();
 
+    void CollectLights();
+
+    void CollectAnimatedObjects();
+
     void ShowHelp();
 
 public:
@@ -26,6 +41,10 @@ public:
 
     void ParseArgs(const size_t & size, char **args);
 
+    /// @brief Moves animated objects to their placement in next frame and refits BVH around them
+    /// @param deltaTime time since last frame in seconds
+    void Animate(const double & deltaTime);
+
     ~Configurator();
 
 };
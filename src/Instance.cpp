@@ -0,0 +1,69 @@
+#include "Instance.h"
+
+static Vector3 Transform(const Vector3 * rows, const Vector3 & vector, const float & w){
+    return Vector3(
+        Vector3::DotProduct(rows[0], vector) + rows[0].w * w,
+        Vector3::DotProduct(rows[1], vector) + rows[1].w * w,
+        Vector3::DotProduct(rows[2], vector) + rows[2].w * w
+    );
+}
+
+Instance Instance::Create(const int32_t & meshID, const Vector3 & position, const Vector3 & rotation, const Vector3 & scale){
+
+    const float toRadians = 3.1415926535f / 180.0f;
+
+    float cx = cosf(rotation.x * toRadians), sx = sinf(rotation.x * toRadians);
+    float cy = cosf(rotation.y * toRadians), sy = sinf(rotation.y * toRadians);
+    float cz = cosf(rotation.z * toRadians), sz = sinf(rotation.z * toRadians);
+
+    // Rotation around x, then y and then z axis
+    Vector3 rows[3] = {
+        Vector3(cy * cz, sx * sy * cz - cx * sz, cx * sy * cz + sx * sz),
+        Vector3(cy * sz, sx * sy * sz + cx * cz, cx * sy * sz - sx * cz),
+        Vector3(-sy, sx * cy, cx * cy)
+    };
+
+    Instance instance;
+    instance.meshID = meshID;
+    instance.rootNode = -1;
+    instance.numNodes = 0;
+
+    float translation[3] = {position.x, position.y, position.z};
+
+    for(int32_t row = 0; row < 3; ++row){
+        instance.toWorld[row] = rows[row] * scale;
+        instance.toWorld[row].w = translation[row];
+    }
+
+    // Inverse of rotation is its transpose, scale is undone after it
+    float inverseScale[3] = {1.0f / scale.x, 1.0f / scale.y, 1.0f / scale.z};
+
+    instance.toInstance[0] = Vector3(rows[0].x, rows[1].x, rows[2].x) * inverseScale[0];
+    instance.toInstance[1] = Vector3(rows[0].y, rows[1].y, rows[2].y) * inverseScale[1];
+    instance.toInstance[2] = Vector3(rows[0].z, rows[1].z, rows[2].z) * inverseScale[2];
+
+    for(int32_t row = 0; row < 3; ++row)
+        instance.toInstance[row].w = -Vector3::DotProduct(instance.toInstance[row], position);
+
+    return instance;
+}
+
+Vector3 Instance::PointToInstance(const Vector3 & point) const{
+    return Transform(toInstance, point, 1.0f);
+}
+
+Vector3 Instance::DirectionToInstance(const Vector3 & direction) const{
+    return Transform(toInstance, direction, 0.0f);
+}
+
+Vector3 Instance::PointToWorld(const Vector3 & point) const{
+    return Transform(toWorld, point, 1.0f);
+}
+
+Vector3 Instance::NormalToWorld(const Vector3 & normal) const{
+    return Vector3(
+        toInstance[0].x * normal.x + toInstance[1].x * normal.y + toInstance[2].x * normal.z,
+        toInstance[0].y * normal.x + toInstance[1].y * normal.y + toInstance[2].y * normal.z,
+        toInstance[0].z * normal.x + toInstance[1].z * normal.y + toInstance[2].z * normal.z
+    );
+}
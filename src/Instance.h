@@ -0,0 +1,49 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "BoundingBox.h"
+#include "Vector3.h"
+
+#include <math.h>
+#include <stdint.h>
+
+// Geometry shared by instances. Its triangles are kept in mesh space and follow objects of the world.
+struct Mesh{
+    int32_t firstObject;
+    int32_t numObjects;
+
+    // Range of flattened nodes of mesh tree, filled by BVH build
+    int32_t rootNode;
+    int32_t numNodes;
+
+    // Bounds of mesh in its own space
+    BoundingBox bounds;
+};
+
+// Placement of mesh in world. Transforms are stored as rows with translation in w.
+struct Instance{
+    Vector3 toWorld[3];
+    Vector3 toInstance[3];
+
+    int32_t meshID;
+
+    // Copied from mesh, so traversal does not need mesh list
+    int32_t rootNode;
+    int32_t numNodes;
+
+    /// @brief Creates placement which scales, then rotates and then moves mesh
+    /// @param rotation angles around x, y and z axis in degrees
+    static Instance Create(const int32_t & meshID, const Vector3 & position, const Vector3 & rotation, const Vector3 & scale);
+
+    Vector3 PointToInstance(const Vector3 & point) const;
+
+    Vector3 DirectionToInstance(const Vector3 & direction) const;
+
+    Vector3 PointToWorld(const Vector3 & point) const;
+
+    /// @brief Transforms normal by transpose of inverse transform
+    Vector3 NormalToWorld(const Vector3 & normal) const;
+
+} __attribute((aligned(16)));
+
+#endif
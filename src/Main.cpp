@@ -46,6 +46,7 @@ int main(int argc, char **argv){
     if( context.boundedFrames ){
 
         for(uint32_t frame = 0; frame < context.numBoundedFrames; ++frame){
+            configurator.Animate(Timer::GetInstance().GetDeltaFrame());
             manager.Render();
             monitor.GatherInformation();
         }
@@ -62,6 +63,7 @@ int main(int argc, char **argv){
         const Vector3 center = Vector3(0.0f, 0.0f, 0.0f);
 
         while ( manager.ShouldClose() ) {
+            configurator.Animate(Timer::GetInstance().GetDeltaFrame());
             manager.Update();
             monitor.GatherInformation();
 
@@ -90,6 +92,7 @@ int main(int argc, char **argv){
     SetupKeyBindings(context, manager);
 
     while ( manager.ShouldClose() ) {
+        configurator.Animate(Timer::GetInstance().GetDeltaFrame());
         manager.Update();
         monitor.GatherInformation();
     }
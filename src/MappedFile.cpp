@@ -0,0 +1,100 @@
+#include "MappedFile.h"
+
+#ifdef __WIN32__
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __WIN32__
+
+MappedFile::MappedFile(const std::string & path){
+
+    data = NULL;
+    size = 0;
+    mappingHandle = NULL;
+
+    fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if( fileHandle == INVALID_HANDLE_VALUE )
+        return;
+
+    LARGE_INTEGER fileSize;
+
+    if( !GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0 )
+        return;
+
+    mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+
+    if( mappingHandle == NULL )
+        return;
+
+    data = (const uint8_t *)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+
+    if( data != NULL )
+        size = fileSize.QuadPart;
+}
+
+MappedFile::~MappedFile(){
+
+    if( data != NULL )
+        UnmapViewOfFile(data);
+
+    if( mappingHandle != NULL )
+        CloseHandle(mappingHandle);
+
+    if( fileHandle != INVALID_HANDLE_VALUE )
+        CloseHandle(fileHandle);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string & path){
+
+    data = NULL;
+    size = 0;
+
+    int file = open(path.c_str(), O_RDONLY);
+
+    if( file == -1 )
+        return;
+
+    struct stat status;
+
+    if( fstat(file, &status) == 0 && status.st_size > 0 ){
+
+        void * mapping = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+
+        if( mapping != MAP_FAILED ){
+            data = (const uint8_t *)mapping;
+            size = status.st_size;
+        }
+
+    }
+
+    // Mapping stays valid after descriptor is closed
+    close(file);
+}
+
+MappedFile::~MappedFile(){
+
+    if( data != NULL )
+        munmap((void *)data, size);
+}
+
+#endif
+
+bool MappedFile::IsOpen() const{
+    return data != NULL;
+}
+
+const uint8_t * MappedFile::GetData() const{
+    return data;
+}
+
+size_t MappedFile::GetSize() const{
+    return size;
+}
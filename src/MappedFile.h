@@ -0,0 +1,33 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// Read-only view of whole file mapped into memory, pages are loaded on first access
+class MappedFile{
+private:
+
+    const uint8_t * data;
+    size_t size;
+
+#ifdef __WIN32__
+    void * fileHandle;
+    void * mappingHandle;
+#endif
+
+public:
+
+    MappedFile(const std::string & path);
+
+    bool IsOpen() const;
+
+    const uint8_t * GetData() const;
+
+    size_t GetSize() const;
+
+    ~MappedFile();
+};
+
+#endif
@@ -93,9 +93,7 @@ void MeshSerializer::CalculateNormals(){
 
 }
 
-void MeshSerializer::BuildTriangles(){
-
-    const Vector3 offset = Vector3(context->width/2.0f, context->height/2.0f, context->depth/2.0f);
+void MeshSerializer::BuildTriangles(const Vector3 & offset, std::vector<Object> & triangles){
 
     float scale = 100.0f * context->camera.aspectRatio;
 
@@ -132,7 +130,7 @@ void MeshSerializer::BuildTriangles(){
 
         temp.materialID = faces[id].materialID;
 
-        context->objects.emplace_back(temp);
+        triangles.emplace_back(temp);
 
     }
 
@@ -238,8 +236,6 @@ void MeshSerializer::Parse(std::ifstream & file, const char * filename){
 
     CalculateNormals();
 
-    BuildTriangles();
-    
 }
 
 void MeshSerializer::LoadFromFile(const char * _filename){
@@ -261,4 +257,37 @@ void MeshSerializer::LoadFromFile(const char * _filename){
 
     file.close();
 
+    const Vector3 offset = Vector3(context->width/2.0f, context->height/2.0f, context->depth/2.0f);
+
+    BuildTriangles(offset, context->objects);
+}
+
+bool MeshSerializer::LoadMesh(const char * _filename, std::vector<Object> & triangles){
+
+    std::ifstream file(_filename, std::ios::in);
+
+    context->loggingService.Write(MessageType::INFO, "Loading instanced mesh file : %s", _filename);
+
+    if ( !file.is_open() ) {
+        fprintf(stderr, "File %s can't be opened.\n", _filename);
+        return false;
+    }
+
+    faces.clear();
+    vertices.clear();
+    normals.clear();
+
+    Parse(file, _filename);
+
+    file.close();
+
+    // Mesh without faces has no bounds to build its tree from
+    if( faces.empty() ){
+        fprintf(stderr, "File %s contains no faces.\n", _filename);
+        return false;
+    }
+
+    BuildTriangles(Vector3(), triangles);
+
+    return true;
 }
@@ -30,7 +30,7 @@ private:
 
     void ParseFace(const  std::vector<std::string> & tokens);
 
-    void BuildTriangles();
+    void BuildTriangles(const Vector3 & offset, std::vector<Object> & triangles);
 
     void CalculateNormals();
 
@@ -42,6 +42,11 @@ public:
 
     void LoadFromFile(const char * _filename);
 
+    /// @brief Loads mesh in its own space, scaled like meshes placed in world
+    /// @param triangles receives triangles of mesh
+    /// @return false when file can't be opened or has no faces
+    bool LoadMesh(const char * _filename, std::vector<Object> & triangles);
+
 };
 
 #endif
\ No newline at end of file
@@ -16,6 +16,7 @@ struct Object{
     Vector3 vertices[3]; //48
     Vector3 uvs[3]; //48
     int materialID; //4
+    int instanceID; //4, placement of mesh when type is INSTANCE
 } __attribute((aligned(256)));
 
 
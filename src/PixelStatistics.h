@@ -0,0 +1,18 @@
+#ifndef PIXELSTATISTICS_H
+#define PIXELSTATISTICS_H
+
+#include <stdint.h>
+
+#define CONVERGENCE_MIN_SAMPLES 16
+#define CONVERGENCE_FLOOR 0.01f
+
+// Running mean and sum of squared deviations of pixel luminance, updated with Welford's method.
+// Pixel is converged once standard error of its mean drops below threshold relative to the mean.
+struct PixelStatistics{
+    float mean;
+    float deviation;
+    uint32_t numSamples;
+    int32_t converged;
+} __attribute((aligned(16)));
+
+#endif
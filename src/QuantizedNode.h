@@ -0,0 +1,67 @@
+#ifndef QUANTIZEDNODE_H
+#define QUANTIZEDNODE_H
+
+#include <stdint.h>
+#include <cstring>
+
+// Width is fixed, so layout is shared with resources/kernels/KernelStructs.h
+#define QUANTIZED_NODE_WIDTH 8
+
+// Child bounds are stored as offsets on grid of 255 steps spanning the node
+#define QUANTIZED_GRID_STEPS 255
+
+// Leaf child stores its object count in one byte
+#define QUANTIZED_MAX_LEAF_SIZE 255
+
+// Grid steps are powers of two with normal float exponents
+#define QUANTIZED_MIN_EXPONENT -126
+#define QUANTIZED_MAX_EXPONENT 127
+
+// Compressed node of collapsed BVH, its children bounds decode as origin + offset * 2^exponent.
+// Offsets are rounded outwards, so decoded boxes always enclose the exact ones.
+// Unused slots have minimal offsets above maximal ones and are never hit.
+struct QuantizedNode{
+    float origin[3];
+    int8_t exponents[3];
+    uint8_t numChildren;
+
+    uint8_t minimal[3][QUANTIZED_NODE_WIDTH];
+    uint8_t maximal[3][QUANTIZED_NODE_WIDTH];
+
+    // Leaf child: first object of its range, inner child: index of quantized node
+    int32_t children[QUANTIZED_NODE_WIDTH];
+
+    // Number of objects in leaf child, zero for inner children
+    uint8_t primitiveCounts[QUANTIZED_NODE_WIDTH];
+
+    QuantizedNode(){
+        for(int32_t axis = 0; axis < 3; ++axis){
+            origin[axis] = 0.0f;
+            exponents[axis] = 0;
+        }
+
+        numChildren = 0;
+
+        for(int32_t slot = 0; slot < QUANTIZED_NODE_WIDTH; ++slot){
+
+            for(int32_t axis = 0; axis < 3; ++axis){
+                minimal[axis][slot] = QUANTIZED_GRID_STEPS;
+                maximal[axis][slot] = 0;
+            }
+
+            children[slot] = -1;
+            primitiveCounts[slot] = 0;
+        }
+    }
+
+    /// @brief Returns grid step 2^exponent, built directly from float exponent bits
+    static float Scale(const int8_t & exponent){
+        uint32_t bits = (uint32_t)(exponent + 127) << 23;
+        float scale;
+        memcpy(&scale, &bits, sizeof(float));
+        return scale;
+    }
+
+} __attribute((aligned(8)));
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef RAYPACKET_H
+#define RAYPACKET_H
+
+#include <stdint.h>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#ifdef __AVX2__
+
+#define PACKET_SIZE 8
+#define PACKET_WIDTH 4
+#define PACKET_HEIGHT 2
+
+typedef __m256 Lanes;
+
+#else
+
+#define PACKET_SIZE 4
+#define PACKET_WIDTH 2
+#define PACKET_HEIGHT 2
+
+#ifdef __SSE2__
+
+typedef __m128 Lanes;
+
+#else
+
+// Portable lanes for targets without SSE2 (e.g. ARM), comparisons yield all bits set like SSE masks
+struct Lanes{
+    float value[PACKET_SIZE];
+} __attribute((aligned(16)));
+
+#endif
+
+#endif
+
+#define PACKET_FULL_MASK ((1 << PACKET_SIZE) - 1)
+
+struct RayPacket{
+    float originX[PACKET_SIZE];
+    float originY[PACKET_SIZE];
+    float originZ[PACKET_SIZE];
+
+    float directionX[PACKET_SIZE];
+    float directionY[PACKET_SIZE];
+    float directionZ[PACKET_SIZE];
+
+    float inverseX[PACKET_SIZE];
+    float inverseY[PACKET_SIZE];
+    float inverseZ[PACKET_SIZE];
+} __attribute((aligned(32)));
+
+namespace Packet{
+
+#ifdef __AVX2__
+
+inline Lanes Load(const float * data){ return _mm256_load_ps(data); }
+
+inline Lanes LoadBytes(const uint8_t * data){ return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)data))); }
+
+inline void Store(float * data, const Lanes & a){ _mm256_store_ps(data, a); }
+
+inline Lanes Set(const float & value){ return _mm256_set1_ps(value); }
+
+inline Lanes Add(const Lanes & a, const Lanes & b){ return _mm256_add_ps(a, b); }
+
+inline Lanes Sub(const Lanes & a, const Lanes & b){ return _mm256_sub_ps(a, b); }
+
+inline Lanes Mul(const Lanes & a, const Lanes & b){ return _mm256_mul_ps(a, b); }
+
+inline Lanes Div(const Lanes & a, const Lanes & b){ return _mm256_div_ps(a, b); }
+
+inline Lanes Min(const Lanes & a, const Lanes & b){ return _mm256_min_ps(a, b); }
+
+inline Lanes Max(const Lanes & a, const Lanes & b){ return _mm256_max_ps(a, b); }
+
+inline Lanes Less(const Lanes & a, const Lanes & b){ return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+
+inline Lanes LessEqual(const Lanes & a, const Lanes & b){ return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+
+inline Lanes And(const Lanes & a, const Lanes & b){ return _mm256_and_ps(a, b); }
+
+inline Lanes Select(const Lanes & a, const Lanes & b, const Lanes & mask){ return _mm256_blendv_ps(a, b, mask); }
+
+inline Lanes Abs(const Lanes & a){ return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+
+inline int32_t Mask(const Lanes & a){ return _mm256_movemask_ps(a); }
+
+#elif defined(__SSE2__)
+
+inline Lanes Load(const float * data){ return _mm_load_ps(data); }
+
+// Bytes are widened by unpacking with zeros, which needs only SSE2
+inline Lanes LoadBytes(const uint8_t * data){
+    int32_t word;
+    memcpy(&word, data, sizeof(word));
+    __m128i zero = _mm_setzero_si128();
+    __m128i words = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(word), zero), zero);
+    return _mm_cvtepi32_ps(words);
+}
+
+inline void Store(float * data, const Lanes & a){ _mm_store_ps(data, a); }
+
+inline Lanes Set(const float & value){ return _mm_set1_ps(value); }
+
+inline Lanes Add(const Lanes & a, const Lanes & b){ return _mm_add_ps(a, b); }
+
+inline Lanes Sub(const Lanes & a, const Lanes & b){ return _mm_sub_ps(a, b); }
+
+inline Lanes Mul(const Lanes & a, const Lanes & b){ return _mm_mul_ps(a, b); }
+
+inline Lanes Div(const Lanes & a, const Lanes & b){ return _mm_div_ps(a, b); }
+
+inline Lanes Min(const Lanes & a, const Lanes & b){ return _mm_min_ps(a, b); }
+
+inline Lanes Max(const Lanes & a, const Lanes & b){ return _mm_max_ps(a, b); }
+
+inline Lanes Less(const Lanes & a, const Lanes & b){ return _mm_cmplt_ps(a, b); }
+
+inline Lanes LessEqual(const Lanes & a, const Lanes & b){ return _mm_cmple_ps(a, b); }
+
+inline Lanes And(const Lanes & a, const Lanes & b){ return _mm_and_ps(a, b); }
+
+inline Lanes Select(const Lanes & a, const Lanes & b, const Lanes & mask){ return _mm_or_ps(_mm_andnot_ps(mask, a), _mm_and_ps(mask, b)); }
+
+inline Lanes Abs(const Lanes & a){ return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+
+inline int32_t Mask(const Lanes & a){ return _mm_movemask_ps(a); }
+
+#else
+
+inline uint32_t Bits(const float & value){ uint32_t bits; memcpy(&bits, &value, sizeof(bits)); return bits; }
+
+inline float Float(const uint32_t & bits){ float value; memcpy(&value, &bits, sizeof(value)); return value; }
+
+inline Lanes Load(const float * data){ Lanes result; memcpy(result.value, data, sizeof(result.value)); return result; }
+
+inline Lanes LoadBytes(const uint8_t * data){ Lanes result; for(int i = 0; i < PACKET_SIZE; ++i) result.value[i] = data[i]; return result; }
+
+inline void Store(float * data, const Lanes & a){ memcpy(data, a.value, sizeof(a.value)); }
+
+inline Lanes Set(const float & value){ Lanes result; for(int i = 0; i < PACKET_SIZE; ++i) result.value[i] = value; return result; }
+
+inline Lanes Add(const Lanes & a, const Lanes & b){ Lanes result; for(int i = 0; i < PACKET_SIZE; ++i) result.value[i] = a.value[i] + b.value[i]; return result; }
+
+inline Lanes Sub(const Lanes & a, const Lanes & b){ Lanes result; for(int i = 0; i < PACKET_SIZE; ++i) result.value[i] = a.value[i] - b.value[i]; return result; }
+
+inline Lanes Mul(const Lanes & a, const Lanes & b){ Lanes result; for(int i = 0; i < PACKET_SIZE; ++i) result.value[i] = a.value[i] * b.value[i]; return result; }
+
+inline Lanes Div(const Lanes & a, const Lanes & b){ Lanes result; for(int i = 0; i < PACKET_SIZE; ++i) result.value[i] = a.value[i] / b.value[i]; return result; }
+
+// Second operand is returned when either is NaN, same as minps and maxps
+inline Lanes Min(const Lanes & a, const Lanes & b){ Lanes result; for(int i = 0; i < PACKET_SIZE; ++i) result.value[i] = a.value[i] < b.value[i] ? a.value[i] : b.value[i]; return result; }
+
+inline Lanes Max(const Lanes & a, const Lanes & b){ Lanes result; for(int i = 0; i < PACKET_SIZE; ++i) result.value[i] = a.value[i] > b.value[i] ? a.value[i] : b.value[i]; return result; }
+
+inline Lanes Less(const Lanes & a, const Lanes & b){ Lanes result; for(int i = 0; i < PACKET_SIZE; ++i) result.value[i] = Float(a.value[i] < b.value[i] ? 0xFFFFFFFFu : 0u); return result; }
+
+inline Lanes LessEqual(const Lanes & a, const Lanes & b){ Lanes result; for(int i = 0; i < PACKET_SIZE; ++i) result.value[i] = Float(a.value[i] <= b.value[i] ? 0xFFFFFFFFu : 0u); return result; }
+
+inline Lanes And(const Lanes & a, const Lanes & b){ Lanes result; for(int i = 0; i < PACKET_SIZE; ++i) result.value[i] = Float(Bits(a.value[i]) & Bits(b.value[i])); return result; }
+
+inline Lanes Select(const Lanes & a, const Lanes & b, const Lanes & mask){ Lanes result; for(int i = 0; i < PACKET_SIZE; ++i) result.value[i] = Bits(mask.value[i]) >> 31 ? b.value[i] : a.value[i]; return result; }
+
+inline Lanes Abs(const Lanes & a){ Lanes result; for(int i = 0; i < PACKET_SIZE; ++i) result.value[i] = Float(Bits(a.value[i]) & 0x7FFFFFFFu); return result; }
+
+inline int32_t Mask(const Lanes & a){ int32_t mask = 0; for(int i = 0; i < PACKET_SIZE; ++i) mask |= (Bits(a.value[i]) >> 31) << i; return mask; }
+
+#endif
+
+};
+
+#endif
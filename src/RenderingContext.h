@@ -5,10 +5,20 @@
 #include "Logger.h"
 #include "Camera.h"
 #include "BoundingBox.h"
+#include "BVHNode.h"
+#include "Instance.h"
+#include "WideNode.h"
+#include "QuantizedNode.h"
+#include "BuilderType.h"
 #include "Texture.h"
+#include "TrianglePack.h"
+#include "PixelStatistics.h"
+#include "Sampler.h"
+#include "ThreadPool.h"
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <string>
 #include <vector>
 
 struct RenderingContext {
@@ -24,6 +34,13 @@ struct RenderingContext {
     bool boundedFrames = false;
     bool followCenter = false;
     bool useCPU = false;
+    bool packetTraversal = false;
+    bool wavefront = false;
+    bool lightSampling = false;
+    bool wideBVH = false;
+    bool stacklessTraversal = false;
+    bool quantizedBVH = false;
+    bool animatedLights = false;
 
     // Texture transfer object
     GLuint textureID;
@@ -32,9 +49,42 @@ struct RenderingContext {
     std::vector<Object> objects;
     std::vector<Material> materials;
 
+    // Meshes placed by instances, their triangles follow objects of the world
+    std::vector<Mesh> meshes;
+    std::vector<Instance> instances;
+
+    // Structure of arrays copy of triangles used by CPU traversal
+    std::vector<TrianglePack> trianglePacks;
+    std::vector<int32_t> sphereIDs;
+
+    // Emissive objects sampled directly at every hit
+    std::vector<int32_t> lights;
+
     // Bounding Boxes
     std::vector<BoundingBox> boxes;
 
+    // Depth first flattened copy of boxes consumed by traversal
+    std::vector<BVHNode> nodes;
+
+    // Copy of nodes where inner node offset points past its subtree, walked without stack on GPU
+    std::vector<BVHNode> linkedNodes;
+
+    // Boxes collapsed into nodes with one child per SIMD lane, used by CPU traversal
+    std::vector<WideNode> wideNodes;
+
+    // Boxes collapsed into nodes with 8 bit child bounds, used by CPU and GPU traversal
+    std::vector<QuantizedNode> quantizedNodes;
+
+    // Entries traversal stacks hold at most for trees of current scene, sized when tree is built
+    int32_t stackSize = 1;
+    int32_t wideStackSize = 1;
+    int32_t instanceStackSize = 1;
+
+    // Nodes and objects modified by refit, shaders upload them before next frame
+    std::vector<int32_t> changedNodes;
+    std::vector<int32_t> changedQuantizedNodes;
+    std::vector<int32_t> changedObjects;
+
     // Texture data
     std::vector<Texture> textureInfo;
     std::vector<unsigned int> textureData;
@@ -45,7 +95,29 @@ struct RenderingContext {
 
     uint32_t numBoundedFrames;
     uint32_t numThreads;
+    uint32_t tileSize = 16;
+    uint32_t maxDepth = 4;
+    uint32_t minDepth = 2;
+    uint32_t maxLeafSize = 4;
     float gamma = 2.2f;
+    float convergenceThreshold = 0.0f;
+    SamplerType samplerType = HASH_SAMPLER;
+    BuilderType bvhBuilder = SAH_BUILDER;
+
+    // Fraction of extra object references spatial splits may create
+    float splitBudget = 0.3f;
+
+    // Treelet restructuring passes run after build, zero disables them
+    uint32_t treeletPasses = 0;
+
+    // Directory of cached BVH trees, caching is disabled when empty
+    std::string cacheDirectory;
+
+    // File BVH statistics are appended to, disabled when empty
+    std::string statisticsPath;
+
+    // Workers shared by BVH builder and CPU renderer, owned by configurator
+    ThreadPool * threadPool = NULL;
 
     // Logging service
     Logger loggingService;
@@ -7,6 +7,8 @@
 struct Sample{
     struct Vector3 point;
     int objectID;
+    // Instance whose mesh contains hit object, -1 for objects of the world
+    int instanceID;
 } __attribute((aligned((32))));
 
 #endif
\ No newline at end of file
@@ -0,0 +1,49 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "Random.h"
+
+#include <stdint.h>
+
+#define SAMPLER_PRIMARY_DIMENSIONS 2
+#define SAMPLER_BOUNCE_DIMENSIONS 8
+#define SOBOL_DIMENSIONS 4
+#define SOBOL_BITS 32
+
+enum SamplerType{
+    HASH_SAMPLER,
+    SOBOL_SAMPLER
+};
+
+// Random stream of one pixel sample, mirrored in resources/kernels/Sampler.h
+struct Sampler{
+    SamplerType type;
+    uint32_t pixel;
+    uint32_t sample;
+    uint32_t dimension;
+    uint32_t seed; // hash state or scrambling seed of the pixel
+};
+
+namespace Sampling{
+
+/// @brief Starts new sample of a pixel
+/// @param type generator used by the sampler
+/// @param pixel index of the pixel
+/// @param sample index of the sample within the pixel
+Sampler Create(const SamplerType & type, const uint32_t & pixel, const uint32_t & sample);
+
+/// @brief Moves sampler to first dimension reserved for given bounce, keeping dimensions of all samples aligned
+void StartBounce(Sampler & sampler, const uint32_t & depth);
+
+/// @brief Returns next value in [0, 1) and advances to next dimension
+float Next(Sampler & sampler);
+
+/// @brief Returns component of Owen scrambled Sobol point, padded to higher dimensions by shuffling 4D sets
+/// @param index index of the point
+/// @param dimension component of the point
+/// @param seed scrambling seed
+float Sobol(const uint32_t & index, const uint32_t & dimension, const uint32_t & seed);
+
+};
+
+#endif
@@ -60,6 +60,7 @@ void SceneSerializer::ResetObject(){
     temporaryObject.normals[1] = Vector3(0.0f, 1.0f, 0.0f);
     temporaryObject.normals[2] = Vector3(0.0f, 1.0f, 0.0f);
     scales = Vector3(1.0f, 1.0f, 1.0f);
+    rotations = Vector3(0.0f, 0.0f, 0.0f);
     temporaryObject.type = SpatialType::INVALID;
     temporaryObject.materialID = 0;
 }
@@ -118,6 +119,21 @@ void SceneSerializer::ParseObject(const std::vector<std::string> & tokens){
             return;
         }
 
+    }else if( tokens[0] == "rotation" ){
+
+        if( tokens.size() > 3){
+
+            temp.x = atof(tokens[1].c_str());
+            temp.y = atof(tokens[2].c_str());
+            temp.z = atof(tokens[3].c_str());
+
+            rotations = temp;
+
+        }else{
+            fprintf(stderr, "Invalid rotation format\n");
+            return;
+        }
+
     }else if( tokens[0] == "material" ){
         if( tokens.size() > 1){
 
@@ -190,6 +206,8 @@ void SceneSerializer::Parse(std::ifstream & file, const char * filename){
                             ObjectBuilder<DISK>::Build(temporaryObject, context);
                         }else if( temporaryObject.type == SpatialType::CUBE){
                             ObjectBuilder<CUBE>::Build(temporaryObject, context, scales);
+                        }else if( temporaryObject.type == SpatialType::INSTANCE){
+                            AddInstance();
                         }else{
                             context->objects.emplace_back(temporaryObject);
                         }
@@ -212,6 +230,16 @@ void SceneSerializer::Parse(std::ifstream & file, const char * filename){
                         return;
                     }
 
+                }else if ( tokens[0] == "instance"){
+
+                    if(tokens.size() > 1){
+                        instancePath = directory.string() + "//" + tokens[1];
+                        temporaryObject.type = SpatialType::INSTANCE;
+                    }else{
+                        fprintf(stderr, "Invalid instance format.\n");
+                        return;
+                    }
+
                 }else if( CheckTypes( tokens[0].c_str() ) != SpatialType::INVALID ){
 
                     if(tokens[0]=="}")
@@ -252,4 +280,85 @@ void SceneSerializer::LoadFromFile(const char * _filename){
 
     file.close();
 
+    AppendMeshes();
+}
+
+int32_t SceneSerializer::FindMesh(const std::string & path){
+
+    for(size_t meshID = 0; meshID < meshPaths.size(); ++meshID){
+        if( meshPaths[meshID] == path )
+            return meshID;
+    }
+
+    Mesh mesh = {};
+    mesh.firstObject = meshObjects.size();
+
+    if( !meshSerializer->LoadMesh(path.c_str(), meshObjects) )
+        return -1;
+
+    mesh.numObjects = meshObjects.size() - mesh.firstObject;
+    mesh.rootNode = -1;
+
+    meshPaths.emplace_back(path);
+    meshes.emplace_back(mesh);
+
+    return meshes.size() - 1;
+}
+
+void SceneSerializer::AddInstance(){
+
+    int32_t meshID = FindMesh(instancePath);
+
+    if( meshID == -1 )
+        return;
+
+    Instance instance = Instance::Create(meshID, temporaryObject.position, rotations, scales);
+
+    if( !context->bvhAcceleration ){
+
+        const Mesh & mesh = meshes[meshID];
+
+        for(int32_t id = mesh.firstObject; id < mesh.firstObject + mesh.numObjects; ++id){
+
+            Object triangle = meshObjects[id];
+
+            for(int32_t vertex = 0; vertex < 3; ++vertex){
+                triangle.vertices[vertex] = instance.PointToWorld(triangle.vertices[vertex]);
+                triangle.normals[vertex] = instance.NormalToWorld(triangle.normals[vertex]).Normalize();
+            }
+
+            triangle.position = instance.PointToWorld(triangle.position);
+
+            context->objects.emplace_back(triangle);
+        }
+
+        return;
+    }
+
+    Object object = {};
+    object.type = SpatialType::INSTANCE;
+    object.position = temporaryObject.position;
+    object.materialID = temporaryObject.materialID;
+    object.instanceID = context->instances.size();
+
+    context->instances.emplace_back(instance);
+    context->objects.emplace_back(object);
+}
+
+void SceneSerializer::AppendMeshes(){
+
+    if( !context->bvhAcceleration || meshes.empty() )
+        return;
+
+    for(Mesh & mesh : meshes)
+        mesh.firstObject += context->objects.size();
+
+    context->objects.insert(context->objects.end(), meshObjects.begin(), meshObjects.end());
+    context->meshes.insert(context->meshes.end(), meshes.begin(), meshes.end());
+
+    context->loggingService.Write(MessageType::INFO, "Placed %d instances of %d meshes with %d triangles", context->instances.size(), meshes.size(), meshObjects.size());
+
+    meshObjects.clear();
+    meshes.clear();
+    meshPaths.clear();
 }
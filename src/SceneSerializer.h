@@ -16,6 +16,15 @@ class SceneSerializer : public Serializer{
 private:
 
     Vector3 scales;
+    Vector3 rotations;
+
+    // Mesh placed by instance block being parsed
+    std::string instancePath;
+
+    // Meshes loaded for instances and their triangles in mesh space, appended to objects after whole scene
+    std::vector<std::string> meshPaths;
+    std::vector<Mesh> meshes;
+    std::vector<Object> meshObjects;
 
     const char * properties[OBJECT_PROPERTIES_SIZE] = OBJECT_PROPERTIES;
     const char * types[SPATIAL_TYPE_SIZE] = SPATIAL_TYPES;
@@ -34,6 +43,16 @@ private:
 
     void ParseObject(const std::vector<std::string> & tokens);
 
+    /// @brief Returns mesh loaded from path, loading it on first use
+    /// @return index of mesh, -1 when file can't be loaded
+    int32_t FindMesh(const std::string & path);
+
+    /// @brief Places mesh of instance block in scene, meshes are baked into world triangles without BVH
+    void AddInstance();
+
+    /// @brief Moves triangles of instanced meshes after objects of the world
+    void AppendMeshes();
+
     void Parse(std::ifstream & file, const char * filename);
 
 public:
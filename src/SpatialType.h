@@ -10,6 +10,7 @@ enum SpatialType{
     DISK,
     CUBE,
     TRIANGLE,
+    INSTANCE,
     INVALID,
     NUM_SPATIALS
 } __attribute((aligned(1)));
@@ -0,0 +1,79 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(const uint32_t & _numThreads){
+
+    this->generation = 0;
+    this->pendingWorkers = 0;
+    this->running = true;
+
+    for(uint32_t id = 0; id < _numThreads; ++id){
+        workers.emplace_back(&ThreadPool::Work, this, id);
+    }
+
+}
+
+void ThreadPool::Work(const uint32_t threadID){
+
+    uint64_t lastGeneration = 0;
+
+    while( true ){
+
+        {
+            std::unique_lock<std::mutex> guard(lock);
+
+            wakeUp.wait(guard, [this, &lastGeneration](){
+                return generation != lastGeneration || !running;
+            });
+
+            if( !running )
+                return;
+
+            lastGeneration = generation;
+        }
+
+        task(threadID);
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            if( --pendingWorkers == 0 )
+                finished.notify_one();
+        }
+
+    }
+
+}
+
+void ThreadPool::Dispatch(const Task & _task){
+
+    std::unique_lock<std::mutex> guard(lock);
+
+    task = _task;
+    pendingWorkers = workers.size();
+    generation++;
+
+    wakeUp.notify_all();
+
+    finished.wait(guard, [this](){
+        return pendingWorkers == 0;
+    });
+
+}
+
+uint32_t ThreadPool::GetSize() const{
+    return workers.size();
+}
+
+ThreadPool::~ThreadPool(){
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        running = false;
+    }
+
+    wakeUp.notify_all();
+
+    for(uint32_t id = 0; id < workers.size(); ++id)
+        workers[id].join();
+
+}
@@ -0,0 +1,44 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <stdint.h>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using Task = std::function<void(const uint32_t & threadID)>;
+
+class ThreadPool{
+private:
+
+    std::vector<std::thread> workers;
+
+    std::mutex lock;
+    std::condition_variable wakeUp;
+    std::condition_variable finished;
+
+    Task task;
+
+    uint64_t generation;
+    uint32_t pendingWorkers;
+    bool running;
+
+    void Work(const uint32_t threadID);
+
+public:
+
+    ThreadPool(const uint32_t & _numThreads);
+
+    /// @brief Wakes every worker with given task and blocks until all of them are done
+    /// @param _task function receiving index of worker executing it
+    void Dispatch(const Task & _task);
+
+    /// @brief Returns number of workers
+    uint32_t GetSize() const;
+
+    ~ThreadPool();
+};
+
+#endif
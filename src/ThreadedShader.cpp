@@ -3,27 +3,149 @@
 
 ThreadedShader::ThreadedShader(RenderingContext * _context) : ComputeShader(_context){
 
-    numThreads = context->numThreads;
+    // Reuse workers which already built the BVH tree
+    ownsPool = context->threadPool == NULL;
+    pool = ownsPool ? new ThreadPool(context->numThreads) : context->threadPool;
+
+    numThreads = pool->GetSize();
 
     context->loggingService.Write(MessageType::INFO, "Discovered %d logic cores", std::thread::hardware_concurrency());
     context->loggingService.Write(MessageType::INFO, "Using %d threads", numThreads);
 
-    threads = new std::thread[numThreads];
+    queues = new TileQueue[numThreads];
+
+    uint32_t tileSize = std::max(context->tileSize, (uint32_t)1);
+
+    for(uint32_t y = 0; y < context->height; y += tileSize){
+        for(uint32_t x = 0; x < context->width; x += tileSize){
+
+            Tile tile;
+            tile.startX = x;
+            tile.startY = y;
+            tile.endX = std::min(x + tileSize, context->width);
+            tile.endY = std::min(y + tileSize, context->height);
 
-    rowsPerThread = context->height / numThreads;
+            tiles.emplace_back(tile);
+        }
+    }
 
-    if ( context->bvhAcceleration == true && context->boxes.size() > 0){
+    context->loggingService.Write(MessageType::INFO, "Split image into %d tiles of %dx%d pixels", tiles.size(), tileSize, tileSize);
+
+    if ( context->bvhAcceleration == true && context->quantizedNodes.size() > 0){
+        traverse = ThreadedShader::WideTraverse<QuantizedNode>;
+        occluded = ThreadedShader::WideOcclusion<QuantizedNode>;
+    }else if ( context->bvhAcceleration == true && context->wideNodes.size() > 0){
+        traverse = ThreadedShader::WideTraverse<WideNode>;
+        occluded = ThreadedShader::WideOcclusion<WideNode>;
+    }else if ( context->bvhAcceleration == true && context->nodes.size() > 0){
         traverse = ThreadedShader::BVHTraverse;
+        occluded = ThreadedShader::BVHOcclusion;
     }else{
         traverse = ThreadedShader::LinearTraverse;
+        occluded = ThreadedShader::LinearOcclusion;
+    }
+
+    PackTriangles();
+
+    statistics.resize(context->width * context->height);
+
+    if( context->convergenceThreshold > 0.0f ){
+        context->loggingService.Write(MessageType::INFO, "Adaptive sampling with convergence threshold %f", context->convergenceThreshold);
+    }
+
+    states = NULL;
+
+    if( context->wavefront ){
+
+        uint32_t numPixels = context->width * context->height;
+
+        states = new PathStates();
+        states->rays.resize(numPixels);
+        states->samples.resize(numPixels);
+        states->normals.resize(numPixels);
+        states->lightSamples.resize(numPixels);
+        states->accumulators.resize(numPixels);
+        states->emissionWeights.resize(numPixels);
+        states->samplers.resize(numPixels);
+        states->activePaths.resize(numPixels);
+        states->survivingPaths.resize(numPixels);
+
+        context->loggingService.Write(MessageType::INFO, "Using wavefront path tracing with %d paths per frame", numPixels);
+    }
+
+    usePackets = context->packetTraversal && traverse == ThreadedShader::BVHTraverse;
+
+    if( usePackets ){
+        context->loggingService.Write(MessageType::INFO, "Tracing primary rays in %dx%d packets", PACKET_WIDTH, PACKET_HEIGHT);
+    }else if( context->packetTraversal && traverse == ThreadedShader::LinearTraverse ){
+        context->loggingService.Write(MessageType::WARNING, "Ray packets require BVH acceleration, tracing single rays");
+    }else if( context->packetTraversal ){
+        context->loggingService.Write(MessageType::WARNING, "Ray packets support only binary BVH nodes, not wide or quantized ones, tracing single rays");
+    }
+
+}
+
+void ThreadedShader::PackTriangles(){
+
+    uint32_t numObjects = context->objects.size();
+    uint32_t numPacks = (numObjects + TRIANGLE_PACK_SIZE - 1) / TRIANGLE_PACK_SIZE;
+
+    context->trianglePacks.assign(numPacks, TrianglePack{});
+    context->sphereIDs.clear();
+
+    for(uint32_t id = 0; id < numPacks * TRIANGLE_PACK_SIZE; ++id){
+
+        TrianglePack & pack = context->trianglePacks[ id / TRIANGLE_PACK_SIZE ];
+        uint32_t lane = id % TRIANGLE_PACK_SIZE;
+
+        pack.type[lane] = INVALID;
+
+        if( id >= numObjects )
+            continue;
+
+        PackObject(id);
+
+        if( context->objects[id].type != TRIANGLE )
+            context->sphereIDs.emplace_back(id);
     }
 
+    context->loggingService.Write(MessageType::INFO, "Packed triangles into %d blocks of %d", numPacks, TRIANGLE_PACK_SIZE);
 }
 
-Vector3 ThreadedShader::RandomDirection(unsigned int& seed){
+void ThreadedShader::PackObject(const uint32_t & id){
 
-    float latitude = acos(2.0f * Random::Rand(seed) - 1.0f) - PI_HALF;
-    float longitude = Random::Rand(seed) * TWO_PI;
+    TrianglePack & pack = context->trianglePacks[ id / TRIANGLE_PACK_SIZE ];
+    uint32_t lane = id % TRIANGLE_PACK_SIZE;
+
+    const Object & object = context->objects[id];
+
+    pack.type[lane] = object.type;
+
+    if( object.type != TRIANGLE )
+        return;
+
+    const Vector3 & A = object.vertices[0];
+
+    Vector3 e1 = object.vertices[1] - A;
+    Vector3 e2 = object.vertices[2] - A;
+
+    pack.vertexX[lane] = A.x;
+    pack.vertexY[lane] = A.y;
+    pack.vertexZ[lane] = A.z;
+
+    pack.firstEdgeX[lane] = e1.x;
+    pack.firstEdgeY[lane] = e1.y;
+    pack.firstEdgeZ[lane] = e1.z;
+
+    pack.secondEdgeX[lane] = e2.x;
+    pack.secondEdgeY[lane] = e2.y;
+    pack.secondEdgeZ[lane] = e2.z;
+}
+
+Vector3 ThreadedShader::RandomDirection(Sampler & sampler){
+
+    float latitude = acos(2.0f * Sampling::Next(sampler) - 1.0f) - PI_HALF;
+    float longitude = Sampling::Next(sampler) * TWO_PI;
 
     float cosLatitude = cosf(latitude);
 
@@ -34,9 +156,9 @@ Vector3 ThreadedShader::RandomDirection(unsigned int& seed){
     };
 }
 
-Vector3 ThreadedShader::DiffuseReflect(const struct Vector3& normal, unsigned int& seed){
+Vector3 ThreadedShader::DiffuseReflect(const struct Vector3& normal, Sampler & sampler){
 
-    Vector3 randomDirection = RandomDirection(seed);
+    Vector3 randomDirection = RandomDirection(sampler);
     float cosDirection = Vector3::DotProduct(normal, randomDirection);
 
     return (randomDirection * cosDirection + normal).Normalize();
@@ -79,7 +201,64 @@ Vector3 ThreadedShader::CalculateWeights(const struct Material & material){
     return weights.Normalize();
 }
 
-Color ThreadedShader::ComputeColor(Ray & ray, const Sample & sample, Color & lightSample, unsigned int& seed, const Vector3 & normal) {
+Color ThreadedShader::SampleLight(const Vector3 & point, const Vector3 & normal, Sampler & sampler){
+
+    uint32_t numLights = context->lights.size();
+    uint32_t lightID = std::min((uint32_t)(Sampling::Next(sampler) * numLights), numLights - 1);
+
+    const Object & light = context->objects[ context->lights[lightID] ];
+    const Material & lightMaterial = context->materials[ light.materialID ];
+
+    Vector3 lightPoint;
+    Vector3 lightNormal;
+    float area;
+
+    if( light.type == TRIANGLE ){
+
+        float u = sqrtf(Sampling::Next(sampler));
+        float v = Sampling::Next(sampler);
+
+        Vector3 e1 = light.vertices[1] - light.vertices[0];
+        Vector3 e2 = light.vertices[2] - light.vertices[0];
+        Vector3 cross = Vector3::CrossProduct(e1, e2);
+
+        lightPoint = light.vertices[0] + e1 * (u * (1.0f - v)) + e2 * (u * v);
+        area = 0.5f * cross.Magnitude();
+        lightNormal = cross * (0.5f / area);
+
+    }else{
+
+        float z = 1.0f - 2.0f * Sampling::Next(sampler);
+        float phi = 2.0f * 3.1415926535f * Sampling::Next(sampler);
+        float r = sqrtf(std::max(0.0f, 1.0f - z * z));
+
+        lightNormal = Vector3(r * cosf(phi), r * sinf(phi), z);
+        lightPoint = light.position + lightNormal * light.radius;
+        area = 4.0f * 3.1415926535f * light.radius * light.radius;
+    }
+
+    Vector3 toLight = lightPoint - point;
+    float distance = toLight.Magnitude();
+
+    Ray shadowRay;
+    shadowRay.origin = point;
+    shadowRay.direction = toLight / distance;
+
+    float cosSurface = Vector3::DotProduct(normal, shadowRay.direction);
+    float cosEmitter = fabs(Vector3::DotProduct(lightNormal, shadowRay.direction));
+
+    if( cosSurface <= 0.0f || cosEmitter <= 0.0f )
+        return {0.0f, 0.0f, 0.0f, 0.0f};
+
+    if( occluded(context, shadowRay, distance * 0.999f) )
+        return {0.0f, 0.0f, 0.0f, 0.0f};
+
+    Color radiance = lightMaterial.albedo * lightMaterial.emmissionIntensity;
+
+    return radiance * (cosSurface * cosEmitter * area * numLights / (distance * distance));
+}
+
+Color ThreadedShader::ComputeColor(Ray & ray, const Sample & sample, Color & lightSample, float & emissionWeight, Sampler & sampler, const Vector3 & normal) {
 
     Object& object = context->objects[sample.objectID];
     Material& material = context->materials[object.materialID];
@@ -89,7 +268,7 @@ Color ThreadedShader::ComputeColor(Ray & ray, const Sample & sample, Color & lig
     Vector3 viewVector = (context->camera.position - sample.point).Normalize();
     Vector3 halfVector = (lightVector + viewVector).Normalize();
 
-    Vector3 diffusionDirection = DiffuseReflect(normal, seed);
+    Vector3 diffusionDirection = DiffuseReflect(normal, sampler);
     Vector3 reflectionDirection = Reflect(ray.direction, normal);
     Vector3 refractionDirecton = Refract(viewVector, normal, INPUT_IOR, material.indexOfRefraction);
 
@@ -105,7 +284,10 @@ Color ThreadedShader::ComputeColor(Ray & ray, const Sample & sample, Color & lig
     Color emission = material.albedo * material.emmissionIntensity;
     float isEmissive = (emission.R + emission.G + emission.B) > 0.0f;
 
-    Color texture = Shading::GetTexturePixel(context->textureData.data(), object, info, sample.point, normal);
+    // Triangles of instanced meshes are stored in mesh space
+    Vector3 localPoint = sample.instanceID < 0 ? sample.point : context->instances[ sample.instanceID ].PointToInstance(sample.point);
+
+    Color texture = Shading::GetTexturePixel(context->textureData.data(), object, info, localPoint, normal);
 
     Color diffuseAlbedo = texture * material.tint * (1.0f - material.metallic);
     Color specularAlbedo = Color::Lerp(material.specular, WHITE, material.metallic);
@@ -119,90 +301,413 @@ Color ThreadedShader::ComputeColor(Ray & ray, const Sample & sample, Color & lig
 
     Vector3 weights = CalculateWeights(material);
 
-    Color colorSample = emission * isEmissive;
+    Color colorSample = emission * (isEmissive * emissionWeight);
     colorSample = colorSample + (diffuseComponent + sheenComponent) * weights.z;
     colorSample = colorSample + clearcoatComponent * weights.w;
     colorSample = colorSample + specularComponent * weights.x;
     colorSample = colorSample + transmissionComponent * weights.y;
     colorSample = colorSample * lightSample * (cosLight > 0.0f);
 
+    // Diffuse share of direct light comes from light sampling, so emission reached by next bounce only counts the rest
+    if( !context->lights.empty() ){
+
+        float diffuseShare = (1.0f - material.metallic) * (1.0f - material.transparency);
+        Color reflectance = texture * material.albedo * (diffuseShare * ONE_OVER_PI);
+
+        colorSample = colorSample + SampleLight(sample.point, normal, sampler) * reflectance * lightSample;
+        emissionWeight = 1.0f - diffuseShare;
+    }
+
     lightSample =  lightSample * texture * material.albedo * 2.0f * cosLight;
 
     return colorSample;
 }
 
-void ThreadedShader::ComputeRows(const int & _startY, const int & _endY, Color * pixels) {
+Ray ThreadedShader::PrimaryRay(const int & x, const int & y, Sampler & sampler){
+
+    Vector3 offset = RandomDirection(sampler);
+    Vector3 pixelPosition = context->camera.CalculatePixelPosition(x + offset.x, y + offset.y, context->width, context->height);
+
+    Ray ray;
+    ray.origin = context->camera.position;
+    ray.direction = (pixelPosition - ray.origin).Normalize();
+
+    return ray;
+}
+
+bool ThreadedShader::ShadeSample(Ray & ray, const Sample & sample, const Vector3 & normal, Color & lightSample, float & emissionWeight, Color & accumulator, Sampler & sampler, const uint32_t & depth){
+
+    if( sample.objectID < 0){
+
+        const Texture & info = context->textureInfo[1];
+
+        float u = ( atan2(ray.direction.x, ray.direction.z) + 3.1415926535f ) * ONE_OVER_PI;
+        float v = acos(-ray.direction.y) * ONE_OVER_PI;
+
+        Color texel = Shading::ColorSample(context->textureData.data(), u, v, info.width, info.height, info.offset);
+
+        accumulator = accumulator + texel * lightSample;
+        return false;
+    }
+
+    Sampling::StartBounce(sampler, depth);
+
+    Color colorSample = ComputeColor(ray, sample, lightSample, emissionWeight, sampler, normal);
+
+    lightSample = Color::Clamp(lightSample);
+    accumulator = Color::Clamp(accumulator + colorSample);
+
+    if( depth + 1 >= context->maxDepth )
+        return false;
+
+    if( depth + 1 < context->minDepth )
+        return true;
+
+    // Russian roulette, path survives with probability of its throughput and is reweighted to stay unbiased
+    float survival = std::min(std::max(lightSample.R, std::max(lightSample.G, lightSample.B)), 1.0f);
+
+    if( Sampling::Next(sampler) >= survival )
+        return false;
+
+    lightSample = lightSample * (1.0f / survival);
+
+    return true;
+}
+
+Color ThreadedShader::TracePath(Ray & ray, const Sample & primarySample, const Vector3 & primaryNormal, Sampler & sampler){
+
+    Color accumulator = {0.0f, 0.0f, 0.0f, 0.0f};
+    Color lightSample = WHITE;
+    float emissionWeight = 1.0f;
+
+    Sample sample = primarySample;
+    Vector3 normal = primaryNormal;
+
+    for(uint32_t depth = 0; depth < context->maxDepth; ++depth){
+
+        if( depth > 0 )
+            sample = traverse(context, ray, normal);
+
+        if( !ShadeSample(ray, sample, normal, lightSample, emissionWeight, accumulator, sampler, depth) )
+            break;
+    }
+
+    return accumulator;
+}
+
+void ThreadedShader::AccumulateSample(Color * pixels, const uint32_t & index, const Color & colorSample){
+
+    PixelStatistics & pixel = statistics[index];
+
+    pixel.numSamples++;
+    pixels[index] = Color::Lerp(pixels[index], colorSample, 1.0f / pixel.numSamples);
+
+    if( context->convergenceThreshold <= 0.0f )
+        return;
 
-    int32_t numElements = _endY - _startY;
+    float luminance = 0.2126f * colorSample.R + 0.7152f * colorSample.G + 0.0722f * colorSample.B;
+    float delta = luminance - pixel.mean;
 
-    for (int y = _startY; y < _endY; ++y) {
-        for (int x = 0; x < context->width; ++x) {
+    pixel.mean += delta / pixel.numSamples;
+    pixel.deviation += delta * (luminance - pixel.mean);
+
+    if( pixel.numSamples < CONVERGENCE_MIN_SAMPLES )
+        return;
+
+    float error = sqrtf(pixel.deviation / ((pixel.numSamples - 1.0f) * pixel.numSamples));
+
+    pixel.converged = error <= context->convergenceThreshold * std::max(pixel.mean, CONVERGENCE_FLOOR);
+}
+
+void ThreadedShader::ComputeTile(const Tile & tile, Color * pixels) {
+
+    for (int y = tile.startY; y < tile.endY; ++y) {
+        for (int x = tile.startX; x < tile.endX; ++x) {
 
             unsigned int index = y * context->width + x;
-            unsigned int seed = (context->frameCounter<<16) ^ (context->frameCounter >>13) + index;
 
-            Vector3 offset = RandomDirection(seed);
-            Vector3 pixelPosition = context->camera.CalculatePixelPosition(x + offset.x, y + offset.y, context->width, context->height);
+            if( statistics[index].converged )
+                continue;
+
+            Sampler sampler = Sampling::Create(context->samplerType, index, context->frameCounter);
+
+            Ray ray = PrimaryRay(x, y, sampler);
 
-            Ray ray;
-            ray.origin = context->camera.position;
-            ray.direction = (pixelPosition - ray.origin).Normalize();
+            Vector3 normal;
+            Sample sample = traverse(context, ray, normal);
 
-            Color accumulator = {0.0f, 0.0f, 0.0f, 0.0f};
-            Color lightSample = WHITE;
+            Color accumulator = TracePath(ray, sample, normal, sampler);
 
-            #pragma unroll
-            for(int iter = 0 ; iter < 4; iter++){
+            AccumulateSample(pixels, index, accumulator);
 
-                Vector3 normal;
-                Sample sample = traverse(context, ray, normal);
+        }
+    }
+}
+
+void ThreadedShader::ComputePacketTile(const Tile & tile, Color * pixels) {
 
-                if( sample.objectID < 0){
+    RayPacket packet;
+    Ray rays[PACKET_SIZE];
+    Sample samples[PACKET_SIZE];
+    Vector3 normals[PACKET_SIZE];
+    Sampler samplers[PACKET_SIZE];
+    unsigned int indices[PACKET_SIZE];
 
-                    const Texture & info = context->textureInfo[1];
+    for (int blockY = tile.startY; blockY < tile.endY; blockY += PACKET_HEIGHT) {
+        for (int blockX = tile.startX; blockX < tile.endX; blockX += PACKET_WIDTH) {
 
-                    float u = ( atan2(ray.direction.x, ray.direction.z) + 3.1415926535f ) * ONE_OVER_PI;
-                    float v = acos(-ray.direction.y) * ONE_OVER_PI;
+            int32_t mask = 0;
 
-                    Color texel = Shading::ColorSample(context->textureData.data(), u, v, info.width, info.height, info.offset);
+            for(int lane = 0; lane < PACKET_SIZE; ++lane){
 
-                    accumulator = accumulator + texel * lightSample;
-                    break;
+                int x = blockX + lane % PACKET_WIDTH;
+                int y = blockY + lane / PACKET_WIDTH;
+
+                if( x >= tile.endX || y >= tile.endY || statistics[y * context->width + x].converged ){
+                    packet.directionX[lane] = packet.directionY[lane] = packet.directionZ[lane] = 1.0f;
+                    packet.inverseX[lane] = packet.inverseY[lane] = packet.inverseZ[lane] = 1.0f;
+                    packet.originX[lane] = packet.originY[lane] = packet.originZ[lane] = 0.0f;
+                    continue;
                 }
 
-                Color colorSample = ComputeColor(ray, sample, lightSample, seed, normal);
+                indices[lane] = y * context->width + x;
+                samplers[lane] = Sampling::Create(context->samplerType, indices[lane], context->frameCounter);
+
+                Ray & ray = rays[lane];
+                ray = PrimaryRay(x, y, samplers[lane]);
+
+                packet.originX[lane] = ray.origin.x;
+                packet.originY[lane] = ray.origin.y;
+                packet.originZ[lane] = ray.origin.z;
+
+                packet.directionX[lane] = ray.direction.x;
+                packet.directionY[lane] = ray.direction.y;
+                packet.directionZ[lane] = ray.direction.z;
+
+                Vector3 inverseDirection = InverseDirection(ray.direction);
+
+                packet.inverseX[lane] = inverseDirection.x;
+                packet.inverseY[lane] = inverseDirection.y;
+                packet.inverseZ[lane] = inverseDirection.z;
+
+                mask |= 1 << lane;
+            }
+
+            if( mask == 0 )
+                continue;
+
+            TracePacket(context, packet, mask, samples, normals);
+
+            for(int lane = 0; lane < PACKET_SIZE; ++lane){
+
+                if( (mask & (1 << lane)) == 0 )
+                    continue;
 
-                lightSample = Color::Clamp(lightSample);
-                accumulator = Color::Clamp(accumulator + colorSample);
+                unsigned int index = indices[lane];
+
+                Color accumulator = TracePath(rays[lane], samples[lane], normals[lane], samplers[lane]);
+
+                AccumulateSample(pixels, index, accumulator);
             }
 
-            float scale = 1.0f / (context->frameCounter + 1);
-            pixels[index] =  Color::Lerp(pixels[index], accumulator, scale);
+        }
+    }
+}
+
+bool ThreadedShader::PopTile(const uint32_t & threadID, uint32_t & tileID){
+
+    TileQueue & queue = queues[threadID];
+    std::lock_guard<std::mutex> guard(queue.lock);
+
+    if( queue.tiles.empty() )
+        return false;
+
+    tileID = queue.tiles.front();
+    queue.tiles.pop_front();
+
+    return true;
+}
+
+bool ThreadedShader::StealTile(const uint32_t & threadID, uint32_t & tileID){
+
+    for(uint32_t offset = 1; offset < numThreads; ++offset){
+
+        TileQueue & victim = queues[ (threadID + offset) % numThreads ];
+        std::lock_guard<std::mutex> guard(victim.lock);
+
+        if( victim.tiles.empty() )
+            continue;
+
+        tileID = victim.tiles.back();
+        victim.tiles.pop_back();
 
+        return true;
+    }
+
+    return false;
+}
+
+void ThreadedShader::ComputeTiles(const uint32_t & threadID, Color * pixels){
+
+    uint32_t tileID;
+
+    while( PopTile(threadID, tileID) || StealTile(threadID, tileID) ){
+
+        if( usePackets ){
+            ComputePacketTile(tiles[tileID], pixels);
+        }else{
+            ComputeTile(tiles[tileID], pixels);
         }
+
     }
+
 }
 
-void ThreadedShader::Render(Color * _pixels){
+void ThreadedShader::ForEachBatch(const uint32_t & count, const Batch & batch){
+
+    std::atomic<uint32_t> nextBatch(0);
+
+    pool->Dispatch([&nextBatch, &count, &batch](const uint32_t & threadID){
+
+        uint32_t begin;
+
+        while( (begin = nextBatch.fetch_add(WAVEFRONT_BATCH)) < count )
+            batch(begin, std::min(begin + WAVEFRONT_BATCH, count));
+
+    });
 
-    int32_t start;
-    int32_t end;
+}
+
+void ThreadedShader::RenderWavefront(Color * _pixels){
+
+    uint32_t numPixels = context->width * context->height;
+
+    PathStates & paths = *states;
+
+    paths.numSurviving = 0;
+
+    ForEachBatch(numPixels, [this, &paths](const uint32_t & begin, const uint32_t & end){
+
+        uint32_t generated[WAVEFRONT_BATCH];
+        uint32_t numGenerated = 0;
+
+        for(uint32_t index = begin; index < end; ++index){
+
+            if( statistics[index].converged )
+                continue;
+
+            int x = index % context->width;
+            int y = index / context->width;
+
+            paths.samplers[index] = Sampling::Create(context->samplerType, index, context->frameCounter);
+            paths.rays[index] = PrimaryRay(x, y, paths.samplers[index]);
+            paths.lightSamples[index] = WHITE;
+            paths.accumulators[index] = {0.0f, 0.0f, 0.0f, 0.0f};
+            paths.emissionWeights[index] = 1.0f;
+            generated[numGenerated++] = index;
+        }
+
+        uint32_t offset = paths.numSurviving.fetch_add(numGenerated);
+        std::copy(generated, generated + numGenerated, paths.activePaths.begin() + offset);
+
+    });
+
+    uint32_t numActive = paths.numSurviving;
+
+    for(uint32_t depth = 0; depth < context->maxDepth && numActive > 0; ++depth){
 
-    for (int i = 0; i < numThreads; ++i) {
+        ForEachBatch(numActive, [this, &paths](const uint32_t & begin, const uint32_t & end){
 
-        start = i * rowsPerThread;
-        end =  (i == numThreads-1 ) ? context->height : start + rowsPerThread;
+            for(uint32_t id = begin; id < end; ++id){
+                uint32_t index = paths.activePaths[id];
+                paths.samples[index] = traverse(context, paths.rays[index], paths.normals[index]);
+            }
+
+        });
+
+        paths.numSurviving = 0;
+
+        ForEachBatch(numActive, [this, &paths, depth](const uint32_t & begin, const uint32_t & end){
+
+            uint32_t survivors[WAVEFRONT_BATCH];
+            uint32_t numSurvivors = 0;
+
+            for(uint32_t id = begin; id < end; ++id){
+
+                uint32_t index = paths.activePaths[id];
+
+                bool alive = ShadeSample(
+                    paths.rays[index],
+                    paths.samples[index],
+                    paths.normals[index],
+                    paths.lightSamples[index],
+                    paths.emissionWeights[index],
+                    paths.accumulators[index],
+                    paths.samplers[index],
+                    depth
+                );
 
-        threads[i] = std::thread(
-            [this, start, end, _pixels](){
-                this->ComputeRows(start, end, _pixels);
+                if( alive )
+                    survivors[numSurvivors++] = index;
             }
-        );
+
+            uint32_t offset = paths.numSurviving.fetch_add(numSurvivors);
+            std::copy(survivors, survivors + numSurvivors, paths.survivingPaths.begin() + offset);
+
+        });
+
+        std::swap(paths.activePaths, paths.survivingPaths);
+        numActive = paths.numSurviving;
+    }
+
+    ForEachBatch(numPixels, [this, &paths, _pixels](const uint32_t & begin, const uint32_t & end){
+
+        for(uint32_t index = begin; index < end; ++index){
+
+            if( statistics[index].converged )
+                continue;
+
+            AccumulateSample(_pixels, index, paths.accumulators[index]);
+        }
+
+    });
+
+}
+
+void ThreadedShader::Render(Color * _pixels){
+
+    // Refitted nodes are read in place, only packed copies of moved objects need update
+    for(const int32_t & objectID : context->changedObjects)
+        PackObject(objectID);
+
+    context->changedObjects.clear();
+    context->changedNodes.clear();
+    context->changedQuantizedNodes.clear();
+
+    if( context->frameCounter == 0 )
+        std::fill(statistics.begin(), statistics.end(), PixelStatistics{});
+
+    if( states != NULL ){
+        RenderWavefront(_pixels);
+        return;
+    }
+
+
+    uint32_t tilesPerThread = tiles.size() / numThreads;
+
+    for(uint32_t threadID = 0; threadID < numThreads; ++threadID){
+
+        uint32_t start = threadID * tilesPerThread;
+        uint32_t end = (threadID == numThreads-1 ) ? tiles.size() : start + tilesPerThread;
+
+        for(uint32_t tileID = start; tileID < end; ++tileID)
+            queues[threadID].tiles.push_back(tileID);
 
     }
 
-    for (int i = 0; i < numThreads; ++i)
-        threads[i].join();
+    pool->Dispatch([this, _pixels](const uint32_t & threadID){
+        this->ComputeTiles(threadID, _pixels);
+    });
 
 }
 
@@ -210,27 +715,45 @@ Sample ThreadedShader::LinearTraverse(RenderingContext * context, const Ray & ra
 
     struct Sample sample = {};
     sample.objectID = -1;
+    sample.instanceID = -1;
     float minLength = INFINITY;
     float length = -1.0f;
-    float u,v;
 
     Vector3 scaledDir = ray.direction * EPSILON;
 
-    for (int id = 0; id < context->objects.size(); ++id) {
+    alignas(32) float lengths[TRIANGLE_PACK_SIZE];
 
-        struct Object object = context->objects[id];
+    for (int packID = 0; packID < context->trianglePacks.size(); ++packID) {
+
+        IntersectTrianglePack(ray, context->trianglePacks[packID], lengths);
+
+        for (int lane = 0; lane < TRIANGLE_PACK_SIZE; ++lane) {
+
+            length = lengths[lane];
+
+            if( (length < minLength) && (length > 0.01f) ){
+
+                minLength = length ;
+                sample.point = ray.origin + scaledDir * length ;
+                sample.objectID = packID * TRIANGLE_PACK_SIZE + lane;
+
+            }
 
-        if ( object.type == TRIANGLE ){
-            length = IntersectTriangle(ray, object, u, v);
-        }else{
-            length = IntersectSphere(ray, object);
         }
 
+    }
+
+    for (int id = 0; id < context->sphereIDs.size(); ++id) {
+
+        int32_t objectID = context->sphereIDs[id];
+
+        length = IntersectSphere(ray, context->objects[objectID]);
+
         if( (length < minLength) && (length > 0.01f) ){
 
             minLength = length ;
             sample.point = ray.origin + scaledDir * length ;
-            sample.objectID = id;
+            sample.objectID = objectID;
 
         }
 
@@ -239,7 +762,28 @@ Sample ThreadedShader::LinearTraverse(RenderingContext * context, const Ray & ra
     if( sample.objectID == -1 )
         return sample;
 
-    struct Object object = context->objects[ sample.objectID ];
+    CalculateNormal(context, sample, normal);
+
+    return sample;
+}
+
+void ThreadedShader::CalculateNormal(RenderingContext * context, const Sample & sample, Vector3 & normal){
+
+    if( sample.instanceID >= 0 ){
+
+        const Instance & instance = context->instances[ sample.instanceID ];
+
+        Sample localSample = sample;
+        localSample.point = instance.PointToInstance(sample.point);
+        localSample.instanceID = -1;
+
+        CalculateNormal(context, localSample, normal);
+
+        normal = instance.NormalToWorld(normal).Normalize();
+        return;
+    }
+
+    struct Object & object = context->objects[ sample.objectID ];
 
     if ( object.type == SPHERE){
 
@@ -268,56 +812,39 @@ Sample ThreadedShader::LinearTraverse(RenderingContext * context, const Ray & ra
 
         normal = (object.normals[0] * w + object.normals[1] * u + object.normals[2] * v).Normalize();
     }
-
-    return sample;
 }
 
-bool ThreadedShader::AABBIntersection(const Ray & ray, const Vector3 & minimalPosition , const Vector3 & maximalPosition){
-
-    Vector3 invDirection = Vector3(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f/ ray.direction.z);
+Vector3 ThreadedShader::InverseDirection(const Vector3 & direction){
 
-    Vector3 tMin = (minimalPosition - ray.origin) * invDirection;
-    Vector3 tMax = (maximalPosition - ray.origin) * invDirection;
+    Vector3 inverse;
 
-    Vector3 t1 = Vector3::Minimal(tMin, tMax);
-    Vector3 t2 = Vector3::Maximal(tMin, tMax);
+    inverse.x = 1.0f / ( fabs(direction.x) > RECIPROCAL_EPSILON ? direction.x : copysignf(RECIPROCAL_EPSILON, direction.x) );
+    inverse.y = 1.0f / ( fabs(direction.y) > RECIPROCAL_EPSILON ? direction.y : copysignf(RECIPROCAL_EPSILON, direction.y) );
+    inverse.z = 1.0f / ( fabs(direction.z) > RECIPROCAL_EPSILON ? direction.z : copysignf(RECIPROCAL_EPSILON, direction.z) );
 
-    float tNear = fmax(t1.x, fmax(t1.y, t1.z));
-    float tFar = fmin(t2.x, fmin(t2.y, t2.z));
-
-    return tNear <= tFar && tFar > 0.0f;
+    return inverse;
 }
 
-float ThreadedShader::IntersectTriangle(const Ray & ray, const Object & object, float & u, float & v){
-    const float epsilon = 1e-6f;
-
-    const Vector3 & A = object.vertices[0];
-    const Vector3 & B = object.vertices[1];
-    const Vector3 & C = object.vertices[2];
-
-    Vector3 e1 = (B - A);
-    Vector3 e2 = (C - A);
-
-    Vector3 normal = Vector3::CrossProduct(ray.direction, e2);
-    float det = Vector3::DotProduct(e1, normal);
+float ThreadedShader::AABBIntersection(const Ray & ray, const Vector3 & inverseDirection, const int32_t * octant, const BVHNode & node){
 
-    if( fabs(det) < epsilon)
-        return -1.0f;
+    // Maximal position lies four floats after minimal one
+    const float * bounds = node.minimalPosition;
 
-    float f = 1.0f/det;
-    Vector3 rayToTriangle = ray.origin - A;
-    u = f * Vector3::DotProduct(rayToTriangle, normal);
+    float nearX = (bounds[ octant[0] * 4 ] - ray.origin.x) * inverseDirection.x;
+    float nearY = (bounds[ octant[1] * 4 + 1 ] - ray.origin.y) * inverseDirection.y;
+    float nearZ = (bounds[ octant[2] * 4 + 2 ] - ray.origin.z) * inverseDirection.z;
 
-    if( u < 0.0f || u >1.0f)
-        return -1.0f;
+    float farX = (bounds[ (1 - octant[0]) * 4 ] - ray.origin.x) * inverseDirection.x;
+    float farY = (bounds[ (1 - octant[1]) * 4 + 1 ] - ray.origin.y) * inverseDirection.y;
+    float farZ = (bounds[ (1 - octant[2]) * 4 + 2 ] - ray.origin.z) * inverseDirection.z;
 
-    Vector3 q = Vector3::CrossProduct(rayToTriangle, e1);
-    v = f * Vector3::DotProduct(ray.direction, q);
+    float tNear = fmax(nearX, fmax(nearY, nearZ));
+    float tFar = fmin(farX, fmin(farY, farZ));
 
-    if( v < 0.0f || (u+v) > 1.0f)
-        return -1.0f;
+    if( tNear > tFar || tFar <= 0.0f )
+        return INFINITY;
 
-    return f * Vector3::DotProduct(e2, q);
+    return tNear;
 }
 
 float ThreadedShader::IntersectSphere(const Ray &ray, const Object &object) {
@@ -334,102 +861,822 @@ float ThreadedShader::IntersectSphere(const Ray &ray, const Object &object) {
     return fmin(t1, t2);
 }
 
-Sample ThreadedShader::BVHTraverse(RenderingContext * context, const Ray & ray, Vector3 & normal){
+// Stacks are sized by BVHTree for current trees, unbalanced ones outgrow any fixed size.
+// Every thread keeps its own storage, grown only when deeper tree is built.
+template<typename Entry>
+static Entry * ReserveStack(std::vector<Entry> & storage, const int32_t & size){
 
-    struct Sample sample = {};
+    if( storage.size() < (size_t)size )
+        storage.resize(size);
+
+    return storage.data();
+}
+
+Sample ThreadedShader::BVHTraverse(RenderingContext * context, const Ray & ray, Vector3 & normal){
+
+    struct Sample sample = {};
     sample.objectID = -1;
+    sample.instanceID = -1;
     float minLength = INFINITY;
-    float length = -1.0f;
-    float u, v;
 
-    int stack[STACK_SIZE] = {};
+    Vector3 inverseDirection = InverseDirection(ray.direction);
+
+    int32_t octant[3] = {
+        ray.direction.x < 0.0f,
+        ray.direction.y < 0.0f,
+        ray.direction.z < 0.0f
+    };
+
+    thread_local std::vector<int> stackStorage;
+    thread_local std::vector<float> entryStorage;
+
+    int * stack = ReserveStack(stackStorage, context->stackSize);
+    float * entries = ReserveStack(entryStorage, context->stackSize);
     int size = 0;
 
+    stack[size] = 0;
+    entries[size++] = 0.0f;
+
+    while ( size > 0 )  {
+
+        --size;
+
+        if( entries[size] >= minLength )
+            continue;
+
+        int nodeID = stack[size];
+
+        const BVHNode & node = context->nodes[ nodeID ];
+
+        if ( node.primitiveCount > 0 ) {
+
+            int32_t instanceID = -1;
+            int32_t objectID = IntersectLeaf(context, ray, node.offset, node.primitiveCount, minLength, instanceID);
+
+            if( objectID != -1 ){
+                sample.point = ray.origin + ray.direction * minLength;
+                sample.objectID = objectID;
+                sample.instanceID = instanceID;
+            }
+
+            continue;
+        }
+
+        int nearID = nodeID + 1;
+        int farID = node.offset;
+
+        float nearEntry = AABBIntersection(ray, inverseDirection, octant, context->nodes[nearID]);
+        float farEntry = AABBIntersection(ray, inverseDirection, octant, context->nodes[farID]);
+
+        if( farEntry < nearEntry ){
+            std::swap(nearID, farID);
+            std::swap(nearEntry, farEntry);
+        }
+
+        if( farEntry < minLength ){
+            stack[size] = farID;
+            entries[size++] = farEntry;
+        }
+
+        if( nearEntry < minLength ){
+            stack[size] = nearID;
+            entries[size++] = nearEntry;
+        }
+
+    }
+
+    if( sample.objectID  < 0 )
+        return sample;
+
+    CalculateNormal(context, sample, normal);
+
+    return sample;
+}
+
+bool ThreadedShader::LinearOcclusion(RenderingContext * context, const Ray & ray, const float & maxLength){
+
+    alignas(32) float lengths[TRIANGLE_PACK_SIZE];
+
+    for (int packID = 0; packID < context->trianglePacks.size(); ++packID) {
+
+        IntersectTrianglePack(ray, context->trianglePacks[packID], lengths);
+
+        for (int lane = 0; lane < TRIANGLE_PACK_SIZE; ++lane) {
+            if( (lengths[lane] < maxLength) && (lengths[lane] > 0.01f) )
+                return true;
+        }
+
+    }
+
+    for (int id = 0; id < context->sphereIDs.size(); ++id) {
+
+        float length = IntersectSphere(ray, context->objects[ context->sphereIDs[id] ]);
+
+        if( (length < maxLength) && (length > 0.01f) )
+            return true;
+    }
+
+    return false;
+}
+
+bool ThreadedShader::BVHOcclusion(RenderingContext * context, const Ray & ray, const float & maxLength){
+
+    Vector3 inverseDirection = InverseDirection(ray.direction);
+
+    int32_t octant[3] = {
+        ray.direction.x < 0.0f,
+        ray.direction.y < 0.0f,
+        ray.direction.z < 0.0f
+    };
+
+    thread_local std::vector<int> stackStorage;
+
+    int * stack = ReserveStack(stackStorage, context->stackSize);
+    int size = 0;
 
     stack[size++] = 0;
 
     while ( size > 0 )  {
 
-        int boxID = stack[--size];
+        int nodeID = stack[--size];
 
-        BoundingBox box = context->boxes[ boxID ];
+        const BVHNode & node = context->nodes[ nodeID ];
 
-        int leftChildIndex = box.leftID;
-        int rightChildIndex = box.rightID;
+        if ( node.primitiveCount > 0 ) {
 
-        if ( box.objectID != -1 ) {
+            float length = maxLength;
+            int32_t instanceID = -1;
 
-            Object object = context->objects[ box.objectID ];
+            if( IntersectLeaf(context, ray, node.offset, node.primitiveCount, length, instanceID) != -1 )
+                return true;
 
-            if ( object.type == TRIANGLE ){
-                length = IntersectTriangle(ray, object, u, v);
-            }else{
-                length = IntersectSphere(ray, object);
+            continue;
+        }
+
+        // Any hit ends traversal, so children are pushed without ordering
+        if( AABBIntersection(ray, inverseDirection, octant, context->nodes[nodeID + 1]) < maxLength )
+            stack[size++] = nodeID + 1;
+
+        if( AABBIntersection(ray, inverseDirection, octant, context->nodes[node.offset]) < maxLength )
+            stack[size++] = node.offset;
+
+    }
+
+    return false;
+}
+
+int32_t ThreadedShader::WideNodeIntersection(const Lanes * origin, const Lanes * inverse, const int32_t * octant, const WideNode & node, const float & maxLength, float * entries){
+
+    const float * bounds[2][3] = {
+        {node.minimalX, node.minimalY, node.minimalZ},
+        {node.maximalX, node.maximalY, node.maximalZ}
+    };
+
+    Lanes nearX = Packet::Mul(Packet::Sub(Packet::Load(bounds[ octant[0] ][0]), origin[0]), inverse[0]);
+    Lanes nearY = Packet::Mul(Packet::Sub(Packet::Load(bounds[ octant[1] ][1]), origin[1]), inverse[1]);
+    Lanes nearZ = Packet::Mul(Packet::Sub(Packet::Load(bounds[ octant[2] ][2]), origin[2]), inverse[2]);
+
+    Lanes farX = Packet::Mul(Packet::Sub(Packet::Load(bounds[ 1 - octant[0] ][0]), origin[0]), inverse[0]);
+    Lanes farY = Packet::Mul(Packet::Sub(Packet::Load(bounds[ 1 - octant[1] ][1]), origin[1]), inverse[1]);
+    Lanes farZ = Packet::Mul(Packet::Sub(Packet::Load(bounds[ 1 - octant[2] ][2]), origin[2]), inverse[2]);
+
+    Lanes tNear = Packet::Max(nearX, Packet::Max(nearY, nearZ));
+    Lanes tFar = Packet::Min(farX, Packet::Min(farY, farZ));
+
+    Lanes hit = Packet::And(Packet::LessEqual(tNear, tFar), Packet::Less(Packet::Set(0.0f), tFar));
+    hit = Packet::And(hit, Packet::Less(tNear, Packet::Set(maxLength)));
+
+    Packet::Store(entries, tNear);
+
+    return Packet::Mask(hit);
+}
+
+int32_t ThreadedShader::WideNodeIntersection(const Lanes * origin, const Lanes * inverse, const int32_t * octant, const QuantizedNode & node, const float & maxLength, float * entries){
+
+    const uint8_t (* bounds[2])[QUANTIZED_NODE_WIDTH] = {node.minimal, node.maximal};
+
+    // Plane at grid offset q is entered at (origin - rayOrigin) * inverse + q * step * inverse
+    Lanes offsets[3];
+    Lanes steps[3];
+
+    for(int32_t axis = 0; axis < 3; ++axis){
+        offsets[axis] = Packet::Mul(Packet::Sub(Packet::Set(node.origin[axis]), origin[axis]), inverse[axis]);
+        steps[axis] = Packet::Mul(Packet::Set(QuantizedNode::Scale(node.exponents[axis])), inverse[axis]);
+    }
+
+    int32_t mask = 0;
+
+    for(int32_t first = 0; first < node.numChildren; first += PACKET_SIZE){
+
+        Lanes nearX = Packet::Add(offsets[0], Packet::Mul(Packet::LoadBytes(bounds[ octant[0] ][0] + first), steps[0]));
+        Lanes nearY = Packet::Add(offsets[1], Packet::Mul(Packet::LoadBytes(bounds[ octant[1] ][1] + first), steps[1]));
+        Lanes nearZ = Packet::Add(offsets[2], Packet::Mul(Packet::LoadBytes(bounds[ octant[2] ][2] + first), steps[2]));
+
+        Lanes farX = Packet::Add(offsets[0], Packet::Mul(Packet::LoadBytes(bounds[ 1 - octant[0] ][0] + first), steps[0]));
+        Lanes farY = Packet::Add(offsets[1], Packet::Mul(Packet::LoadBytes(bounds[ 1 - octant[1] ][1] + first), steps[1]));
+        Lanes farZ = Packet::Add(offsets[2], Packet::Mul(Packet::LoadBytes(bounds[ 1 - octant[2] ][2] + first), steps[2]));
+
+        Lanes tNear = Packet::Max(nearX, Packet::Max(nearY, nearZ));
+        Lanes tFar = Packet::Min(farX, Packet::Min(farY, farZ));
+
+        Lanes hit = Packet::And(Packet::LessEqual(tNear, tFar), Packet::Less(Packet::Set(0.0f), tFar));
+        hit = Packet::And(hit, Packet::Less(tNear, Packet::Set(maxLength)));
+
+        Packet::Store(entries + first, tNear);
+
+        mask |= Packet::Mask(hit) << first;
+    }
+
+    return mask;
+}
+
+template<>
+const std::vector<WideNode> & ThreadedShader::GetWideNodes<WideNode>(RenderingContext * context){
+    return context->wideNodes;
+}
+
+template<>
+const std::vector<QuantizedNode> & ThreadedShader::GetWideNodes<QuantizedNode>(RenderingContext * context){
+    return context->quantizedNodes;
+}
+
+template<typename Node>
+Sample ThreadedShader::WideTraverse(RenderingContext * context, const Ray & ray, Vector3 & normal){
+
+    struct Sample sample = {};
+    sample.objectID = -1;
+    sample.instanceID = -1;
+    float minLength = INFINITY;
+
+    Vector3 inverseDirection = InverseDirection(ray.direction);
+
+    int32_t octant[3] = {
+        ray.direction.x < 0.0f,
+        ray.direction.y < 0.0f,
+        ray.direction.z < 0.0f
+    };
+
+    Lanes origin[3] = {Packet::Set(ray.origin.x), Packet::Set(ray.origin.y), Packet::Set(ray.origin.z)};
+    Lanes inverse[3] = {Packet::Set(inverseDirection.x), Packet::Set(inverseDirection.y), Packet::Set(inverseDirection.z)};
+
+    // Large enough for children of both node types
+    alignas(32) float entries[QUANTIZED_NODE_WIDTH];
+
+    thread_local std::vector<WideEntry> stackStorage;
+
+    WideEntry * stack = ReserveStack(stackStorage, context->wideStackSize);
+    int size = 0;
+
+    stack[size++] = {0, 0, 0.0f};
+
+    while ( size > 0 ) {
+
+        WideEntry current = stack[--size];
+
+        if( current.entry >= minLength )
+            continue;
+
+        if( current.primitiveCount > 0 ){
+
+            int32_t instanceID = -1;
+            int32_t objectID = IntersectLeaf(context, ray, current.index, current.primitiveCount, minLength, instanceID);
+
+            if( objectID != -1 ){
+                sample.point = ray.origin + ray.direction * minLength;
+                sample.objectID = objectID;
+                sample.instanceID = instanceID;
             }
 
-            if( (length < minLength) && (length > 0.01f) ){
+            continue;
+        }
 
-                minLength = length ;
-                sample.point = ray.origin + ray.direction * length ;
-                sample.objectID = box.objectID;
+        const Node & node = GetWideNodes<Node>(context)[ current.index ];
+
+        int32_t mask = WideNodeIntersection(origin, inverse, octant, node, minLength, entries);
+        int first = size;
+
+        // Entered children are kept sorted, so the nearest one is visited first
+        while( mask ){
+
+            int32_t slot = __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            WideEntry child = {node.children[slot], node.primitiveCounts[slot], entries[slot]};
+            int position = size++;
 
+            while( position > first && stack[position - 1].entry < child.entry ){
+                stack[position] = stack[position - 1];
+                --position;
             }
 
-        } else {
+            stack[position] = child;
+        }
+
+    }
+
+    if( sample.objectID < 0 )
+        return sample;
 
-            if( leftChildIndex != -1 ){
-                BoundingBox & left = context->boxes[leftChildIndex];
+    CalculateNormal(context, sample, normal);
+
+    return sample;
+}
+
+template<typename Node>
+bool ThreadedShader::WideOcclusion(RenderingContext * context, const Ray & ray, const float & maxLength){
+
+    Vector3 inverseDirection = InverseDirection(ray.direction);
+
+    int32_t octant[3] = {
+        ray.direction.x < 0.0f,
+        ray.direction.y < 0.0f,
+        ray.direction.z < 0.0f
+    };
+
+    Lanes origin[3] = {Packet::Set(ray.origin.x), Packet::Set(ray.origin.y), Packet::Set(ray.origin.z)};
+    Lanes inverse[3] = {Packet::Set(inverseDirection.x), Packet::Set(inverseDirection.y), Packet::Set(inverseDirection.z)};
+
+    alignas(32) float entries[QUANTIZED_NODE_WIDTH];
+
+    thread_local std::vector<WideEntry> stackStorage;
+
+    WideEntry * stack = ReserveStack(stackStorage, context->wideStackSize);
+    int size = 0;
+
+    stack[size++] = {0, 0, 0.0f};
+
+    while ( size > 0 ) {
+
+        WideEntry current = stack[--size];
+
+        if( current.primitiveCount > 0 ){
+
+            float length = maxLength;
+            int32_t instanceID = -1;
+
+            if( IntersectLeaf(context, ray, current.index, current.primitiveCount, length, instanceID) != -1 )
+                return true;
+
+            continue;
+        }
+
+        const Node & node = GetWideNodes<Node>(context)[ current.index ];
+
+        int32_t mask = WideNodeIntersection(origin, inverse, octant, node, maxLength, entries);
+
+        // Any hit ends traversal, so children are pushed without ordering
+        while( mask ){
+
+            int32_t slot = __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            stack[size++] = {node.children[slot], node.primitiveCounts[slot], entries[slot]};
+        }
+
+    }
+
+    return false;
+}
+
+int32_t ThreadedShader::IntersectLeaf(RenderingContext * context, const Ray & ray, const int32_t & first, const int32_t & count, float & minLength, int32_t & instanceID){
+
+    alignas(32) float lengths[TRIANGLE_PACK_SIZE];
+
+    int32_t last = first + count;
+    int32_t hitID = -1;
+
+    // Packs overlapping the leaf are intersected whole when more than one of their lanes belongs to it
+    for(int32_t packStart = first - first % TRIANGLE_PACK_SIZE; packStart < last; packStart += TRIANGLE_PACK_SIZE){
+
+        const TrianglePack & pack = context->trianglePacks[ packStart / TRIANGLE_PACK_SIZE ];
+
+        int32_t begin = std::max(first, packStart);
+        int32_t end = std::min(last, packStart + TRIANGLE_PACK_SIZE);
+
+        if( end - begin > 1 )
+            IntersectTrianglePack(ray, pack, lengths);
+
+        for(int32_t objectID = begin; objectID < end; ++objectID){
+
+            uint32_t lane = objectID - packStart;
+            float length;
+
+            if( pack.type[lane] == INSTANCE ){
+
+                int32_t meshObjectID = IntersectInstance(context, ray, context->objects[objectID].instanceID, minLength);
+
+                if( meshObjectID != -1 ){
+                    hitID = meshObjectID;
+                    instanceID = context->objects[objectID].instanceID;
+                }
 
-                if( AABBIntersection(ray, left.minimalPosition, left.maximalPosition) )
-                    stack[size++] = leftChildIndex;
+                continue;
             }
 
-            if( rightChildIndex != -1 ){
-                BoundingBox & right = context->boxes[rightChildIndex];
+            if( pack.type[lane] != TRIANGLE ){
+                length = IntersectSphere(ray, context->objects[objectID]);
+            }else if( end - begin > 1 ){
+                length = lengths[lane];
+            }else{
+                length = IntersectPackedTriangle(ray, pack, lane);
+            }
 
-                if( AABBIntersection(ray, right.minimalPosition, right.maximalPosition) )
-                    stack[size++] = rightChildIndex;
+            if( (length < minLength) && (length > 0.01f) ){
+                minLength = length;
+                hitID = objectID;
+                instanceID = -1;
             }
+        }
+    }
+
+    return hitID;
+}
+
+int32_t ThreadedShader::IntersectInstance(RenderingContext * context, const Ray & ray, const int32_t & instanceID, float & minLength){
+
+    const Instance & instance = context->instances[ instanceID ];
+
+    // Local direction is left unnormalized, so hit lengths stay comparable with world ones
+    Ray localRay;
+    localRay.origin = instance.PointToInstance(ray.origin);
+    localRay.direction = instance.DirectionToInstance(ray.direction);
+
+    Vector3 inverseDirection = InverseDirection(localRay.direction);
+
+    int32_t octant[3] = {
+        localRay.direction.x < 0.0f,
+        localRay.direction.y < 0.0f,
+        localRay.direction.z < 0.0f
+    };
+
+    thread_local std::vector<int> stackStorage;
+    thread_local std::vector<float> entryStorage;
+
+    int * stack = ReserveStack(stackStorage, context->instanceStackSize);
+    float * entries = ReserveStack(entryStorage, context->instanceStackSize);
+    int size = 0;
+
+    stack[size] = instance.rootNode;
+    entries[size++] = AABBIntersection(localRay, inverseDirection, octant, context->nodes[ instance.rootNode ]);
+
+    int32_t hitID = -1;
+
+    while ( size > 0 )  {
+
+        --size;
+
+        if( entries[size] >= minLength )
+            continue;
 
+        int nodeID = stack[size];
+
+        const BVHNode & node = context->nodes[ nodeID ];
+
+        if ( node.primitiveCount > 0 ) {
+
+            // Meshes hold only triangles, so nested instances never occur
+            int32_t meshInstanceID = -1;
+            int32_t objectID = IntersectLeaf(context, localRay, node.offset, node.primitiveCount, minLength, meshInstanceID);
+
+            if( objectID != -1 )
+                hitID = objectID;
+
+            continue;
+        }
+
+        int nearID = nodeID + 1;
+        int farID = node.offset;
+
+        float nearEntry = AABBIntersection(localRay, inverseDirection, octant, context->nodes[nearID]);
+        float farEntry = AABBIntersection(localRay, inverseDirection, octant, context->nodes[farID]);
+
+        if( farEntry < nearEntry ){
+            std::swap(nearID, farID);
+            std::swap(nearEntry, farEntry);
+        }
+
+        if( farEntry < minLength ){
+            stack[size] = farID;
+            entries[size++] = farEntry;
         }
+
+        if( nearEntry < minLength ){
+            stack[size] = nearID;
+            entries[size++] = nearEntry;
+        }
+
     }
 
-    if( sample.objectID  < 0 )
-        return sample;
+    return hitID;
+}
 
-    struct Object & object = context->objects[ sample.objectID ];
+float ThreadedShader::IntersectPackedTriangle(const Ray & ray, const TrianglePack & pack, const uint32_t & lane){
 
-    if ( object.type == SPHERE){
+    Vector3 A = Vector3(pack.vertexX[lane], pack.vertexY[lane], pack.vertexZ[lane]);
+    Vector3 e1 = Vector3(pack.firstEdgeX[lane], pack.firstEdgeY[lane], pack.firstEdgeZ[lane]);
+    Vector3 e2 = Vector3(pack.secondEdgeX[lane], pack.secondEdgeY[lane], pack.secondEdgeZ[lane]);
 
-        normal = ( sample.point - object.position).Normalize();
+    Vector3 normal = Vector3::CrossProduct(ray.direction, e2);
+    float det = Vector3::DotProduct(e1, normal);
 
-    }else if( object.type == TRIANGLE ){
+    if( fabs(det) < 1e-6f)
+        return -1.0f;
 
-        Vector3 & A = object.vertices[0];
-        Vector3 & B = object.vertices[1];
-        Vector3 & C = object.vertices[2];
+    float f = 1.0f/det;
+    Vector3 rayToTriangle = ray.origin - A;
+    float u = f * Vector3::DotProduct(rayToTriangle, normal);
 
-        Vector3 v0 = (B - A);
-        Vector3 v1 = (C - A);
-        Vector3 v2 = sample.point - A;
+    if( u < 0.0f || u >1.0f)
+        return -1.0f;
 
-        float dot00 = Vector3::DotProduct(v0, v0);
-        float dot01 = Vector3::DotProduct(v0, v1);
-        float dot02 = Vector3::DotProduct(v0, v2);
-        float dot11 = Vector3::DotProduct(v1, v1);
-        float dot12 = Vector3::DotProduct(v1, v2);
+    Vector3 q = Vector3::CrossProduct(rayToTriangle, e1);
+    float v = f * Vector3::DotProduct(ray.direction, q);
 
-        float invDenom = 1.0f / (dot00 * dot11 - dot01 * dot01);
-        float u = (dot11 * dot02 - dot01 * dot12) * invDenom;
-        float v = (dot00 * dot12 - dot01 * dot02) * invDenom;
-        float w = 1.0f - u - v;
+    if( v < 0.0f || (u+v) > 1.0f)
+        return -1.0f;
+
+    return f * Vector3::DotProduct(e2, q);
+}
+
+void ThreadedShader::IntersectTrianglePack(const Ray & ray, const TrianglePack & pack, float * lengths){
+
+    Lanes directionX = Packet::Set(ray.direction.x);
+    Lanes directionY = Packet::Set(ray.direction.y);
+    Lanes directionZ = Packet::Set(ray.direction.z);
+
+    Lanes zero = Packet::Set(0.0f);
+    Lanes one = Packet::Set(1.0f);
+
+    for(uint32_t offset = 0; offset < TRIANGLE_PACK_SIZE; offset += PACKET_SIZE){
+
+        Lanes e1X = Packet::Load(pack.firstEdgeX + offset);
+        Lanes e1Y = Packet::Load(pack.firstEdgeY + offset);
+        Lanes e1Z = Packet::Load(pack.firstEdgeZ + offset);
+
+        Lanes e2X = Packet::Load(pack.secondEdgeX + offset);
+        Lanes e2Y = Packet::Load(pack.secondEdgeY + offset);
+        Lanes e2Z = Packet::Load(pack.secondEdgeZ + offset);
+
+        Lanes normalX = Packet::Sub(Packet::Mul(directionY, e2Z), Packet::Mul(e2Y, directionZ));
+        Lanes normalY = Packet::Sub(Packet::Mul(directionZ, e2X), Packet::Mul(directionX, e2Z));
+        Lanes normalZ = Packet::Sub(Packet::Mul(directionX, e2Y), Packet::Mul(e2X, directionY));
+
+        Lanes det = Packet::Add(Packet::Mul(e1X, normalX), Packet::Add(Packet::Mul(e1Y, normalY), Packet::Mul(e1Z, normalZ)));
+        Lanes f = Packet::Div(one, det);
+
+        Lanes toTriangleX = Packet::Sub(Packet::Set(ray.origin.x), Packet::Load(pack.vertexX + offset));
+        Lanes toTriangleY = Packet::Sub(Packet::Set(ray.origin.y), Packet::Load(pack.vertexY + offset));
+        Lanes toTriangleZ = Packet::Sub(Packet::Set(ray.origin.z), Packet::Load(pack.vertexZ + offset));
+
+        Lanes u = Packet::Add(Packet::Mul(toTriangleX, normalX), Packet::Add(Packet::Mul(toTriangleY, normalY), Packet::Mul(toTriangleZ, normalZ)));
+        u = Packet::Mul(u, f);
+
+        Lanes qX = Packet::Sub(Packet::Mul(toTriangleY, e1Z), Packet::Mul(e1Y, toTriangleZ));
+        Lanes qY = Packet::Sub(Packet::Mul(toTriangleZ, e1X), Packet::Mul(toTriangleX, e1Z));
+        Lanes qZ = Packet::Sub(Packet::Mul(toTriangleX, e1Y), Packet::Mul(e1X, toTriangleY));
+
+        Lanes v = Packet::Add(Packet::Mul(directionX, qX), Packet::Add(Packet::Mul(directionY, qY), Packet::Mul(directionZ, qZ)));
+        v = Packet::Mul(v, f);
+
+        Lanes t = Packet::Add(Packet::Mul(e2X, qX), Packet::Add(Packet::Mul(e2Y, qY), Packet::Mul(e2Z, qZ)));
+        t = Packet::Mul(t, f);
+
+        Lanes valid = Packet::LessEqual(Packet::Set(1e-6f), Packet::Abs(det));
+        valid = Packet::And(valid, Packet::LessEqual(zero, u));
+        valid = Packet::And(valid, Packet::LessEqual(u, one));
+        valid = Packet::And(valid, Packet::LessEqual(zero, v));
+        valid = Packet::And(valid, Packet::LessEqual(Packet::Add(u, v), one));
+
+        Packet::Store(lengths + offset, Packet::Select(Packet::Set(-1.0f), t, valid));
+    }
+
+}
+
+int32_t ThreadedShader::AABBPacketIntersection(const RayPacket & packet, const BVHNode & node, const float * minLength, float * entries){
+
+    Lanes inverseX = Packet::Load(packet.inverseX);
+    Lanes inverseY = Packet::Load(packet.inverseY);
+    Lanes inverseZ = Packet::Load(packet.inverseZ);
+
+    Lanes originX = Packet::Load(packet.originX);
+    Lanes originY = Packet::Load(packet.originY);
+    Lanes originZ = Packet::Load(packet.originZ);
+
+    Lanes minX = Packet::Mul(Packet::Sub(Packet::Set(node.minimalPosition[0]), originX), inverseX);
+    Lanes minY = Packet::Mul(Packet::Sub(Packet::Set(node.minimalPosition[1]), originY), inverseY);
+    Lanes minZ = Packet::Mul(Packet::Sub(Packet::Set(node.minimalPosition[2]), originZ), inverseZ);
+
+    Lanes maxX = Packet::Mul(Packet::Sub(Packet::Set(node.maximalPosition[0]), originX), inverseX);
+    Lanes maxY = Packet::Mul(Packet::Sub(Packet::Set(node.maximalPosition[1]), originY), inverseY);
+    Lanes maxZ = Packet::Mul(Packet::Sub(Packet::Set(node.maximalPosition[2]), originZ), inverseZ);
+
+    Lanes tNear = Packet::Max(Packet::Min(minX, maxX), Packet::Max(Packet::Min(minY, maxY), Packet::Min(minZ, maxZ)));
+    Lanes tFar = Packet::Min(Packet::Max(minX, maxX), Packet::Min(Packet::Max(minY, maxY), Packet::Max(minZ, maxZ)));
+
+    Lanes hit = Packet::LessEqual(tNear, tFar);
+    hit = Packet::And(hit, Packet::Less(Packet::Set(0.0f), tFar));
+    hit = Packet::And(hit, Packet::Less(tNear, Packet::Load(minLength)));
+
+    Packet::Store(entries, tNear);
+
+    return Packet::Mask(hit);
+}
+
+void ThreadedShader::IntersectTrianglePacket(const RayPacket & packet, const TrianglePack & pack, const uint32_t & lane, float * lengths){
+
+    Vector3 A = Vector3(pack.vertexX[lane], pack.vertexY[lane], pack.vertexZ[lane]);
+    Vector3 e1 = Vector3(pack.firstEdgeX[lane], pack.firstEdgeY[lane], pack.firstEdgeZ[lane]);
+    Vector3 e2 = Vector3(pack.secondEdgeX[lane], pack.secondEdgeY[lane], pack.secondEdgeZ[lane]);
+
+    Lanes directionX = Packet::Load(packet.directionX);
+    Lanes directionY = Packet::Load(packet.directionY);
+    Lanes directionZ = Packet::Load(packet.directionZ);
+
+    Lanes e1X = Packet::Set(e1.x);
+    Lanes e1Y = Packet::Set(e1.y);
+    Lanes e1Z = Packet::Set(e1.z);
+
+    Lanes e2X = Packet::Set(e2.x);
+    Lanes e2Y = Packet::Set(e2.y);
+    Lanes e2Z = Packet::Set(e2.z);
+
+    Lanes normalX = Packet::Sub(Packet::Mul(directionY, e2Z), Packet::Mul(e2Y, directionZ));
+    Lanes normalY = Packet::Sub(Packet::Mul(directionZ, e2X), Packet::Mul(directionX, e2Z));
+    Lanes normalZ = Packet::Sub(Packet::Mul(directionX, e2Y), Packet::Mul(e2X, directionY));
+
+    Lanes det = Packet::Add(Packet::Mul(e1X, normalX), Packet::Add(Packet::Mul(e1Y, normalY), Packet::Mul(e1Z, normalZ)));
+    Lanes f = Packet::Div(Packet::Set(1.0f), det);
+
+    Lanes toTriangleX = Packet::Sub(Packet::Load(packet.originX), Packet::Set(A.x));
+    Lanes toTriangleY = Packet::Sub(Packet::Load(packet.originY), Packet::Set(A.y));
+    Lanes toTriangleZ = Packet::Sub(Packet::Load(packet.originZ), Packet::Set(A.z));
+
+    Lanes u = Packet::Add(Packet::Mul(toTriangleX, normalX), Packet::Add(Packet::Mul(toTriangleY, normalY), Packet::Mul(toTriangleZ, normalZ)));
+    u = Packet::Mul(u, f);
+
+    Lanes qX = Packet::Sub(Packet::Mul(toTriangleY, e1Z), Packet::Mul(e1Y, toTriangleZ));
+    Lanes qY = Packet::Sub(Packet::Mul(toTriangleZ, e1X), Packet::Mul(toTriangleX, e1Z));
+    Lanes qZ = Packet::Sub(Packet::Mul(toTriangleX, e1Y), Packet::Mul(e1X, toTriangleY));
+
+    Lanes v = Packet::Add(Packet::Mul(directionX, qX), Packet::Add(Packet::Mul(directionY, qY), Packet::Mul(directionZ, qZ)));
+    v = Packet::Mul(v, f);
+
+    Lanes t = Packet::Add(Packet::Mul(e2X, qX), Packet::Add(Packet::Mul(e2Y, qY), Packet::Mul(e2Z, qZ)));
+    t = Packet::Mul(t, f);
+
+    Lanes zero = Packet::Set(0.0f);
+    Lanes one = Packet::Set(1.0f);
+
+    Lanes valid = Packet::LessEqual(Packet::Set(1e-6f), Packet::Abs(det));
+    valid = Packet::And(valid, Packet::LessEqual(zero, u));
+    valid = Packet::And(valid, Packet::LessEqual(u, one));
+    valid = Packet::And(valid, Packet::LessEqual(zero, v));
+    valid = Packet::And(valid, Packet::LessEqual(Packet::Add(u, v), one));
+
+    Packet::Store(lengths, Packet::Select(Packet::Set(-1.0f), t, valid));
+}
+
+void ThreadedShader::TracePacket(RenderingContext * context, const RayPacket & packet, const int32_t & mask, Sample * samples, Vector3 * normals){
+
+    alignas(32) float minLength[PACKET_SIZE];
+    alignas(32) float lengths[PACKET_SIZE];
+    alignas(32) float entries[PACKET_SIZE];
+
+    for(int lane = 0; lane < PACKET_SIZE; ++lane){
+        minLength[lane] = INFINITY;
+        samples[lane] = {};
+        samples[lane].objectID = -1;
+        samples[lane].instanceID = -1;
+    }
+
+    thread_local std::vector<int> stackStorage;
+    thread_local std::vector<int32_t> maskStorage;
+
+    int * stack = ReserveStack(stackStorage, context->stackSize);
+    int32_t * masks = ReserveStack(maskStorage, context->stackSize);
+    int size = 0;
+
+    stack[size] = 0;
+    masks[size++] = mask;
+
+    while ( size > 0 ) {
+
+        --size;
+        int nodeID = stack[size];
+        int32_t activeMask = masks[size];
+
+        const BVHNode & node = context->nodes[ nodeID ];
+
+        if ( node.primitiveCount > 0 ) {
+
+            for(int32_t objectID = node.offset; objectID < node.offset + node.primitiveCount; ++objectID) {
+
+                const TrianglePack & pack = context->trianglePacks[ objectID / TRIANGLE_PACK_SIZE ];
+                uint32_t lane = objectID % TRIANGLE_PACK_SIZE;
+
+                if ( pack.type[lane] == TRIANGLE ){
+
+                    IntersectTrianglePacket(packet, pack, lane, lengths);
+
+                }else{
+
+                    const Object & object = context->objects[ objectID ];
+
+                    for(int lane = 0; lane < PACKET_SIZE; ++lane){
+
+                        if( (activeMask & (1 << lane)) == 0 )
+                            continue;
+
+                        Ray ray;
+                        ray.origin = Vector3(packet.originX[lane], packet.originY[lane], packet.originZ[lane]);
+                        ray.direction = Vector3(packet.directionX[lane], packet.directionY[lane], packet.directionZ[lane]);
+
+                        if( object.type != INSTANCE ){
+                            lengths[lane] = IntersectSphere(ray, object);
+                            continue;
+                        }
+
+                        // Instances are traversed ray by ray and record their hits directly
+                        lengths[lane] = INFINITY;
+
+                        int32_t meshObjectID = IntersectInstance(context, ray, object.instanceID, minLength[lane]);
+
+                        if( meshObjectID != -1 ){
+                            samples[lane].point = ray.origin + ray.direction * minLength[lane];
+                            samples[lane].objectID = meshObjectID;
+                            samples[lane].instanceID = object.instanceID;
+                        }
+                    }
+
+                }
+
+                for(int lane = 0; lane < PACKET_SIZE; ++lane){
+
+                    if( (activeMask & (1 << lane)) == 0 )
+                        continue;
+
+                    float length = lengths[lane];
+
+                    if( (length < minLength[lane]) && (length > 0.01f) ){
+
+                        minLength[lane] = length;
+                        samples[lane].point = Vector3(packet.originX[lane], packet.originY[lane], packet.originZ[lane]) + Vector3(packet.directionX[lane], packet.directionY[lane], packet.directionZ[lane]) * length;
+                        samples[lane].objectID = objectID;
+                        samples[lane].instanceID = -1;
+
+                    }
+
+                }
+
+            }
+
+            continue;
+        }
+
+        int children[2] = {nodeID + 1, node.offset};
+        int32_t hitMasks[2] = {0, 0};
+        float nearestEntries[2] = {INFINITY, INFINITY};
+
+        for(int child = 0; child < 2; ++child){
+
+            hitMasks[child] = AABBPacketIntersection(packet, context->nodes[ children[child] ], minLength, entries) & activeMask;
+
+            for(int lane = 0; lane < PACKET_SIZE; ++lane){
+
+                if( hitMasks[child] & (1 << lane) )
+                    nearestEntries[child] = fmin(nearestEntries[child], entries[lane]);
+
+            }
+
+        }
+
+        int nearChild = nearestEntries[1] < nearestEntries[0];
+        int farChild = 1 - nearChild;
+
+        if( hitMasks[farChild] ){
+            stack[size] = children[farChild];
+            masks[size++] = hitMasks[farChild];
+        }
+
+        if( hitMasks[nearChild] ){
+            stack[size] = children[nearChild];
+            masks[size++] = hitMasks[nearChild];
+        }
+
+    }
+
+    for(int lane = 0; lane < PACKET_SIZE; ++lane){
+
+        if( (mask & (1 << lane)) && samples[lane].objectID >= 0 )
+            CalculateNormal(context, samples[lane], normals[lane]);
 
-        normal = (object.normals[0] * w + object.normals[1] * u + object.normals[2] * v).Normalize();
     }
 
-    return sample;
 }
 
 ThreadedShader::~ThreadedShader(){
-    delete[] threads;
+    if( ownsPool )
+        delete pool;
+    delete[] queues;
+    delete states;
 }
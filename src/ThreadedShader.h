@@ -3,12 +3,18 @@
 
 #include "ComputeShader.h"
 #include "RenderingContext.h"
-#include "Random.h"
+#include "ThreadPool.h"
+#include "RayPacket.h"
+#include "Sampler.h"
 #include "Sample.h"
 #include "Ray.h"
 
 #include <stack>
-#include <thread>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <stdio.h>
 #include <vector>
 #include <cmath>
@@ -20,22 +26,71 @@
 #endif
 
 #define EPSILON 1.0000001f
-#define STACK_SIZE 32
+#define RECIPROCAL_EPSILON 1e-8f
 #define INPUT_IOR 1.0f
+#define WAVEFRONT_BATCH 256
+
+struct WideEntry{
+    int32_t index;
+    int32_t primitiveCount;
+    float entry;
+};
+
+struct Tile{
+    uint32_t startX;
+    uint32_t startY;
+    uint32_t endX;
+    uint32_t endY;
+};
+
+struct TileQueue{
+    std::mutex lock;
+    std::deque<uint32_t> tiles;
+};
+
+struct PathStates{
+    std::vector<Ray> rays;
+    std::vector<Sample> samples;
+    std::vector<Vector3> normals;
+    std::vector<Color> lightSamples;
+    std::vector<Color> accumulators;
+    std::vector<float> emissionWeights;
+    std::vector<Sampler> samplers;
+
+    std::vector<uint32_t> activePaths;
+    std::vector<uint32_t> survivingPaths;
+    std::atomic<uint32_t> numSurviving;
+};
+
+using Batch = std::function<void(const uint32_t & begin, const uint32_t & end)>;
 
 class ThreadedShader : public ComputeShader{
 private:
 
     unsigned int numThreads;
-    int rowsPerThread;
+
+    std::vector<Tile> tiles;
+    TileQueue * queues;
 
     Sample ( * traverse )(RenderingContext * context, const Ray & ray, Vector3 & normal);
 
-    std::thread * threads;
+    bool ( * occluded )(RenderingContext * context, const Ray & ray, const float & maxLength);
+
+    ThreadPool * pool;
 
-    static bool AABBIntersection(const Ray & ray, const Vector3 & minimalPosition , const Vector3 & maximalPosition);
+    bool ownsPool;
 
-    Vector3 DiffuseReflect(const struct Vector3& normal, unsigned int& seed);
+    bool usePackets;
+
+    PathStates * states;
+
+    std::vector<PixelStatistics> statistics;
+
+    static Vector3 InverseDirection(const Vector3 & direction);
+
+    static float AABBIntersection(const Ray & ray, const Vector3 & inverseDirection, const int32_t * octant, const BVHNode & node);
+
+    Vector3 DiffuseReflect(const struct Vector3& normal, Sampler & sampler);
 
     Vector3 Reflect(const Vector3& incident, const Vector3& normal);
 
@@ -47,15 +102,86 @@ private:
 
     static Sample BVHTraverse(RenderingContext * context, const Ray & ray, Vector3 & normal);
 
-    static float IntersectTriangle(const Ray & ray, const Object & object, float & u, float & v);
+    static bool LinearOcclusion(RenderingContext * context, const Ray & ray, const float & maxLength);
+
+    static bool BVHOcclusion(RenderingContext * context, const Ray & ray, const float & maxLength);
+
+    static float IntersectPackedTriangle(const Ray & ray, const TrianglePack & pack, const uint32_t & lane);
+
+    static void IntersectTrianglePack(const Ray & ray, const TrianglePack & pack, float * lengths);
+
+    /// @brief Intersects objects of a leaf, closer than minLength
+    /// @param instanceID receives instance of the hit mesh triangle, -1 for objects of the world
+    /// @return index of the closest hit object, -1 when none was hit
+    static int32_t IntersectLeaf(RenderingContext * context, const Ray & ray, const int32_t & first, const int32_t & count, float & minLength, int32_t & instanceID);
+
+    /// @brief Moves ray into space of instance and traverses tree of its mesh
+    /// @return index of the closest hit mesh triangle, -1 when none was hit
+    static int32_t IntersectInstance(RenderingContext * context, const Ray & ray, const int32_t & instanceID, float & minLength);
+
+    /// @brief Tests ray against boxes of all children of a wide node at once
+    /// @param origin ray origin broadcast to all lanes, one register per axis
+    /// @param inverse inverse ray direction broadcast to all lanes
+    /// @param entries receives entry distance of every child
+    /// @return mask of children entered closer than maxLength
+    static int32_t WideNodeIntersection(const Lanes * origin, const Lanes * inverse, const int32_t * octant, const WideNode & node, const float & maxLength, float * entries);
+
+    /// @brief Decodes child boxes of quantized node and tests them in SIMD sized groups
+    /// @return mask of children entered closer than maxLength
+    static int32_t WideNodeIntersection(const Lanes * origin, const Lanes * inverse, const int32_t * octant, const QuantizedNode & node, const float & maxLength, float * entries);
+
+    /// @brief Returns collapsed nodes of given type
+    template<typename Node>
+    static const std::vector<Node> & GetWideNodes(RenderingContext * context);
+
+    template<typename Node>
+    static Sample WideTraverse(RenderingContext * context, const Ray & ray, Vector3 & normal);
+
+    template<typename Node>
+    static bool WideOcclusion(RenderingContext * context, const Ray & ray, const float & maxLength);
+
+    static int32_t AABBPacketIntersection(const RayPacket & packet, const BVHNode & node, const float * minLength, float * entries);
+
+    static void IntersectTrianglePacket(const RayPacket & packet, const TrianglePack & pack, const uint32_t & lane, float * lengths);
+
+    static void TracePacket(RenderingContext * context, const RayPacket & packet, const int32_t & mask, Sample * samples, Vector3 * normals);
+
+    static void CalculateNormal(RenderingContext * context, const Sample & sample, Vector3 & normal);
 
     static float IntersectSphere(const Ray &ray, const Object &object);
 
-    Vector3 RandomDirection(unsigned int& seed);
+    void PackTriangles();
+
+    /// @brief Copies triangle of object into its lane of triangle packs
+    void PackObject(const uint32_t & id);
+
+    Vector3 RandomDirection(Sampler & sampler);
+
+    Color SampleLight(const Vector3 & point, const Vector3 & normal, Sampler & sampler);
+
+    Color ComputeColor(Ray & ray, const Sample & sample, Color & lightSample, float & emissionWeight, Sampler & sampler, const Vector3 & normal);
+
+    Ray PrimaryRay(const int & x, const int & y, Sampler & sampler);
+
+    bool ShadeSample(Ray & ray, const Sample & sample, const Vector3 & normal, Color & lightSample, float & emissionWeight, Color & accumulator, Sampler & sampler, const uint32_t & depth);
+
+    Color TracePath(Ray & ray, const Sample & primarySample, const Vector3 & primaryNormal, Sampler & sampler);
+
+    void AccumulateSample(Color * pixels, const uint32_t & index, const Color & colorSample);
+
+    void ComputeTile(const Tile & tile, Color * pixels);
+
+    void ComputePacketTile(const Tile & tile, Color * pixels);
+
+    bool PopTile(const uint32_t & threadID, uint32_t & tileID);
+
+    bool StealTile(const uint32_t & threadID, uint32_t & tileID);
+
+    void ComputeTiles(const uint32_t & threadID, Color * pixels);
 
-    Color ComputeColor(Ray & ray, const Sample & sample, Color & lightSample, unsigned int& seed, const Vector3 & normal);
+    void ForEachBatch(const uint32_t & count, const Batch & batch);
 
-    void ComputeRows(const int& _startY, const int& _endY, Color * pixels);
+    void RenderWavefront(Color * _pixels);
 
 public:
 
@@ -0,0 +1,26 @@
+#ifndef TRIANGLEPACK_H
+#define TRIANGLEPACK_H
+
+#define TRIANGLE_PACK_SIZE 8
+
+#include <stdint.h>
+
+// Triangles of eight consecutive objects, object i is stored in pack i/8 at lane i%8.
+// Lanes of non triangle objects have zero edges and never report a hit.
+struct TrianglePack{
+    int32_t type[TRIANGLE_PACK_SIZE];
+
+    float vertexX[TRIANGLE_PACK_SIZE];
+    float vertexY[TRIANGLE_PACK_SIZE];
+    float vertexZ[TRIANGLE_PACK_SIZE];
+
+    float firstEdgeX[TRIANGLE_PACK_SIZE];
+    float firstEdgeY[TRIANGLE_PACK_SIZE];
+    float firstEdgeZ[TRIANGLE_PACK_SIZE];
+
+    float secondEdgeX[TRIANGLE_PACK_SIZE];
+    float secondEdgeY[TRIANGLE_PACK_SIZE];
+    float secondEdgeZ[TRIANGLE_PACK_SIZE];
+} __attribute((aligned(32)));
+
+#endif
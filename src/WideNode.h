@@ -0,0 +1,40 @@
+#ifndef WIDENODE_H
+#define WIDENODE_H
+
+#include "RayPacket.h"
+
+#include <cmath>
+#include <stdint.h>
+
+// Node is as wide as SIMD register, so all child boxes are tested at once
+#define WIDE_NODE_WIDTH PACKET_SIZE
+
+// Node of collapsed BVH storing bounds of its children in structure of arrays form.
+// Unused slots have inverted bounds and are never hit.
+struct WideNode{
+    float minimalX[WIDE_NODE_WIDTH];
+    float minimalY[WIDE_NODE_WIDTH];
+    float minimalZ[WIDE_NODE_WIDTH];
+
+    float maximalX[WIDE_NODE_WIDTH];
+    float maximalY[WIDE_NODE_WIDTH];
+    float maximalZ[WIDE_NODE_WIDTH];
+
+    // Leaf child: first object of its range, inner child: index of wide node
+    int32_t children[WIDE_NODE_WIDTH];
+
+    // Number of objects in leaf child, zero for inner children
+    int32_t primitiveCounts[WIDE_NODE_WIDTH];
+
+    WideNode(){
+        for(int32_t slot = 0; slot < WIDE_NODE_WIDTH; ++slot){
+            minimalX[slot] = minimalY[slot] = minimalZ[slot] = INFINITY;
+            maximalX[slot] = maximalY[slot] = maximalZ[slot] = -INFINITY;
+            children[slot] = -1;
+            primitiveCounts[slot] = 0;
+        }
+    }
+
+} __attribute((aligned(32)));
+
+#endif